@@ -4,19 +4,38 @@
 
 #include <__expected/unexpected.h>
 #include <algorithm>
+#include <atomic>
+#include <bit>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <ios>
 #include <iostream>
 #include <limits>
 #include <map>
+#include <memory>
 #include <ostream>
+#include <set>
+#include <sstream>
+#include <span>
 #include <stack>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <utility>
 #include <variant>
 
+#include <poll.h>
+#include <sys/inotify.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace sfs = std::filesystem;
 
 /*** Declarations ************************************************************/
@@ -29,40 +48,127 @@ public:
     const size_t line;
 };
 
+// Stream for error and verbose messages of assembling a program, each thread assembling a program in batch mode
+// uses its own buffer
+thread_local std::ostream* diag = &std::cerr;
+
 // All input files
 class input {
 public:
-    using text_t = std::vector<std::string>; // lines of a file
-    using text_span = std::span<const std::string>; // read-only refence to an interval of lines
+    using text_t = std::vector<std::string_view>; // lines of a file, pointing to file_t::source
+    using text_span = std::span<const std::string_view>; // read-only refence to an interval of lines
+    // a line split by assembler::split()
+    struct line_t {
+        std::string_view label;
+        std::string_view cmd;
+        std::vector<std::string_view> args;
+    };
+    // $use directive found by scan()
+    struct use_t {
+        size_t line;
+        std::string error; // nonempty if the directive is invalid
+        std::string name_space;
+        std::string_view file;
+    };
+    // the result of scan()
+    struct scan_t {
+        std::unique_ptr<const mapped_file> source;
+        text_t full_text;
+        text_t text;
+        std::vector<line_t> split;
+        std::vector<use_t> uses;
+        uint64_t hash; // of source, 0 if not using the cache
+        bool cached; // loaded from the parse cache
+    };
     struct file_t;
     using files_t = std::map<sfs::path, file_t>; // keys are absolute paths
     using name_spaces_t = std::map<std::string, files_t::const_iterator>;
     struct file_t {
         sfs::path orig_path; // from $use directive
+        std::unique_ptr<const mapped_file> source; // the contents of the file
         text_t full_text; // original, with comments, without trailing whitespace
         text_t text; // without comments and trailing whitespace
+        std::vector<line_t> split; // text split to label, command, and arguments
+        uint64_t hash; // of source, 0 if not using the cache
         name_spaces_t name_spaces; // of files included by $use
         bool processed;
+        std::future<scan_t> scan; // running in parallel with scanning other files, until read() gets the result
     };
-    input(sfs::path file, bool verbose);
-    [[nodiscard]] std::pair<const files_t&, files_t::const_iterator> files() const {
-        return {_files, _top_file};
-    }
+    // Reads top level files and all files included by them; parsed files are cached in cache_dir, unless it is
+    // empty; files found in reuse are not read again
+    input(std::span<const sfs::path> top_files, sfs::path cache_dir, bool verbose, files_t reuse = {});
+    [[nodiscard]] const files_t& files() const { return _files; }
+    // Distinct top level files in the order of the constructor argument
+    [[nodiscard]] const std::vector<files_t::const_iterator>& top_files() const { return _top_files; }
+    // Moves out successfully read files, except changed ones, for the next input; this object becomes empty
+    files_t reusable(const std::set<sfs::path>& changed);
+    [[nodiscard]] const sfs::path& cache_dir() const { return _cache_dir; }
 private:
-    // Adds a file by $use on line in already read file from (files.end() if adding a top level file)
+    // Adds a file by $use on line in already read file from (_files.end() if adding a top level file)
     files_t::iterator add_file(files_t::iterator from, size_t line, sfs::path relative, const std::string& name_space);
-    // Read a file unless already processed
+    // Reads a file, splits it to lines, removes comments, and splits lines to parts, or loads the result from the
+    // cache; it does not use any shared state, therefore files are scanned in parallel
+    static scan_t scan(const sfs::path& file, const sfs::path& cache_dir);
+    // Gets $use directives from split lines
+    static std::vector<use_t> find_uses(const std::vector<line_t>& split);
+    // Processes a scanned file unless already processed
     std::vector<files_t::iterator> read(files_t::iterator it);
     files_t _files;
-    files_t::const_iterator _top_file;
+    std::vector<files_t::const_iterator> _top_files;
+    files_t _reuse; // used by the constructor
+    sfs::path _cache_dir;
     bool verbose;
 };
 
 // Output files
 class output {
 public:
-    // Construct output file names from input file name
-    output(sfs::path file, bool verbose);
+    struct location_t {
+        const sfs::path* file; // points to a key of input::files_t
+        size_t line;
+    };
+    struct dbg_line_t {
+        uint16_t addr;
+        uint16_t size;
+        uint16_t level;
+        location_t loc;
+    };
+    // An annotation of the instruction or data at an address, used by cost_analysis
+    struct annotation_t {
+        enum class kind_t: uint8_t {
+            loop_bound, // $loop_bound, value is the maximum number of executions per entering the loop
+            target, // $targets, value is a target of an indirect jump or call, or a value of a code pointer
+            intr_deadline, // $intr_deadline, value is the frequency of interrupts served by the handler
+        };
+        kind_t kind;
+        uint16_t addr;
+        uint16_t value;
+        location_t loc; // of the directive
+    };
+    // A position in the output, see segment()
+    struct mark_t {
+        size_t text;
+        size_t dbg;
+        size_t annotations;
+    };
+    // Output added after a mark, and the state for continuing the output, used by prelude snapshots
+    struct segment_t {
+        struct text_line_t {
+            std::string text;
+            std::optional<uint16_t> addr; // of bytes, nullopt if not a line of $data_b
+            std::vector<uint8_t> bytes;
+            std::optional<uint16_t> instr; // of an instruction, nullopt if not a line of an instruction
+        };
+        std::vector<text_line_t> text;
+        std::vector<dbg_line_t> dbg_lines;
+        std::vector<annotation_t> annotations;
+        sfs::path last_file;
+        size_t last_line;
+        std::vector<location_t> locations;
+    };
+    // Construct output file names from input file name; if keep_unchanged, files with unchanged contents are not
+    // written
+    output(sfs::path file, bool verbose, bool keep_unchanged = false);
     // Stores binary data for all output files, and an optional instruction for the text output file
     void add_bytes(uint16_t addr, std::span<uint8_t> bytes, std::string_view instr, std::string_view prefix);
     // Stores a source line for text output file
@@ -70,65 +176,305 @@ public:
                       std::string_view macro_prefix);
     void add_src_location(const sfs::path& file, size_t line, std::string_view prefix, std::string_view macro_prefix);
     void add_txt_line(std::string_view text, std::string_view prefix);
+    // Sets the source line for debug information of subsequently added bytes at a macro nesting level
+    void set_location(const sfs::path& file, size_t line, size_t level);
+    // Stores a label or a constant for debug information
+    void add_symbol(std::string name, uint16_t value, bool label);
+    // Stores an annotation at the current source location
+    void add_annotation(annotation_t::kind_t kind, uint16_t addr, uint16_t value);
     void set_byte(uint16_t addr, uint8_t byte);
     void set_word(uint16_t addr, uint16_t word);
-    // Writes all output files
+    [[nodiscard]] uint16_t word(uint16_t addr) const;
+    [[nodiscard]] mark_t mark() const {
+        return {.text = out_text.size(), .dbg = dbg_lines.size(), .annotations = annotations.size()};
+    }
+    // Gets the output added since a mark
+    [[nodiscard]] segment_t segment(mark_t since) const;
+    // Adds output and restores the state saved by segment()
+    void append(const segment_t& seg);
+    // Writes all output files of a program
     void write();
+    // Writes a relocatable object file instead of the output files of a program
+    void write_object(std::string_view data);
     size_t last_line = 0;
 private:
     struct out_line_t {
         std::string text{};
         std::span<uint8_t> bytes{};
+        std::optional<uint16_t> instr{}; // the address of an instruction described by this line
+    };
+    struct dbg_symbol_t {
+        std::string name;
+        uint16_t value;
+        bool label;
     };
+    // Copies bytes to the address space
+    std::span<uint8_t> store_bytes(uint16_t addr, std::span<const uint8_t> bytes);
+    void write_debug_info(const sfs::path& out_file);
+    // Generates the table of sizes and cycles of code labels and the worst cases of interrupt handlers for the text
+    // output, and warns about interrupt handlers that can miss their deadlines
+    std::string cost_table() const;
+    // Writes data to a file, kind is used in error messages
+    void write_file(const sfs::path& out_file, std::string_view kind, std::string_view data);
     sfs::path file{}; // the input file name
     sfs::path last_file{};
     std::vector<out_line_t> out_text{};
     std::array<uint8_t, 0x10000> out_bin{}; // The full address space
     size_t start_addr = 0x10000; // Write part of the address space starting from this address
     size_t end_addr = 0x0000; // One after the last byte written
+    std::vector<location_t> locations{}; // indexed by macro nesting level
+    std::vector<dbg_line_t> dbg_lines{};
+    std::vector<dbg_symbol_t> dbg_symbols{};
+    std::vector<annotation_t> annotations{};
     bool verbose = false;
+    bool keep_unchanged = false;
+};
+
+// Static analysis of execution time of a program, in clock cycles of the instructions
+class cost_analysis {
+public:
+    // The worst case of execution starting at an instruction
+    struct cost_t {
+        uint64_t cycles = 0; // the maximum sum of cycles of executed instructions
+        bool loops = false; // a loop without a bound or a recursion is counted only once
+        bool unknown = false; // a jump or call with an unknown target, its cycles after the jump are not counted
+    };
+    // bin is the address space, code contains the addresses of instructions
+    cost_analysis(std::span<const uint8_t, 0x10000> bin, std::vector<bool> code,
+                  std::span<const output::annotation_t> annotations);
+    // Whether there is an instruction at an address
+    [[nodiscard]] bool code(uint16_t addr) const { return _code[addr]; }
+    // The sum of cycles of the instructions in [begin, end), each executed once
+    [[nodiscard]] uint64_t cycles(uint16_t begin, size_t end) const;
+    // The worst case of acyclic paths from the instruction at addr until a return from a subroutine or from an
+    // interrupt handler, or a halt; a call of a subroutine with a known address adds the worst case of the
+    // subroutine, and a loop with a bound adds the worst case of all its iterations
+    cost_t worst(uint16_t addr) { return path(addr, no_target).value_or(cost_t{}); }
+    // The cycles of an instruction, for the text output
+    static std::string cycles_str(const isa::instr_t& instr);
+private:
+    // The target of path() at the end of execution
+    static constexpr uint32_t no_target = 0x10000;
+    // The next instruction of an edge that ends execution
+    static constexpr uint32_t no_next = 0x10000;
+    // The result of path() and its state
+    struct memo_t {
+        bool done = false; // false while being computed
+        size_t depth = 0; // the depth in the stack of queries while being computed
+        std::optional<cost_t> cost{};
+        // Depths of queries being computed, whose back edges cut the paths counted by the result, the result is
+        // removed when the deepest of them is done; empty if the result is valid for any query
+        std::set<size_t> open{};
+    };
+    // A possible continuation of execution after an instruction
+    struct edge_t {
+        uint64_t cycles = 0; // the cycles of the instruction
+        uint32_t next = no_next; // the next instruction
+        bool unknown = false; // a call with an unknown target, or execution ending by a jump to an unknown target
+        std::optional<uint16_t> call{}; // a subroutine called before continuing by next
+    };
+    // A query of path() being computed, each edge is followed by querying the called subroutine and then next
+    struct frame_t {
+        enum class wait_t {
+            none, // the edge has not been started
+            call, // waiting for the result of the call, or the call has been computed
+            next, // waiting for the result of next
+        };
+        uint64_t key;
+        uint16_t addr;
+        uint32_t target; // addr while computing an iteration of a loop with a bound
+        std::vector<edge_t> edges;
+        size_t edge = 0; // the edge being followed
+        wait_t wait = wait_t::none;
+        std::optional<cost_t> call{}; // the worst case of the subroutine called by the edge
+        std::optional<cost_t> result{}; // the worst case of the edges followed so far
+        std::optional<cost_t> first{}; // the result without iterations while computing an iteration
+        std::set<size_t> open{}; // memo_t::open of the result
+    };
+    // The worst case of paths from the instruction at addr until reaching target, or until the end of execution if
+    // target is no_target; nullopt if there is no such path. It uses an explicit stack, because the depth of nested
+    // queries grows with the size of the program.
+    std::optional<cost_t> path(uint16_t addr, uint32_t target);
+    // The continuations of execution after the instruction at addr
+    [[nodiscard]] std::vector<edge_t> edges(uint16_t addr) const;
+    [[nodiscard]] uint16_t word(uint16_t addr) const {
+        return uint16_t(bin[addr] + 256U * bin[uint16_t(addr + 1)]);
+    }
+    // Whether the instruction before addr sets a register to a constant, which is the word before addr
+    [[nodiscard]] bool set_by_previous(uint8_t reg, uint16_t addr) const {
+        return addr >= 4 && _code[addr - 4] && bin[addr - 4] == isa::opcode("ldis") &&
+            bin[addr - 3] == uint8_t(reg << 4U | isa::reg_pc);
+    }
+    std::span<const uint8_t, 0x10000> bin;
+    std::vector<bool> _code;
+    std::map<uint16_t, uint16_t> loop_bounds{};
+    std::multimap<uint16_t, uint16_t> targets{};
+    std::map<uint64_t, memo_t> memo{}; // results of path(), indexed by target * 0x10000 + addr
+};
+
+// Identifier interned in a name_pool
+using name_id_t = uint32_t;
+
+// Pool of interned identifiers, each distinct name gets a stable small integer ID
+class name_pool {
+public:
+    name_id_t intern(std::string_view name);
+    // nullopt if the name has not been interned yet
+    [[nodiscard]] std::optional<name_id_t> find(std::string_view name) const;
+    [[nodiscard]] const std::string& name(name_id_t id) const {
+        return names[id];
+    }
+    [[nodiscard]] size_t size() const { return names.size(); }
+private:
+    static constexpr name_id_t empty = std::numeric_limits<name_id_t>::max();
+    // index of the slot containing name or of the empty slot where name belongs
+    [[nodiscard]] size_t slot(std::string_view name) const;
+    std::deque<std::string> names{}; // indexed by ID, elements do not move
+    std::vector<name_id_t> slots{}; // open addressing with linear probing, the size is a power of 2
+};
+
+// Hash table with open addressing keyed by interned identifiers, iterated in the order of insertion
+template<class T> class id_table {
+public:
+    using value_type = std::pair<name_id_t, T>;
+    id_table() = default;
+    id_table(name_pool& names, std::initializer_list<std::pair<std::string_view, T>> init) {
+        for (auto&& v: init)
+            emplace(names.intern(v.first), v.second);
+    }
+    T* find(name_id_t id) {
+        auto i = index(id);
+        return i ? &entries[*i].second : nullptr;
+    }
+    const T* find(name_id_t id) const {
+        auto i = index(id);
+        return i ? &entries[*i].second : nullptr;
+    }
+    [[nodiscard]] bool contains(name_id_t id) const {
+        return index(id).has_value();
+    }
+    // like std::map::emplace(), the returned pointer is valid until the next insertion
+    std::pair<value_type*, bool> emplace(name_id_t id, T value) {
+        if (auto i = index(id))
+            return {&entries[*i], false};
+        if (2 * (entries.size() + 1) > slots.size()) {
+            slots.assign(std::max(size_t{16}, 2 * slots.size()), 0);
+            for (size_t i = 0; i < entries.size(); ++i)
+                slots[slot(entries[i].first)] = uint32_t(i + 1);
+        }
+        entries.emplace_back(id, std::move(value));
+        slots[slot(id)] = uint32_t(entries.size());
+        return {&entries.back(), true};
+    }
+    auto begin() { return entries.begin(); }
+    auto end() { return entries.end(); }
+    [[nodiscard]] auto begin() const { return entries.begin(); }
+    [[nodiscard]] auto end() const { return entries.end(); }
+private:
+    // index of the slot containing id or of the empty slot where id belongs
+    [[nodiscard]] size_t slot(name_id_t id) const {
+        size_t mask = slots.size() - 1;
+        for (size_t i = uint32_t(id * 0x9e3779b1U) & mask;; i = (i + 1) & mask)
+            if (slots[i] == 0 || entries[slots[i] - 1].first == id)
+                return i;
+    }
+    [[nodiscard]] std::optional<size_t> index(name_id_t id) const {
+        if (slots.empty())
+            return std::nullopt;
+        if (auto i = slots[slot(id)]; i != 0)
+            return i - 1;
+        return std::nullopt;
+    }
+    std::vector<value_type> entries{};
+    std::vector<uint32_t> slots{}; // 0 = empty, otherwise index + 1 to entries; the size is a power of 2
 };
 
 // Assembler
 class assembler {
 public:
-    struct line_t {
-        std::string_view label;
-        std::string_view cmd;
-        std::vector<std::string_view> args;
+    using line_t = input::line_t;
+    // An instruction or a data directive generated by the assembler, recorded for the peephole optimizer
+    struct item_t {
+        input::files_t::const_iterator module; // the file run by $use or the top level file containing the item
+        uint16_t addr;
+        uint16_t size;
+        const isa::instr_t* instr; // nullptr for data
+        uint8_t regs; // registers of an instruction
+        bool words; // data: generated by $data_w
+        bool fixed; // data: the value does not depend on any address
+    };
+    // An item removed or replaced by the optimizer
+    struct change_t {
+        item_t item; // the original item
+        const isa::instr_t* instr = nullptr; // the replacement instruction, nullptr if the item is removed
+        uint8_t regs = 0; // registers of the replacement instruction
+        // a data word: the index of the item whose address replaces the value, nullopt if the item is removed
+        std::optional<size_t> target{};
+        [[nodiscard]] bool removes() const { return item.instr ? !instr : !target; }
     };
-    assembler(input& in, output& out, bool verbose);
+    // Changes by the optimizer, indexed by the order of generation of items, which does not depend on the changes
+    using changes_t = std::map<size_t, change_t>;
+    // If relocatable, the top level file is assembled to a relocatable object, see write_object(); if optimize,
+    // items are recorded for peephole() and generated with changes applied
+    assembler(const input& in, input::files_t::const_iterator top, output& out, bool verbose, bool relocatable,
+              bool optimize = false, changes_t changes = {});
     void run();
-    static std::string remove_comment(std::string_view line);
+    // Writes the result of run() as a relocatable object
+    void write_object();
+    // Finds instructions that can be removed or replaced by shorter ones, and jumps that can be redirected, in the
+    // result of run(); returns the changes of this run extended by the newly found ones, the program must be
+    // assembled again with them
+    [[nodiscard]] changes_t peephole() const;
+    // Writes the bytes and cycles saved by the changes, per module
+    void report() const;
+    // Returns a prefix of line, or an empty string if the prefix contains only whitespace
+    static std::string_view remove_comment(std::string_view line);
     // Expects a line without comment
     static line_t split(std::string_view line);
+    // Returns the index of the first character significant for remove_comment() or split() in s at or after pos,
+    // or s.size() if there is no such character
+    static size_t scan_special(std::string_view s, size_t pos);
 private:
-    class expr_base;
-    class expr_number;
-    class expr_const;
-    class expr_label;
-    class expr_bytes;
-    class expr_reg;
-    class expr_addr;
-    class expr_binop;
-    class expr_unop;
-    class expr_or;
-    class expr_xor;
-    class expr_and;
-    class expr_shl;
-    class expr_shr;
-    class expr_add;
-    class expr_sub;
-    class expr_mul;
-    class expr_div;
-    class expr_rem;
-    class expr_not;
-    class expr_neg;
+    class label_t;
+    // operation of an expression node
+    enum class expr_op: uint8_t {
+        constant, // a number
+        label, // the value of a label
+        addr, // the current address
+        reg, // a register selector for an instruction
+        bytes, // a constant sequence of bytes
+        bit_or,
+        bit_xor,
+        bit_and,
+        shl,
+        shr,
+        add,
+        sub,
+        mul,
+        div,
+        rem,
+        bit_not,
+        neg,
+    };
+    // expression node, expressions are stored flattened in postfix order in expr_nodes
+    struct expr_node_t {
+        expr_op op;
+        bool csr = false; // reg: false = normal register, true = CSR
+        bool addr = false; // constant: computed from an address (a label or __addr)
+        uint16_t value = 0; // constant: the value; reg: the register index; bytes: the number of bytes
+        uint32_t bytes = 0; // bytes: index of the first byte in expr_bytes
+        const label_t* label = nullptr; // label: the label
+    };
+    // expression consisting of nodes expr_nodes[begin]...expr_nodes[begin + size - 1], the last one is the root
+    struct expr_t {
+        uint32_t begin;
+        uint32_t size;
+    };
     // second phase of expression evaluation
     struct phase2_t {
         const sfs::path& path; // file containing the expression
         size_t line; // line containing the expression
-        std::shared_ptr<expr_base> expr; // evaluate this expression
+        expr_t expr; // evaluate this expression
         uint16_t addr; // store value here
         bool word; // false = byte, true = word
     };
@@ -160,52 +506,96 @@ private:
     };
     // expression that must be always evaluated
     struct var_t {
-        std::shared_ptr<expr_base> expr;
+        expr_t expr;
     };
     // macro definition
     struct macro_t {
-        std::vector<std::string> params; // names of parameters of this macro
+        std::vector<name_id_t> params; // names of parameters of this macro
         input::files_t::const_iterator file; // file containing the macro definition
         input::text_span full_replace; // replacement text: original, with comments, without trailing whitespace
         input::text_span replace; // replacement text: without comments and trailing whitespace
+        std::span<const line_t> split_replace; // lines of replace split by split()
         size_t order; // ordering of macro definitions
     };
     using symbol_t = std::variant<label_t, var_t, macro_t>;
-    using symbol_table_t = std::map<std::string, std::shared_ptr<symbol_t>>;
-    using global_symbol_table_t = std::map<std::string, std::shared_ptr<symbol_t>>;
-    using macro_args_t = std::map<std::string, std::shared_ptr<expr_base>>;
-    using parse_expr_t = std::expected<std::shared_ptr<expr_base>, std::string>;
+    using symbol_table_t = id_table<std::shared_ptr<symbol_t>>;
+    using global_symbol_table_t = id_table<std::shared_ptr<symbol_t>>;
+    using macro_args_t = id_table<expr_t>;
+    using parse_expr_t = std::expected<expr_t, std::string>;
     using parse_fun_t =
         std::pair<assembler::parse_expr_t, std::string_view> (assembler::*)(std::string_view,
                                                                             input::files_t::const_iterator,
                                                                             macro_args_t*,
                                                                             parser::id_macro_t);
-    struct instruction_t {
-        uint8_t opcode = 0x00; // the first (lower) byte of the instruction
-        bool dst_csr = false; // destination is CSR
-        bool src_csr = false; // source is CSR
+    // $use lines at the start of the top level file, see run_prelude()
+    struct prelude_t {
+        // output of a file run by $use in the prelude
+        struct segment_t {
+            input::files_t::const_iterator file;
+            output::segment_t out;
+        };
+        // snapshot keys of the prefixes of the prelude, keys[i] identifies the state after $use lines 0...i
+        std::vector<uint64_t> keys;
+        size_t replay; // the number of $use lines restored from a snapshot, their segments are used instead of files
+        size_t uses; // the number of $use lines processed so far
+        std::vector<segment_t> segments;
+        size_t next; // the next segment to replay
     };
     void run_file(const input::files_t& files, input::files_t::const_iterator current);
-    // macro_args != nullptr when expanding a macro; cur_macro is for label$
+    // Records an item for the optimizer, returns its change, nullptr if it is generated unchanged
+    const change_t* add_item(item_t item);
+    // Runs the prelude of the top level file, that is, the initial lines containing only $use directives and
+    // comments, restoring the state after the longest prefix of the prelude that has a valid snapshot and running
+    // only the remaining $use lines; returns the number of lines of the prelude
+    size_t run_prelude(const input::files_t& files);
+    // The snapshot file for a key
+    [[nodiscard]] sfs::path snapshot_file(uint64_t key) const {
+        return in.cache_dir() / std::format("{:016x}.snp", key);
+    }
+    // Writes the state after a prefix of the prelude to a snapshot file, unless it depends on the top level file
+    void save_snapshot(const sfs::path& file, uint64_t key);
+    // Restores the state after a prefix of the prelude from a snapshot file, false if there is no valid snapshot
+    bool load_snapshot(const input::files_t& files, const sfs::path& file, uint64_t key);
+    // macro_args != nullptr when expanding a macro; cur_macro is for label$; split_text contains lines of text
+    // split by split()
     void run_lines(const input::files_t& files, input::files_t::const_iterator current,
-                   input::text_span full_text, input::text_span text,
+                   input::text_span full_text, input::text_span text, std::span<const line_t> split_text,
                    size_t macro_idx = std::numeric_limits<decltype(macro_idx)>::max(),
                    macro_args_t* macro_args = nullptr, size_t macro_level = 0);
     // false if symbol name already defined, true otherwise
-    bool define_const(input::files_t::const_iterator file, std::string name,
-                      std::shared_ptr<assembler::expr_base> expr);
+    bool define_const(input::files_t::const_iterator file, name_id_t name, expr_t expr);
     // false if symbol name already defined, true otherwise
-    bool define_label(input::files_t::const_iterator file, std::string name, std::optional<uint16_t> addr, bool global);
+    bool define_label(input::files_t::const_iterator file, name_id_t name, std::optional<uint16_t> addr, bool global);
     // false if symbol name already defined, true otherwise
-    bool define_macro(input::files_t::const_iterator file, std::string name, input::text_span full_replace,
-                      input::text_span replace, std::vector<std::string> params);
-    void define_global(std::string name, std::shared_ptr<symbol_t> sym, bool multi);
+    bool define_macro(input::files_t::const_iterator file, name_id_t name, input::text_span full_replace,
+                      input::text_span replace, std::span<const line_t> split_replace, std::vector<name_id_t> params);
+    void define_global(name_id_t name, std::shared_ptr<symbol_t> sym, bool multi);
     // bool = whether the symbol is defined; {nullptr, true} = unqualified name with multiple definitions
     std::pair<const symbol_t*, bool> find_symbol(input::files_t::const_iterator file, const parser::ident_t& id,
                                                  bool def_as_label = false);
+    // appends an operand node to expr_nodes
+    expr_t expr_leaf(expr_node_t node);
+    // appends a copy of an expression to expr_nodes
+    expr_t expr_copy(expr_t e);
+    // appends an operator node, its operands must be the last expressions in expr_nodes
+    expr_t expr_unop(expr_op op, expr_t inner);
+    expr_t expr_binop(expr_op op, expr_t left, expr_t right);
+    std::shared_ptr<symbol_t> predef_reg(uint8_t idx, bool csr);
+    // whether an expression returns a number, that is, not a register or bytes
+    [[nodiscard]] bool is_number(expr_t e) const;
+    // if relative, labels defined by the module of a relocatable object are evaluated to offsets in the module
+    std::optional<uint16_t> eval(expr_t e, bool relative = false);
+    static uint16_t eval_binop(expr_op op, uint16_t l, uint16_t r);
+    // returns a sequence of bytes; after nullopt in the first phase, length 1 is expected for the second phase
+    std::optional<std::vector<uint8_t>> eval_bytes(expr_t e);
+    // returns a register index 0..15 and false = normal register, true = CSR
+    [[nodiscard]] std::optional<std::pair<uint8_t, bool>> eval_reg(expr_t e) const;
+    [[nodiscard]] std::string eval_reg_str(expr_t e) const;
+    // the source text of a binary operator
+    static constexpr std::string_view expr_op_str(expr_op op);
     parse_expr_t parse_expr(std::string_view s, input::files_t::const_iterator file, macro_args_t* macro_args,
                             parser::id_macro_t macro_id);
-    template<parse_fun_t F, std::derived_from<expr_base> ...E>
+    template<parse_fun_t F, expr_op ...Op>
         std::pair<assembler::parse_expr_t, std::string_view>
         parse_expr_binary(std::string_view s, input::files_t::const_iterator file, macro_args_t* macro_args,
                           parser::id_macro_t macro_id);
@@ -233,9 +623,15 @@ private:
     std::pair<parse_expr_t, std::string_view>
         parse_expr5_multiplicative(std::string_view s, input::files_t::const_iterator file, macro_args_t* macro_args,
                                    parser::id_macro_t macro_id);
-    input& in;
+    const input& in;
+    input::files_t::const_iterator top; // the top level file of the program
     output& out;
     bool verbose;
+    name_pool names; // all identifiers used as keys of symbol tables
+    // all expressions, freed together with the assembler
+    std::vector<expr_node_t> expr_nodes;
+    std::vector<uint8_t> expr_bytes;
+    std::vector<std::optional<uint16_t>> eval_stack; // reused by eval()
     std::map<input::files_t::const_iterator, symbol_table_t, decltype([](auto&& a, auto&& b){ return &*a < &*b; })>
         symbols;
     global_symbol_table_t global_symbols;
@@ -244,283 +640,226 @@ private:
     size_t max_macro = 0; // for label$
     uint16_t cur_addr = 0; // current output address
     std::vector<phase2_t> phase2;
-    std::map<std::string, instruction_t> opcodes;
-};
-
-// expression base
-class assembler::expr_base {
-public:
-    expr_base() = default;
-    expr_base(const expr_base&) = delete;
-    expr_base(expr_base&&) = delete;
-    expr_base& operator=(const expr_base&) = delete;
-    expr_base& operator=(expr_base&&) = delete;
-    virtual ~expr_base() = default;
-    virtual std::optional<uint16_t> eval() {
-        return std::nullopt;
-    }
-    // this function provides special handling of symbol __addr
-    virtual std::shared_ptr<expr_base> fixed_clone(std::shared_ptr<expr_base> obj) {
-        return obj;
-    }
-    // returns a sequence of bytes; after nullopt in the first phase, length 1 is expected for the second phase
-    virtual std::optional<std::vector<uint8_t>> eval_bytes() {
-        if (auto val = eval())
-            return {{uint8_t(*val % 256U)}};
-        else
-            return std::nullopt;
-    }
-    // returns a register index 0..15 and false = normal register, true = CSR
-    virtual std::optional<std::pair<uint8_t, bool>> eval_reg() {
-        return std::nullopt;
-    }
-    [[nodiscard]] virtual std::string eval_reg_str() const {
-        return "?";
-    }
-};
-
-// expression returing a number
-class assembler::expr_number: public assembler::expr_base {
-};
-
-// expression returning a constant number
-class assembler::expr_const: public assembler::expr_number {
-public:
-    explicit expr_const(uint16_t value): value(value) {}
-    std::optional<uint16_t> eval() override {
-        return value;
-    }
-private:
-    uint16_t value;
-};
-
-// expression returning a label
-class assembler::expr_label: public assembler::expr_number {
-public:
-    explicit expr_label(const label_t& label): label(label) {}
-    std::optional<uint16_t> eval() override {
-        return label.value();
-    }
-private:
-    const label_t& label;
+    std::optional<prelude_t> prelude; // while running the prelude
+    bool relocatable; // assembling a relocatable object
+    // In a relocatable object, files included by the module are run only for their definitions, with this counter
+    // greater than zero
+    unsigned declaring = 0;
+    std::set<const label_t*> local_labels; // labels defined by the module of a relocatable object
+    std::deque<label_t> addr_labels; // anonymous labels replacing __addr in a relocatable object
+    std::vector<std::pair<std::string, input::files_t::const_iterator>> object_uses; // $use in a relocatable object
+    output::mark_t object_mark{}; // the start of output of the module of a relocatable object
+    std::vector<object_file::block_t> object_blocks; // boundaries of blocks at labels of a relocatable object
+    bool object_falls = true; // execution may continue to cur_addr in a relocatable object
+    bool object_split = true; // blocks of a relocatable object are valid, $addr has not moved backwards
+    bool optimize; // recording items for peephole()
+    changes_t changes; // items not generated or replaced
+    std::vector<item_t> items; // all items generated so far, including the removed ones, after replacement
+    input::files_t::const_iterator module; // the file run by run_file()
 };
 
-// expression returning a constant sequence of bytes
-class assembler::expr_bytes: public assembler::expr_base {
-public:
-    explicit expr_bytes(std::vector<uint8_t> bytes): bytes(std::move(bytes)) {}
-    std::optional<std::vector<uint8_t>> eval_bytes() override {
-        return bytes;
-    }
-private:
-    std::vector<uint8_t> bytes;
-};
+/*** src_pos *****************************************************************/
 
-// register selector for an instruction
-class assembler::expr_reg: public assembler::expr_base {
-public:
-    expr_reg(uint8_t idx, bool csr): idx(idx), csr(csr) {}
-    std::optional<std::pair<uint8_t, bool>> eval_reg() override {
-        return {{decltype(idx){idx}, decltype(csr){csr}}};
-    }
-    [[nodiscard]] std::string eval_reg_str() const override {
-        return std::format("{}r{}", csr ? "cs" : "", uint8_t(idx));
-    }
-private:
-    uint8_t idx: 4;
-    bool csr: 1;
-};
+std::ostream& operator<<(std::ostream& os, const src_pos& pos)
+{
+    os << pos.path << ':' << pos.line << ": ";
+    return os;
+}
 
-// the current address
-class assembler::expr_addr: public assembler::expr_number {
-public:
-    explicit expr_addr(assembler& as): addr(as.cur_addr) {}
-    std::optional<uint16_t> eval() override {
-        return addr;
-    }
-    std::shared_ptr<expr_base> fixed_clone(std::shared_ptr<expr_base>) override {
-        return std::make_shared<expr_const>(addr);
-    }
-private:
-    const uint16_t& addr;
-};
+/*** Parse cache *************************************************************/
 
-// a binary operation
-class assembler::expr_binop: public assembler::expr_number {
-public:
-    expr_binop(std::shared_ptr<expr_base> left, std::shared_ptr<expr_base> right):
-        left(std::move(left)), right(std::move(right)) {}
-protected:
-    std::shared_ptr<expr_base> left;
-    std::shared_ptr<expr_base> right;
-};
+// Results of input::scan() stored in a cache directory, in files named by a
+// hash of the source file. A cache file is mapped to memory and used without
+// parsing: a header is followed by tables of fixed-size entries. Offsets are in
+// bytes, integers are stored in the byte order of the host. A cache file is
+// used only if it has been created by the same build of the assembler from a
+// source file with the same hash and size.
+namespace parse_cache {
 
-// an unary operation
-class assembler::expr_unop: public assembler::expr_number {
-public:
-    explicit expr_unop(std::shared_ptr<expr_base> inner): inner(std::move(inner)) {}
-protected:
-    std::shared_ptr<expr_base> inner;
-};
+// Identification of the file format, the last character is the version
+constexpr std::array<char, 8> magic{'M', 'B', '5', '0', 'P', 'R', 'S', '1'};
 
-class assembler::expr_or: public assembler::expr_binop {
-    using expr_binop::expr_binop;
-public:
-    static constexpr std::string_view op = "|";
-    std::optional<uint16_t> eval() override {
-        if (auto [l, r] = std::pair{left->eval(), right->eval()}; l && r)
-            return uint16_t(*l | *r);
-        return std::nullopt;
-    }
-};
+// Identification of the assembler build, padded by '\0'
+constexpr std::array<char, 24> build = [] {
+    std::array<char, 24> result{};
+    std::ranges::copy(__DATE__ " " __TIME__ ""sv, result.begin());
+    return result;
+}();
 
-class assembler::expr_xor: public assembler::expr_binop {
-    using expr_binop::expr_binop;
-public:
-    static constexpr std::string_view op = "^";
-    std::optional<uint16_t> eval() override {
-        if (auto [l, r] = std::pair{left->eval(), right->eval()}; l && r)
-            return uint16_t(*l ^ *r);
-        return std::nullopt;
-    }
+// Location of a table in the file
+struct table_t {
+    uint32_t offset;
+    uint32_t size; // number of entries
 };
 
-class assembler::expr_and: public assembler::expr_binop {
-    using expr_binop::expr_binop;
-public:
-    static constexpr std::string_view op = "&";
-    std::optional<uint16_t> eval() override {
-        if (auto [l, r] = std::pair{left->eval(), right->eval()}; l && r)
-            return uint16_t(*l & *r);
-        return std::nullopt;
-    }
+struct header_t {
+    std::array<char, 8> magic;
+    std::array<char, 24> build;
+    uint64_t hash; // of the source file
+    uint64_t size; // of the source file
+    table_t lines; // line_t, indexed by line number - 1
+    table_t parts; // part_t
 };
 
-class assembler::expr_shl: public assembler::expr_binop {
-    using expr_binop::expr_binop;
-public:
-    static constexpr std::string_view op = "<<";
-    std::optional<uint16_t> eval() override {
-        if (auto [l, r] = std::pair{left->eval(), right->eval()}; l && r)
-            return uint16_t(*l << std::max(uint16_t(0), std::min(*r, uint16_t(16))));
-        return std::nullopt;
-    }
+// A source line, without trailing whitespace
+struct line_t {
+    uint32_t offset; // in the source file
+    uint32_t full_size; // including a comment
+    uint32_t size; // without a comment
+    uint32_t parts; // index of the label in parts, followed by the command and the arguments
+    uint32_t args; // number of arguments
 };
 
-class assembler::expr_shr: public assembler::expr_binop {
-    using expr_binop::expr_binop;
-public:
-    static constexpr std::string_view op = ">>";
-    std::optional<uint16_t> eval() override {
-        if (auto [l, r] = std::pair{left->eval(), right->eval()}; l && r)
-            return uint16_t(*l >> std::max(uint16_t(0), std::min(*r, uint16_t(16))));
-        return std::nullopt;
-    }
+// A label, a command, or an argument
+struct part_t {
+    uint32_t offset; // in the source file
+    uint32_t size;
 };
 
-class assembler::expr_add: public assembler::expr_binop {
-    using expr_binop::expr_binop;
-public:
-    static constexpr std::string_view op = "+";
-    std::optional<uint16_t> eval() override {
-        if (auto [l, r] = std::pair{left->eval(), right->eval()}; l && r)
-            return uint16_t(*l + *r);
-        return std::nullopt;
-    }
-};
+// 64-bit FNV-1a
+uint64_t hash(std::string_view data)
+{
+    uint64_t result = 0xcbf29ce484222325U;
+    for (char c: data)
+        result = (result ^ uint8_t(c)) * 0x100000001b3U;
+    return result;
+}
 
-class assembler::expr_sub: public assembler::expr_binop {
-    using expr_binop::expr_binop;
-public:
-    static constexpr std::string_view op = "-";
-    std::optional<uint16_t> eval() override {
-        if (auto [l, r] = std::pair{left->eval(), right->eval()}; l && r)
-            return uint16_t(*l - *r);
-        return std::nullopt;
-    }
-};
+sfs::path file_name(const sfs::path& dir, uint64_t hash)
+{
+    return dir / std::format("{:016x}.prs", hash);
+}
 
-class assembler::expr_mul: public assembler::expr_binop {
-    using expr_binop::expr_binop;
-public:
-    static constexpr std::string_view op = "*";
-    std::optional<uint16_t> eval() override {
-        if (auto [l, r] = std::pair{left->eval(), right->eval()}; l && r)
-            return uint16_t(*l * *r);
+// Gets a table, nullopt if it is not inside the file
+template<class T> std::optional<std::span<const T>> table(const mapped_file& map, table_t t)
+{
+    if (t.offset % alignof(T) != 0 || t.offset > map.size() || (map.size() - t.offset) / sizeof(T) < t.size)
         return std::nullopt;
-    }
-};
+    return std::span<const T>{reinterpret_cast<const T*>(map.data() + t.offset), t.size};
+}
 
-class assembler::expr_div: public assembler::expr_binop {
-    using expr_binop::expr_binop;
-public:
-    static constexpr std::string_view op = "/";
-    std::optional<uint16_t> eval() override {
-        if (auto [l, r] = std::pair{left->eval(), right->eval()}; l && r) {
-            if (*r != 0)
-                return uint16_t(*l / *r);
-            else
-                throw eval_error("Division by zero");
-        }
-        return std::nullopt;
-    }
-};
+// Writes a file to the cache directory, errors are ignored, because the cache only speeds up assembling
+void write_file(const sfs::path& file, std::string_view data)
+{
+    // A temporary file is renamed, so that a concurrently running assembler never sees an incomplete file
+    static std::atomic<unsigned> tmp_idx = 0;
+    std::error_code ec;
+    sfs::create_directories(file.parent_path(), ec);
+    sfs::path tmp = sfs::path(file).concat(std::format(".{}.{}.tmp", getpid(), tmp_idx++));
+    std::ofstream ofs(tmp, std::ios_base::binary | std::ios_base::trunc);
+    ofs.write(data.data(), std::streamsize(data.size()));
+    ofs.close();
+    if (ofs)
+        sfs::rename(tmp, file, ec);
+    if (!ofs || ec)
+        sfs::remove(tmp, ec);
+}
 
-class assembler::expr_rem: public assembler::expr_binop {
-    using expr_binop::expr_binop;
-public:
-    static constexpr std::string_view op = "%";
-    std::optional<uint16_t> eval() override {
-        if (auto [l, r] = std::pair{left->eval(), right->eval()}; l && r) {
-            if (*r != 0)
-                return uint16_t(*l % *r);
+// Fills full_text, text, and split from a cache file, returns false if there is no valid cache file for source
+bool load(const sfs::path& dir, std::string_view source, uint64_t hash, input::text_t& full_text, input::text_t& text,
+          std::vector<input::line_t>& split)
+{
+    mapped_file map(file_name(dir, hash));
+    header_t header{};
+    if (!map.ok() || map.size() < sizeof(header))
+        return false;
+    std::memcpy(&header, map.data(), sizeof(header));
+    if (header.magic != magic || header.build != build || header.hash != hash || header.size != source.size())
+        return false;
+    auto lines = table<line_t>(map, header.lines);
+    auto parts = table<part_t>(map, header.parts);
+    if (!lines || !parts)
+        return false;
+    auto str = [source](uint64_t offset, uint64_t size) -> std::optional<std::string_view> {
+        if (offset > source.size() || source.size() - offset < size)
+            return std::nullopt;
+        return source.substr(offset, size);
+    };
+    input::text_t cached_full_text{};
+    input::text_t cached_text{};
+    std::vector<input::line_t> cached_split{};
+    for (auto&& l: *lines) {
+        auto full = str(l.offset, l.full_size);
+        if (!full || l.size > l.full_size || l.parts > parts->size() || parts->size() - l.parts < 2 + uint64_t(l.args))
+            return false;
+        cached_full_text.push_back(*full);
+        cached_text.push_back(full->substr(0, l.size));
+        auto p = parts->subspan(l.parts, 2 + l.args);
+        std::vector<std::string_view> line_parts{};
+        for (auto&& part: p)
+            if (auto v = str(part.offset, part.size))
+                line_parts.push_back(*v);
             else
-                throw eval_error("Division by zero");
-        }
-        return std::nullopt;
-    }
-};
-
-class assembler::expr_not: public assembler::expr_unop {
-    using expr_unop::expr_unop;
-public:
-    std::optional<uint16_t> eval() override {
-        if (auto i = inner->eval(); i)
-            return uint16_t(~*i);
-        return std::nullopt;
-    }
-};
-
-class assembler::expr_neg: public assembler::expr_unop {
-    using expr_unop::expr_unop;
-public:
-    std::optional<uint16_t> eval() override {
-        if (auto i = inner->eval(); i)
-            return uint16_t(-*i);
-        return std::nullopt;
+                return false;
+        cached_split.push_back({.label = line_parts[0], .cmd = line_parts[1], .args = {line_parts.begin() + 2,
+                                                                                        line_parts.end()}});
     }
-};
-
-/*** src_pos *****************************************************************/
+    full_text = std::move(cached_full_text);
+    text = std::move(cached_text);
+    split = std::move(cached_split);
+    return true;
+}
 
-std::ostream& operator<<(std::ostream& os, const src_pos& pos)
+// Writes a cache file for source
+void store(const sfs::path& dir, std::string_view source, uint64_t hash, const input::text_t& full_text,
+           const input::text_t& text, const std::vector<input::line_t>& split)
 {
-    os << pos.path << ':' << pos.line << ": ";
-    return os;
+    if (source.size() > std::numeric_limits<uint32_t>::max())
+        return;
+    auto offset = [source](std::string_view s) {
+        return s.empty() ? uint32_t{0} : uint32_t(s.data() - source.data());
+    };
+    std::vector<line_t> lines{};
+    std::vector<part_t> parts{};
+    for (size_t i = 0; i < full_text.size(); ++i) {
+        lines.push_back({.offset = offset(full_text[i]), .full_size = uint32_t(full_text[i].size()),
+                         .size = uint32_t(text[i].size()), .parts = uint32_t(parts.size()),
+                         .args = uint32_t(split[i].args.size())});
+        parts.push_back({.offset = offset(split[i].label), .size = uint32_t(split[i].label.size())});
+        parts.push_back({.offset = offset(split[i].cmd), .size = uint32_t(split[i].cmd.size())});
+        for (auto&& a: split[i].args)
+            parts.push_back({.offset = offset(a), .size = uint32_t(a.size())});
+    }
+    header_t header{
+        .magic = magic,
+        .build = build,
+        .hash = hash,
+        .size = source.size(),
+        .lines = {.offset = uint32_t(sizeof(header)), .size = uint32_t(lines.size())},
+        .parts = {.offset = uint32_t(sizeof(header) + lines.size() * sizeof(line_t)), .size = uint32_t(parts.size())},
+    };
+    std::string data(reinterpret_cast<const char*>(&header), sizeof(header));
+    data.append(reinterpret_cast<const char*>(lines.data()), lines.size() * sizeof(line_t));
+    data.append(reinterpret_cast<const char*>(parts.data()), parts.size() * sizeof(part_t));
+    write_file(file_name(dir, hash), data);
 }
 
+} // namespace parse_cache
+
 /*** input *******************************************************************/
 
-input::input(sfs::path file, bool verbose):
-    verbose(verbose)
+input::input(std::span<const sfs::path> top_files, sfs::path cache_dir, bool verbose, files_t reuse):
+    _reuse(std::move(reuse)), _cache_dir(std::move(cache_dir)), verbose(verbose)
 {
+    // Top level files are added first, so that all of them are scanned in parallel
+    std::vector<files_t::iterator> tops{};
+    for (auto&& f: top_files)
+        tops.push_back(add_file(_files.end(), 0, f, ""s));
     std::stack<files_t::iterator> todo{};
-    todo.push(add_file(_files.end(), 0, std::move(file), ""s));
+    todo.push_range(tops | std::ranges::views::reverse);
     while (!todo.empty()) {
         files_t::iterator p = todo.top();
         todo.pop();
         todo.push_range(read(p) | std::ranges::views::reverse);
     }
+    _reuse.clear();
+}
+
+input::files_t input::reusable(const std::set<sfs::path>& changed)
+{
+    std::erase_if(_files, [&changed](auto&& f) { return !f.second.source || changed.contains(f.first); });
+    _top_files.clear();
+    return std::move(_files);
 }
 
 input::files_t::iterator
@@ -533,18 +872,35 @@ input::add_file(files_t::iterator from, size_t line, sfs::path relative, const s
         abs = base / abs;
     }
     abs = sfs::canonical(abs);
-    auto [result, added] = _files.insert({
-        std::move(abs),
-        file_t{
-            .orig_path = std::move(relative),
-            .full_text = {},
-            .text = {},
-            .name_spaces = {},
-            .processed = false,
-        }});
-    if (from == _files.end())
-        _top_file = result;
-    else {
+    std::pair<files_t::iterator, bool> inserted{};
+    if (auto node = _reuse.extract(abs)) {
+        // Already parsed by a previous input
+        node.mapped().orig_path = std::move(relative);
+        node.mapped().name_spaces.clear();
+        node.mapped().processed = false;
+        auto r = _files.insert(std::move(node));
+        inserted = {r.position, r.inserted};
+    } else
+        inserted = _files.insert({
+            std::move(abs),
+            file_t{
+                .orig_path = std::move(relative),
+                .source = nullptr,
+                .full_text = {},
+                .text = {},
+                .split = {},
+                .hash = 0,
+                .name_spaces = {},
+                .processed = false,
+                .scan = {},
+            }});
+    auto [result, added] = inserted;
+    if (added && !result->second.source)
+        result->second.scan = std::async(std::launch::async, scan, result->first, _cache_dir);
+    if (from == _files.end()) {
+        if (std::ranges::find(_top_files, files_t::const_iterator(result)) == _top_files.end())
+            _top_files.push_back(result);
+    } else {
         if (from->second.name_spaces.contains(name_space)) {
             std::cerr << src_pos(from->first, line) << "Namespace " << name_space << " already defined" <<
                 std::endl;
@@ -563,6 +919,65 @@ input::add_file(files_t::iterator from, size_t line, sfs::path relative, const s
     return result;
 }
 
+input::scan_t input::scan(const sfs::path& file, const sfs::path& cache_dir)
+{
+    scan_t result{.source = std::make_unique<const mapped_file>(file), .full_text = {}, .text = {}, .split = {},
+                  .uses = {}, .hash = 0, .cached = false};
+    if (!result.source->ok())
+        return result;
+    std::string_view source = result.source->text();
+    if (!cache_dir.empty())
+        result.hash = parse_cache::hash(source);
+    if (!cache_dir.empty() &&
+        parse_cache::load(cache_dir, source, result.hash, result.full_text, result.text, result.split))
+    {
+        result.cached = true;
+    } else {
+        for (std::string_view data = source; !data.empty();) {
+            // Lines are split like by std::getline(), the last line need not end by a newline
+            auto eol = data.find('\n');
+            std::string_view line = data.substr(0, eol);
+            data.remove_prefix(eol == std::string_view::npos ? data.size() : eol + 1);
+            if (auto e = line.find_last_not_of(whitespace_chars); e == std::string_view::npos)
+                line = {};
+            else
+                line = line.substr(0, e + 1);
+            result.full_text.push_back(line);
+            result.text.push_back(assembler::remove_comment(line));
+            result.split.push_back(assembler::split(result.text.back()));
+        }
+        if (!cache_dir.empty())
+            parse_cache::store(cache_dir, source, result.hash, result.full_text, result.text, result.split);
+    }
+    result.uses = find_uses(result.split);
+    return result;
+}
+
+std::vector<input::use_t> input::find_uses(const std::vector<line_t>& split)
+{
+    std::vector<use_t> result{};
+    for (size_t i = 0; i < split.size(); ++i)
+        if (auto&& parts = split[i]; parts.cmd == "$use"sv) {
+            use_t& use = result.emplace_back(use_t{.line = i + 1, .error = {}, .name_space = {}, .file = {}});
+            if (parts.args.size() != 2 || parts.args[1].empty()) {
+                use.error = "Expected namespace, file_name";
+                break;
+            }
+            auto id_ns = parser::identifier(parts.args[0], true);
+            if (!id_ns.first) {
+                use.error = "Expected namespace: "s.append(id_ns.first.error());
+                break;
+            }
+            if (id_ns.first->name_space) {
+                use.error = "Expected identifier without namespace";
+                break;
+            }
+            use.name_space = std::move(id_ns.first->name);
+            use.file = parts.args[1];
+        }
+    return result;
+}
+
 std::vector<input::files_t::iterator> input::read(files_t::iterator it)
 {
     std::vector<input::files_t::iterator> result{};
@@ -571,51 +986,63 @@ std::vector<input::files_t::iterator> input::read(files_t::iterator it)
     if (verbose)
         std::cerr << "Reading file \"" << it->first.string() << '"' << std::endl;
     it->second.processed = true;
-    if (std::ifstream ifs{it->first}; !ifs) {
-        std::cerr << "Cannot read file \"" << it->first.string() << '"' << std::endl;
-        throw silent_error{};
+    file_t& f = it->second;
+    std::vector<use_t> uses{};
+    if (f.source) {
+        // Reused from a previous input
+        if (verbose)
+            std::cerr << "Using unchanged file \"" << it->first.string() << '"' << std::endl;
+        uses = find_uses(f.split);
     } else {
-        file_t& f = it->second;
-        for (std::string line; std::getline(ifs, line);) {
-            if (auto e = line.find_last_not_of(whitespace_chars); e == std::string::npos)
-                line.clear();
-            else
-                line.resize(e + 1);
-            f.full_text.push_back(line);
-            f.text.push_back(assembler::remove_comment(line));
-            auto parts = assembler::split(f.text.back());
-            if (parts.cmd == "$use"sv) {
-                if (parts.args.size() != 2 || parts.args[1].empty()) {
-                    std::cerr << src_pos(it->first, f.text.size()) << "Expected namespace, file_name" << std::endl;
-                    throw silent_error{};
-                }
-                auto id_ns = parser::identifier(parts.args[0], true);
-                if (!id_ns.first) {
-                    std::cerr << src_pos(it->first, f.text.size()) << "Expected namespace: " << id_ns.first.error() <<
-                        std::endl;
-                    throw silent_error{};
-                }
-                if (id_ns.first->name_space) {
-                    std::cerr << src_pos(it->first, f.text.size()) << "Expected identifier without namespace" <<
-                        std::endl;
-                    throw silent_error{};
-                }
-                result.push_back(add_file(it, f.text.size(), parts.args[1], id_ns.first->name));
-            }
+        auto scanned = f.scan.get();
+        if (!scanned.source->ok()) {
+            std::cerr << "Cannot read file \"" << it->first.string() << '"' << std::endl;
+            throw silent_error{};
+        }
+        f.source = std::move(scanned.source);
+        f.full_text = std::move(scanned.full_text);
+        f.text = std::move(scanned.text);
+        f.split = std::move(scanned.split);
+        f.hash = scanned.hash;
+        if (verbose && scanned.cached)
+            std::cerr << "Using cached parsing of file \"" << it->first.string() << '"' << std::endl;
+        uses = std::move(scanned.uses);
+    }
+    for (auto&& use: uses) {
+        if (!use.error.empty()) {
+            std::cerr << src_pos(it->first, use.line) << use.error << std::endl;
+            throw silent_error{};
         }
+        result.push_back(add_file(it, use.line, use.file, use.name_space));
     }
     return result;
 }
 
 /*** output ******************************************************************/
 
-output::output(sfs::path file, bool verbose):
-    file(std::move(file)), verbose(verbose)
+output::output(sfs::path file, bool verbose, bool keep_unchanged):
+    file(std::move(file)), verbose(verbose), keep_unchanged(keep_unchanged)
 {
     this->file.replace_extension();
 }
 
 void output::add_bytes(uint16_t addr, std::span<uint8_t> bytes, std::string_view instr, std::string_view prefix)
+{
+    auto stored = store_bytes(addr, bytes);
+    if (!instr.empty()) {
+        auto i = bytes.empty() ? nullptr : isa::decode(bytes[0]);
+        out_text.push_back({.text = std::format("; {}{:04x}: {}{}", prefix, addr, instr,
+                                                i ? cost_analysis::cycles_str(*i) : ""s),
+                            .instr = addr});
+    }
+    out_text.push_back({.text = std::format("; {}{:04x}: $data_b", prefix, addr), .bytes = stored});
+    if (!bytes.empty())
+        for (size_t level = 0; level < locations.size(); ++level)
+            dbg_lines.push_back({.addr = addr, .size = uint16_t(bytes.size()), .level = uint16_t(level),
+                                 .loc = locations[level]});
+}
+
+std::span<uint8_t> output::store_bytes(uint16_t addr, std::span<const uint8_t> bytes)
 {
     if (addr + bytes.size() > out_bin.size())
         throw fatal_error("Output does not fit to address space");
@@ -625,9 +1052,7 @@ void output::add_bytes(uint16_t addr, std::span<uint8_t> bytes, std::string_view
         end_addr = addr + bytes.size();
     auto addr_begin = out_bin.begin() + addr;
     auto addr_end = std::ranges::copy(bytes, addr_begin).out;
-    if (!instr.empty())
-        out_text.push_back({.text = std::format("; {}{:04x}: {}", prefix, addr, instr)});
-    out_text.push_back({.text = std::format("; {}{:04x}: $data_b", prefix, addr), .bytes = {addr_begin, addr_end}});
+    return {addr_begin, addr_end};
 }
 
 void output::add_src_line(const sfs::path& file, size_t line, std::string_view text, std::string_view prefix,
@@ -653,6 +1078,24 @@ void output::add_txt_line(std::string_view text, std::string_view prefix)
     out_text.push_back({.text = std::format("; {}{}", prefix, text)});
 }
 
+void output::set_location(const sfs::path& file, size_t line, size_t level)
+{
+    locations.resize(level + 1);
+    locations.back() = {.file = &file, .line = line};
+}
+
+void output::add_symbol(std::string name, uint16_t value, bool label)
+{
+    dbg_symbols.push_back({.name = std::move(name), .value = value, .label = label});
+}
+
+void output::add_annotation(annotation_t::kind_t kind, uint16_t addr, uint16_t value)
+{
+    if (locations.empty())
+        throw fatal_error("Annotation without location in output::add_annotation");
+    annotations.push_back({.kind = kind, .addr = addr, .value = value, .loc = locations.back()});
+}
+
 void output::set_byte(uint16_t addr, uint8_t byte)
 {
     out_bin.at(addr) = byte;
@@ -664,60 +1107,47 @@ void output::set_word(uint16_t addr, uint16_t word)
     out_bin.at(addr + 1) = uint8_t(word / 256U);
 }
 
+uint16_t output::word(uint16_t addr) const
+{
+    return uint16_t(out_bin.at(addr) + 256U * out_bin.at(addr + 1));
+}
+
+output::segment_t output::segment(mark_t since) const
+{
+    segment_t result{.text = {}, .dbg_lines = {dbg_lines.begin() + ptrdiff_t(since.dbg), dbg_lines.end()},
+                     .annotations = {annotations.begin() + ptrdiff_t(since.annotations), annotations.end()},
+                     .last_file = last_file, .last_line = last_line, .locations = locations};
+    for (auto&& l: std::span(out_text).subspan(since.text))
+        result.text.push_back({.text = l.text,
+                               .addr = l.bytes.data() ? std::optional(uint16_t(l.bytes.data() - out_bin.data())) :
+                                                        std::nullopt,
+                               .bytes = {l.bytes.begin(), l.bytes.end()}, .instr = l.instr});
+    return result;
+}
+
+void output::append(const segment_t& seg)
+{
+    for (auto&& l: seg.text)
+        out_text.push_back({.text = l.text, .bytes = l.addr ? store_bytes(*l.addr, l.bytes) : std::span<uint8_t>{},
+                            .instr = l.instr});
+    dbg_lines.insert(dbg_lines.end(), seg.dbg_lines.begin(), seg.dbg_lines.end());
+    annotations.insert(annotations.end(), seg.annotations.begin(), seg.annotations.end());
+    last_file = seg.last_file;
+    last_line = seg.last_line;
+    locations = seg.locations;
+}
+
 void output::write()
 {
-    std::ofstream ofs;
     if (start_addr >= out_bin.size() || end_addr > out_bin.size() || end_addr <= start_addr) {
         start_addr = 0x0000;
         end_addr = 0x0000;
     }
-    auto out_size = std::streamsize(end_addr - start_addr);
-
-    sfs::path out_file = file;
-    out_file.replace_extension(".bin");
-    if (verbose)
-        std::cerr << "Writing file \"" << out_file.string() << '"' << std::endl;
-    ofs.open(out_file, std::ios_base::binary | std::ios_base::trunc);
-    if (!ofs)
-        throw fatal_error(std::format("Cannot write binary output file \"{}\"", out_file.string()));
-    ofs << std::format("{:04x}\n", start_addr);
-    if (out_size > 0)
-        ofs.write(reinterpret_cast<const char*>(out_bin.data() + start_addr), out_size);
-    ofs.close();
-    if (!ofs)
-        throw fatal_error(std::format("Error writing binary output file \"{}\"", out_file.string()));
+    auto image = std::span(out_bin).subspan(start_addr, end_addr - start_addr);
+    write_file(sfs::path(file).replace_extension(".bin"), "binary output", program_bin(start_addr, image));
+    write_file(sfs::path(file).replace_extension(".mif"), "MIF output", program_mif("mb50as", start_addr, image));
 
-    out_file = file;
-    out_file.replace_extension(".mif");
-    if (verbose)
-        std::cerr << "Writing file \"" << out_file.string() << '"' << std::endl;
-    ofs.open(out_file, std::ios_base::binary | std::ios_base::trunc);
-    if (!ofs)
-        throw fatal_error(std::format("Cannot write MIF output file \"{}\"", out_file.string()));
-    ofs << R"(-- mb50as generated Memory Initialization File (.mif)
-
-WIDTH=8;
-DEPTH=30720;
-
-ADDRESS_RADIX=HEX;
-DATA_RADIX=HEX;
-
-CONTENT BEGIN
-)";
-    for (size_t addr = start_addr; addr < end_addr; ++addr)
-        ofs << std::format("\t{:04x}: {:02x};\n", addr, out_bin[addr]);
-    ofs << "END;\n";
-    ofs.close();
-    if (!ofs)
-        throw fatal_error(std::format("Error writing MIF output file \"{}\"", out_file.string()));
-
-    out_file = file;
-    out_file.replace_extension(".out");
-    if (verbose)
-        std::cerr << "Writing file \"" << out_file.string() << '"' << std::endl;
-    ofs.open(out_file, std::ios_base::trunc);
-    if (!ofs)
-        throw fatal_error(std::format("Cannot write text output file \"{}\"", out_file.string()));
+    std::ostringstream ofs;
     for (auto&&l: out_text) {
         ofs << l.text;
         std::string delim = " "s;
@@ -729,105 +1159,404 @@ CONTENT BEGIN
             ofs << std::format(" # 0x{:02x}{:02x}", l.bytes[1], l.bytes[0]);
         ofs << '\n';
     }
+    ofs << cost_table();
+    write_file(sfs::path(file).replace_extension(".out"), "text output", ofs.view());
+
+    write_debug_info(sfs::path(file).replace_extension(".dbg"));
+}
+
+void output::write_object(std::string_view data)
+{
+    write_file(sfs::path(file).replace_extension(".o"), "object output", data);
+}
+
+void output::write_file(const sfs::path& out_file, std::string_view kind, std::string_view data)
+{
+    if (keep_unchanged) {
+        if (mapped_file old(out_file); old.ok() && old.text() == data) {
+            if (verbose)
+                *diag << "Keeping unchanged file \"" << out_file.string() << '"' << std::endl;
+            return;
+        }
+    }
+    if (verbose)
+        *diag << "Writing file \"" << out_file.string() << '"' << std::endl;
+    std::ofstream ofs(out_file, std::ios_base::binary | std::ios_base::trunc);
+    if (!ofs)
+        throw fatal_error(std::format("Cannot write {} file \"{}\"", kind, out_file.string()));
+    ofs.write(data.data(), std::streamsize(data.size()));
     ofs.close();
     if (!ofs)
-        throw fatal_error(std::format("Error writing text output file \"{}\"", out_file.string()));
+        throw fatal_error(std::format("Error writing {} file \"{}\"", kind, out_file.string()));
 }
 
-/*** assembler ***************************************************************/
+void output::write_debug_info(const sfs::path& out_file)
+{
+    debug_info::writer w;
+    for (auto&& l: dbg_lines)
+        w.add_line(l.addr, l.size, l.level, l.loc.file->native(), l.loc.line);
+    for (auto&& s: dbg_symbols)
+        w.add_symbol(s.name, s.value, s.label);
+    write_file(out_file, "debug information", w.data());
+}
 
-assembler::assembler(input& in, output& out, bool verbose):
-    in(in), out(out), verbose(verbose),
-    predef_symbols{
-        {"sp", std::make_shared<symbol_t>(var_t{std::make_shared<expr_reg>(11, false)})},
-        {"ca", std::make_shared<symbol_t>(var_t{std::make_shared<expr_reg>(12, false)})},
-        {"ia", std::make_shared<symbol_t>(var_t{std::make_shared<expr_reg>(13, false)})},
-        {"f", std::make_shared<symbol_t>(var_t{std::make_shared<expr_reg>(14, false)})},
-        {"pc", std::make_shared<symbol_t>(var_t{std::make_shared<expr_reg>(15, false)})},
-        {"__addr", std::make_shared<symbol_t>(var_t{std::make_shared<expr_addr>(*this)})},
-    },
-    opcodes{
-        {"add", {.opcode = 0x01}},
-        {"and", {.opcode = 0x02}},
-        {"brk", {.opcode = 0x22}},
-        {"cmps", {.opcode = 0x1b}},
-        {"cmpu", {.opcode = 0x19}},
-        {"csrr", {.opcode = 0x03, .src_csr = true}},
-        {"csrw", {.opcode = 0x04, .dst_csr = true}},
-        {"ddsto", {.opcode = 0x17}},
-        {"dec1", {.opcode = 0x05}},
-        {"dec2", {.opcode = 0x06}},
-        {"exch", {.opcode = 0x07}},
-        {"inc1", {.opcode = 0x08}},
-        {"inc2", {.opcode = 0x09}},
-        {"ill", {.opcode = 0x00}},
-        {"ld", {.opcode = 0x0a}},
-        {"ldb", {.opcode = 0x0b}},
-        {"ldis", {.opcode = 0x0c}},
-        //{"ldisx", {.opcode = 0x0d}},
-        {"mulss", {.opcode = 0x1e}},
-        {"mulsu", {.opcode = 0x1f}},
-        {"mulus", {.opcode = 0x20}},
-        {"muluu", {.opcode = 0x21}},
-        {"mv", {.opcode = 0x0e}},
-        {"neg", {.opcode = 0x0f}},
-        {"not", {.opcode = 0x10}},
-        {"or", {.opcode = 0x11}},
-        {"reti", {.opcode = 0x1c}},
-        {"rev", {.opcode = 0x1d}},
-        {"shl", {.opcode = 0x12}},
-        {"shr", {.opcode = 0x13}},
-        {"shra", {.opcode = 0x14}},
-        {"sto", {.opcode = 0x15}},
-        {"stob", {.opcode = 0x16}},
-        {"sub", {.opcode = 0x18}},
-        {"xor", {.opcode = 0x1a}},
+std::string output::cost_table() const
+{
+    std::vector<bool> code(out_bin.size());
+    for (auto&& l: out_text)
+        if (l.instr)
+            code[*l.instr] = true;
+    cost_analysis costs(out_bin, code, annotations);
+    // Names of code labels by address, all label addresses delimit the code of a label
+    std::map<uint16_t, std::set<std::string_view>> labels;
+    std::set<size_t> bounds{end_addr};
+    for (auto&& s: dbg_symbols)
+        if (s.label) {
+            bounds.insert(s.value);
+            if (costs.code(s.value))
+                labels[s.value].insert(s.name);
+        }
+    if (labels.empty())
+        return {};
+    std::ostringstream result;
+    auto worst_str = [](const cost_analysis::cost_t& c) {
+        return std::format("{}{}", c.loops ? "+" : "", c.unknown ? "?" : "");
+    };
+    result << "; Costs of code labels: BYTES up to the next label, CYCLES of instructions up to the next label each\n"
+        "; executed once, WORST case cycles of acyclic paths including called subroutines and bounded loops, which is\n"
+        "; marked by + if it counts a loop without a bound or a recursion once, and by ? if it ignores a jump or\n"
+        "; a call with an unknown target\n"
+        "; ADDR    BYTES  CYCLES    WORST  LABELS\n";
+    for (auto&& [addr, names]: labels) {
+        auto next = bounds.upper_bound(addr);
+        size_t end = next == bounds.end() ? addr : *next;
+        auto worst = costs.worst(addr);
+        result << std::format("; {:#06x} {:6} {:7} {:8}{}", addr, end - addr, costs.cycles(addr, end), worst.cycles,
+                              worst_str(worst));
+        std::string delim = "  "s;
+        for (auto n: names) {
+            result << delim << n;
+            delim = ", "s;
+        }
+        result << '\n';
     }
+    bool deadlines = false;
+    for (auto&& a: annotations)
+        if (a.kind == annotation_t::kind_t::intr_deadline) {
+            if (!deadlines) {
+                result << std::format("; Worst cases of interrupt handlers: WORST case cycles including the interrupt "
+                                      "entry, DEADLINE\n; cycles at CPU_HZ {} for interrupts with frequency HZ\n"
+                                      "; ADDR      WORST   DEADLINE     HZ  LABELS\n", isa::cpu_hz);
+                deadlines = true;
+            }
+            // A handler is analyzed from scratch, not depending on results memoized while analyzing labels
+            auto worst = cost_analysis(out_bin, code, annotations).worst(a.addr);
+            worst.cycles += isa::intr_entry_cycles;
+            auto deadline = isa::cpu_hz / a.value;
+            result << std::format("; {:#06x} {:8}{:2} {:8} {:6}", a.addr, worst.cycles, worst_str(worst), deadline,
+                                  a.value);
+            std::string delim = "  "s;
+            if (auto l = labels.find(a.addr); l != labels.end())
+                for (auto n: l->second) {
+                    result << delim << n;
+                    delim = ", "s;
+                }
+            result << '\n';
+            if (worst.cycles > deadline)
+                *diag << src_pos(a.loc.file->string(), a.loc.line) <<
+                    "Warning: Interrupt handler can miss its deadline, worst case " << worst.cycles <<
+                    " cycles, deadline " << deadline << " cycles" << std::endl;
+        }
+    return std::move(result).str();
+}
+
+/*** cost_analysis ***********************************************************/
+
+cost_analysis::cost_analysis(std::span<const uint8_t, 0x10000> bin, std::vector<bool> code,
+                             std::span<const output::annotation_t> annotations):
+    bin(bin), _code(std::move(code))
 {
-    for (int i = 0; i <= 15; ++i) {
-        predef_symbols.emplace(std::format("r{}", i),
-                               std::make_shared<symbol_t>(var_t{std::make_shared<expr_reg>(uint8_t(i), false)}));
-        predef_symbols.emplace(std::format("csr{}", i),
-                               std::make_shared<symbol_t>(var_t{std::make_shared<expr_reg>(uint8_t(i), true)}));
-    }
-    for (const auto& [prefix, suffix, opcode]: {
-        //{"exch", "", 0x80},
-         std::tuple{"ld", "", 0x90},
-        {"ld", "is", 0xa0},
-        //{"ldx", "is", 0xb0},
-        {"mv", "", 0xc0},
-    }) {
-        for (const auto& [flag, f_code]: {
-            std::tuple{"f0", 0x00},
-            std::tuple{"f1", 0x01},
-            std::tuple{"f2", 0x02},
-            std::tuple{"f3", 0x03},
-            std::tuple{"z", 0x04},
-            std::tuple{"c", 0x05},
-            std::tuple{"s", 0x06},
-            std::tuple{"o", 0x07},
-        }) {
-            for (const auto& [neg, n_code]: {
-                std::tuple{"", 0x08},
-                std::tuple{"n", 0x00},
-            }) {
-                opcodes.emplace(std::format("{}{}{}{}", prefix, neg, flag, suffix),
-                            instruction_t{.opcode = uint8_t(unsigned(opcode) | unsigned(n_code) | unsigned(f_code))});
+    _code.resize(bin.size());
+    for (auto&& a: annotations)
+        if (a.kind == output::annotation_t::kind_t::loop_bound)
+            loop_bounds[a.addr] = a.value;
+        else if (a.kind == output::annotation_t::kind_t::target)
+            targets.emplace(a.addr, a.value);
+}
+
+uint64_t cost_analysis::cycles(uint16_t begin, size_t end) const
+{
+    uint64_t result = 0;
+    for (size_t a = begin; a < end && a < bin.size(); ++a)
+        if (auto i = _code[a] ? isa::decode(bin[a]) : nullptr)
+            result += i->cycles;
+    return result;
+}
+
+std::optional<cost_analysis::cost_t> cost_analysis::path(uint16_t addr, uint32_t target)
+{
+    std::vector<frame_t> stack;
+    // Keys of results in memo indexed by the deepest element of memo_t::open
+    std::vector<std::vector<uint64_t>> scoped;
+    std::optional<cost_t> ret{}; // the result of the last query
+    std::set<size_t> ret_open{}; // memo_t::open of ret
+    // Sets ret and returns true if the result of a query is known, otherwise pushes the query to the stack
+    auto query = [this, &stack, &scoped, &ret, &ret_open](uint16_t a, uint32_t t) {
+        ret_open.clear();
+        if (a == t) {
+            ret = cost_t{};
+            return true;
+        }
+        uint64_t key = uint64_t{t} * 0x10000U + a;
+        auto [it, inserted] = memo.try_emplace(key);
+        if (inserted) {
+            it->second.depth = stack.size();
+            stack.push_back({.key = key, .addr = a, .target = t, .edges = edges(a)});
+            scoped.resize(std::max(scoped.size(), stack.size()));
+            return false;
+        }
+        if (it->second.done) {
+            ret = it->second.cost;
+            ret_open = it->second.open;
+            return true;
+        }
+        if (loop_bounds.contains(a))
+            ret = std::nullopt; // a back edge of a loop, its iterations are added by the loop header
+        else
+            ret = cost_t{.loops = true}; // a back edge of a loop without a bound or a recursive call
+        ret_open.insert(it->second.depth);
+        return true;
+    };
+    auto merge = [](std::optional<cost_t>& result, const cost_t& c) {
+        if (!result)
+            result = c;
+        else {
+            result->cycles = std::max(result->cycles, c.cycles);
+            result->loops |= c.loops;
+            result->unknown |= c.unknown;
+        }
+    };
+    bool returned = query(addr, target); // ret contains the result for the top of the stack
+    while (!stack.empty()) {
+        frame_t& f = stack.back();
+        if (returned) {
+            returned = false;
+            f.open.merge(ret_open);
+            if (f.wait == frame_t::wait_t::call)
+                f.call = ret;
+            else {
+                if (ret)
+                    merge(f.result, {.cycles = f.edges[f.edge].cycles + f.call->cycles + ret->cycles,
+                                     .loops = f.call->loops || ret->loops,
+                                     .unknown = f.edges[f.edge].unknown || f.call->unknown || ret->unknown});
+                f.wait = frame_t::wait_t::none;
+                ++f.edge;
+            }
+        }
+        if (f.edge < f.edges.size()) {
+            const edge_t& e = f.edges[f.edge];
+            if (f.wait == frame_t::wait_t::none) {
+                if (e.next == no_next && f.target != no_target) {
+                    ++f.edge; // the end of execution is only a path to no_target
+                    continue;
+                }
+                f.wait = frame_t::wait_t::call;
+                if (e.call) {
+                    returned = query(*e.call, no_target);
+                    continue;
+                }
+                f.call = cost_t{};
+            }
+            if (f.call && e.next != no_next) {
+                f.wait = frame_t::wait_t::next;
+                returned = query(uint16_t(e.next), f.target);
+                continue;
+            }
+            if (f.call) // the end of execution
+                merge(f.result, {.cycles = e.cycles + f.call->cycles, .loops = f.call->loops,
+                                 .unknown = e.unknown || f.call->unknown});
+            f.wait = frame_t::wait_t::none; // or the subroutine does not return
+            ++f.edge;
+            continue;
+        }
+        auto b = loop_bounds.find(f.addr);
+        if (f.target != f.addr && b != loop_bounds.end() && f.result && b->second > 1) {
+            // Compute paths from the loop header back to it
+            f.first = std::exchange(f.result, std::nullopt);
+            f.target = f.addr;
+            f.edge = 0;
+            continue;
+        }
+        if (f.target == f.addr) {
+            if (f.result) {
+                f.first->cycles += (b->second - 1U) * f.result->cycles;
+                f.first->loops |= f.result->loops;
+                f.first->unknown |= f.result->unknown;
             }
+            f.result = f.first;
         }
+        // Results depending on this query are not valid after it is done, this result is valid while the queries
+        // cutting its paths are being computed
+        size_t depth = stack.size() - 1;
+        for (auto k: scoped[depth])
+            memo.erase(k);
+        scoped[depth].clear();
+        f.open.erase(depth);
+        if (!f.open.empty())
+            scoped[*f.open.rbegin()].push_back(f.key);
+        ret = f.result;
+        ret_open = f.open;
+        memo[f.key] = {.done = true, .depth = depth, .cost = f.result, .open = std::move(f.open)};
+        stack.pop_back();
+        returned = true;
+    }
+    return ret;
+}
+
+std::vector<cost_analysis::edge_t> cost_analysis::edges(uint16_t addr) const
+{
+    std::vector<edge_t> result;
+    // Continues by the instruction at next after cycles and a call of a subroutine
+    auto follow = [this, &result](size_t next, uint64_t cycles, std::optional<uint16_t> call = std::nullopt,
+                                  bool unknown = false) {
+        if (next >= bin.size())
+            result.push_back({.cycles = cycles, .unknown = true, .call = call});
+        else
+            result.push_back({.cycles = cycles, .next = uint32_t(next), .unknown = unknown, .call = call});
+    };
+    // Ends execution after cycles
+    auto end = [&result](uint64_t cycles, bool unknown) {
+        result.push_back({.cycles = cycles, .unknown = unknown});
+    };
+    auto instr = _code[addr] ? isa::decode(bin[addr]) : nullptr;
+    if (!instr) {
+        end(0, true); // execution continues to data
+        return result;
+    }
+    uint8_t dst = bin[uint16_t(addr + 1)] >> 4U;
+    uint8_t src = bin[uint16_t(addr + 1)] & 0x0fU;
+    bool cond = isa::conditional(*instr);
+    auto op = uint8_t(cond ? instr->opcode & ~(isa::cond_flag | isa::cond_value) : instr->opcode);
+    bool ldis = op == isa::opcode("ldis") || op == isa::cond_ldis;
+    bool ld = op == isa::opcode("ld") || op == isa::cond_ld;
+    bool writes_pc = dst == isa::reg_pc && !instr->dst_csr &&
+        (instr->dst == isa::access::write || instr->dst == isa::access::read_write);
+    // The instruction after this one, skipping an immediate operand
+    size_t next = addr + (ldis && src == isa::reg_pc ? 4 : 2);
+    // Targets of an indirect jump or call, annotated at the instruction, or at the address of a code pointer
+    // loaded by the preceding instructions set and ld
+    auto indirect = targets.equal_range(addr);
+    if (indirect.first == indirect.second && addr >= 2 && _code[addr - 2] && bin[addr - 2] == isa::opcode("ld") &&
+        bin[addr - 1] == uint8_t(src << 4U | src) && set_by_previous(src, uint16_t(addr - 2)))
+    {
+        indirect = targets.equal_range(word(uint16_t(addr - 4)));
+    }
+    if (op == isa::opcode("reti") || op == isa::opcode("brk") || op == isa::opcode("ill"))
+        end(instr->cycles, false);
+    else if (writes_pc && src == isa::reg_pc && (ld || ldis)) {
+        // A jump to the address in the following word, a conditional ld does not skip the word if not jumping
+        if (!cond && set_by_previous(isa::reg_ca, addr))
+            follow(word(addr - 2), instr->cycles, word(addr + 2)); // a call returning to ca
+        else
+            follow(word(addr + 2), instr->cycles);
+        if (cond)
+            follow(ld ? addr + 2 : next, instr->cycles_false);
+    } else if (op == isa::opcode("exch") && dst == isa::reg_pc) {
+        // A call of a subroutine, its address is known if set by the preceding instruction
+        if (set_by_previous(src, addr))
+            follow(next, instr->cycles, word(addr - 2));
+        else if (indirect.first != indirect.second)
+            for (auto t = indirect.first; t != indirect.second; ++t)
+                follow(next, instr->cycles, t->second);
+        else
+            follow(next, instr->cycles, std::nullopt, true);
+    } else if (writes_pc) {
+        // A return from a subroutine if jumping to ca, otherwise a jump with an unknown target
+        if ((op == isa::opcode("mv") || op == isa::cond_mv) && src == isa::reg_ca)
+            end(instr->cycles, false);
+        else if (indirect.first != indirect.second)
+            for (auto t = indirect.first; t != indirect.second; ++t)
+                follow(t->second, instr->cycles);
+        else
+            end(instr->cycles, true);
+        if (cond)
+            follow(next, instr->cycles_false);
+    } else
+        follow(next, instr->cycles);
+    return result;
+}
+
+std::string cost_analysis::cycles_str(const isa::instr_t& instr)
+{
+    if (isa::conditional(instr))
+        return std::format(" # {}/{} cycles", instr.cycles, instr.cycles_false);
+    return std::format(" # {} cycles", instr.cycles);
+}
+
+/*** name_pool ***************************************************************/
+
+size_t name_pool::slot(std::string_view name) const
+{
+    size_t mask = slots.size() - 1;
+    for (size_t i = std::hash<std::string_view>{}(name) & mask;; i = (i + 1) & mask)
+        if (slots[i] == empty || names[slots[i]] == name)
+            return i;
+}
+
+std::optional<name_id_t> name_pool::find(std::string_view name) const
+{
+    if (slots.empty())
+        return std::nullopt;
+    if (auto id = slots[slot(name)]; id != empty)
+        return id;
+    return std::nullopt;
+}
+
+name_id_t name_pool::intern(std::string_view name)
+{
+    if (auto id = find(name))
+        return *id;
+    if (2 * (names.size() + 1) > slots.size()) {
+        slots.assign(std::max(size_t{64}, 2 * slots.size()), empty);
+        for (name_id_t id = 0; id < names.size(); ++id)
+            slots[slot(names[id])] = id;
+    }
+    names.emplace_back(name);
+    auto id = name_id_t(names.size() - 1);
+    slots[slot(name)] = id;
+    return id;
+}
+
+/*** assembler ***************************************************************/
+
+assembler::assembler(const input& in, input::files_t::const_iterator top, output& out, bool verbose,
+                     bool relocatable, bool optimize, changes_t changes):
+    in(in), top(top), out(out), verbose(verbose),
+    predef_symbols{names, {
+        {"sp", predef_reg(11, false)},
+        {"ca", predef_reg(12, false)},
+        {"ia", predef_reg(13, false)},
+        {"f", predef_reg(14, false)},
+        {"pc", predef_reg(15, false)},
+        {"__addr", std::make_shared<symbol_t>(var_t{expr_leaf({.op = expr_op::addr})})},
+    }},
+    relocatable(relocatable), optimize(optimize), changes(std::move(changes)), module(top)
+{
+    for (int i = 0; i <= 15; ++i) {
+        predef_symbols.emplace(names.intern(std::format("r{}", i)), predef_reg(uint8_t(i), false));
+        predef_symbols.emplace(names.intern(std::format("csr{}", i)), predef_reg(uint8_t(i), true));
     }
 }
 
-bool assembler::define_const(input::files_t::const_iterator file, std::string name,
-                             std::shared_ptr<assembler::expr_base> expr)
+bool assembler::define_const(input::files_t::const_iterator file, name_id_t name, expr_t expr)
 {
     if (predef_symbols.contains(name))
         return false;
     if (auto it = symbols.find(file); it == symbols.end())
         throw fatal_error("Parsed file not in assembler::symbols ($const definition)");
     else
-        if (auto [sym_it, added] = it->second.emplace(std::move(name),
-                                                      std::make_shared<symbol_t>(var_t{.expr = std::move(expr)}));
+        if (auto [sym_it, added] = it->second.emplace(name,
+                                                      std::make_shared<symbol_t>(var_t{.expr = expr}));
             added)
         {
             define_global(sym_it->first, sym_it->second, false);
@@ -836,16 +1565,16 @@ bool assembler::define_const(input::files_t::const_iterator file, std::string na
             return false;
 }
 
-void assembler::define_global(std::string name, std::shared_ptr<symbol_t> symbol, bool multi)
+void assembler::define_global(name_id_t name, std::shared_ptr<symbol_t> symbol, bool multi)
 {
-    if (auto gl_it = global_symbols.find(name); gl_it != global_symbols.end()) {
+    if (auto gl = global_symbols.find(name)) {
         if (!multi)
-            gl_it->second = nullptr; // multiple definitions
+            *gl = nullptr; // multiple definitions
     } else
-        global_symbols.emplace(std::move(name), std::move(symbol));
+        global_symbols.emplace(name, std::move(symbol));
 }
 
-bool assembler::define_label(input::files_t::const_iterator file, std::string name, std::optional<uint16_t> addr,
+bool assembler::define_label(input::files_t::const_iterator file, name_id_t name, std::optional<uint16_t> addr,
                              bool global)
 {
     if (predef_symbols.contains(name))
@@ -863,28 +1592,28 @@ bool assembler::define_label(input::files_t::const_iterator file, std::string na
     else {
         std::shared_ptr<symbol_t> symbol{};
         label_t* label = nullptr;
-        auto gl_it = global_symbols.find(name);
-        if (gl_it != global_symbols.end() && gl_it->second) {
-            label = std::get_if<label_t>(gl_it->second.get());
+        auto gl = global_symbols.find(name);
+        if (gl && *gl) {
+            label = std::get_if<label_t>(gl->get());
             if (label) {
                 // globally defined as label
                 if (global)
-                    symbol = gl_it->second;
+                    symbol = *gl;
                 if (addr) {
                     if (label->value()) {
                         if (label->fixed())
                             return false; // already defined and referenced, cannot undefine
-                        gl_it->second = nullptr; // multiple definitions of this label
+                        *gl = nullptr; // multiple definitions of this label
                     } else
                         label->set(*addr);
                 }
             } else
-                gl_it->second = nullptr; // globally defined as not a label
+                *gl = nullptr; // globally defined as not a label
         }
         if (!symbol)
             symbol = std::make_shared<symbol_t>(label_t{addr, false}); // not yet referenced as global label
-        if (auto [sym_it, added] = it->second.emplace(std::move(name), symbol); added) {
-            if (gl_it == global_symbols.end())
+        if (auto [sym_it, added] = it->second.emplace(name, symbol); added) {
+            if (!gl)
                 define_global(sym_it->first, sym_it->second, !addr); // not defined, define with unknown or known value
             return true;
         } else
@@ -899,20 +1628,22 @@ bool assembler::define_label(input::files_t::const_iterator file, std::string na
     }
 }
 
-bool assembler::define_macro(input::files_t::const_iterator file, std::string name, input::text_span full_replace,
-                             input::text_span replace, std::vector<std::string> params)
+bool assembler::define_macro(input::files_t::const_iterator file, name_id_t name, input::text_span full_replace,
+                             input::text_span replace, std::span<const line_t> split_replace,
+                             std::vector<name_id_t> params)
 {
-    if (predef_symbols.contains(name) || opcodes.contains(name))
+    if (predef_symbols.contains(name) || isa::find(names.name(name)))
         return false;
     if (auto it = symbols.find(file); it == symbols.end())
         throw fatal_error("Parsed file not in assembler::symbols ($macro definition)");
     else
-        if (auto [sym_it, added] = it->second.emplace(std::move(name),
+        if (auto [sym_it, added] = it->second.emplace(name,
                                                       std::make_shared<symbol_t>(macro_t{
                                                           .params = std::move(params),
                                                           .file = file,
                                                           .full_replace = full_replace,
                                                           .replace = replace,
+                                                          .split_replace = split_replace,
                                                           .order = macro_def_order++,
                                                       }));
             added)
@@ -926,18 +1657,20 @@ bool assembler::define_macro(input::files_t::const_iterator file, std::string na
 std::pair<const assembler::symbol_t*, bool>
 assembler::find_symbol(input::files_t::const_iterator file, const parser::ident_t& id, bool def_as_label)
 {
+    // A name not interned yet is not a key in any symbol table
+    auto name = names.find(id.name);
     if (id.name_space) {
         if (id.name_space->empty()) {
             // .id: unqualified name (global)
-            if (auto it = global_symbols.find(id.name); it != global_symbols.end()) {
-                if (auto label = std::get_if<label_t>(it->second.get()))
+            if (auto gl = name ? global_symbols.find(*name) : nullptr) {
+                if (auto label = std::get_if<label_t>(gl->get()))
                     label->fix(); // referenced global label, it must not become undefined
-                return {it->second.get(), true};
+                return {gl->get(), true};
             } else
-                if (def_as_label && define_label(file, id.name, std::nullopt, true) &&
-                    (it = global_symbols.find(id.name)) != global_symbols.end())
+                if (def_as_label && define_label(file, *(name = names.intern(id.name)), std::nullopt, true) &&
+                    (gl = global_symbols.find(*name)))
                 {
-                    return {it->second.get(), true};
+                    return {gl->get(), true};
                 } else
                     return {nullptr, false};
         } else {
@@ -949,24 +1682,236 @@ assembler::find_symbol(input::files_t::const_iterator file, const parser::ident_
         }
     } else {
         // id: predefined name
-        if (auto it = predef_symbols.find(id.name); it != predef_symbols.end())
-            return {it->second.get(), true};
+        if (auto p = name ? predef_symbols.find(*name) : nullptr)
+            return {p->get(), true};
     }
     // id: local name; namespace.id: qualified name
     if (auto sym_it = symbols.find(file); sym_it == symbols.end())
         throw fatal_error{std::format("File \"{}\" does not have a symbol table", file->first.string())};
     else
-        if (auto it = sym_it->second.find(id.name); it != sym_it->second.end())
-            return {it->second.get(), true};
+        if (auto sym = name ? sym_it->second.find(*name) : nullptr)
+            return {sym->get(), true};
         else
-            if (def_as_label && define_label(file, id.name, std::nullopt, false) &&
-                (it = sym_it->second.find(id.name)) != sym_it->second.end())
+            if (def_as_label && define_label(file, *(name = names.intern(id.name)), std::nullopt, false) &&
+                (sym = sym_it->second.find(*name)))
             {
-                return {it->second.get(), true};
+                return {sym->get(), true};
             } else
                 return {nullptr, false};
 }
 
+assembler::expr_t assembler::expr_leaf(expr_node_t node)
+{
+    expr_nodes.push_back(node);
+    return {uint32_t(expr_nodes.size() - 1), 1};
+}
+
+assembler::expr_t assembler::expr_copy(expr_t e)
+{
+    auto begin = uint32_t(expr_nodes.size());
+    expr_nodes.reserve(begin + e.size);
+    for (uint32_t i = 0; i < e.size; ++i)
+        expr_nodes.push_back(expr_nodes[e.begin + i]);
+    return {begin, e.size};
+}
+
+assembler::expr_t assembler::expr_unop(expr_op op, expr_t inner)
+{
+    if (inner.begin + inner.size != expr_nodes.size())
+        throw fatal_error("Operand of unary operator is not the last expression");
+    // constant folding
+    if (auto& i = expr_nodes.back(); inner.size == 1 && i.op == expr_op::constant) {
+        i.value = uint16_t(op == expr_op::bit_not ? ~i.value : -i.value);
+        return inner;
+    }
+    expr_nodes.push_back({.op = op});
+    return {inner.begin, inner.size + 1};
+}
+
+assembler::expr_t assembler::expr_binop(expr_op op, expr_t left, expr_t right)
+{
+    if (left.begin + left.size != right.begin || right.begin + right.size != expr_nodes.size())
+        throw fatal_error("Operands of binary operator are not the last expressions");
+    // constant folding, division by zero is left for reporting by eval()
+    if (auto& l = expr_nodes[left.begin], r = expr_nodes[right.begin];
+        left.size == 1 && right.size == 1 && l.op == expr_op::constant && r.op == expr_op::constant &&
+        ((op != expr_op::div && op != expr_op::rem) || r.value != 0))
+    {
+        l.value = eval_binop(op, l.value, r.value);
+        l.addr = l.addr || r.addr;
+        expr_nodes.pop_back();
+        return left;
+    }
+    expr_nodes.push_back({.op = op});
+    return {left.begin, left.size + right.size + 1};
+}
+
+std::shared_ptr<assembler::symbol_t> assembler::predef_reg(uint8_t idx, bool csr)
+{
+    return std::make_shared<symbol_t>(var_t{expr_leaf({.op = expr_op::reg, .csr = csr, .value = idx})});
+}
+
+bool assembler::is_number(expr_t e) const
+{
+    auto op = expr_nodes[e.begin + e.size - 1].op;
+    return op != expr_op::reg && op != expr_op::bytes;
+}
+
+std::optional<uint16_t> assembler::eval(expr_t e, bool relative)
+{
+    eval_stack.clear();
+    for (auto&& n: std::span(expr_nodes).subspan(e.begin, e.size))
+        switch (n.op) {
+        case expr_op::constant:
+            eval_stack.emplace_back(n.value);
+            break;
+        case expr_op::label:
+            // in a relocatable object, addresses of labels are assigned by the linker
+            if (relocatable && declaring == 0 && !(relative && local_labels.contains(n.label)))
+                eval_stack.emplace_back(std::nullopt);
+            else
+                eval_stack.push_back(n.label->value());
+            break;
+        case expr_op::addr:
+            eval_stack.emplace_back(cur_addr);
+            break;
+        case expr_op::reg:
+        case expr_op::bytes:
+            eval_stack.emplace_back(std::nullopt);
+            break;
+        case expr_op::bit_or:
+        case expr_op::bit_xor:
+        case expr_op::bit_and:
+        case expr_op::shl:
+        case expr_op::shr:
+        case expr_op::add:
+        case expr_op::sub:
+        case expr_op::mul:
+        case expr_op::div:
+        case expr_op::rem:
+            if (auto r = eval_stack.back(); eval_stack.pop_back(), eval_stack.back() && r)
+                eval_stack.back() = eval_binop(n.op, *eval_stack.back(), *r);
+            else
+                eval_stack.back() = std::nullopt;
+            break;
+        case expr_op::bit_not:
+            if (auto& i = eval_stack.back())
+                i = uint16_t(~*i);
+            break;
+        case expr_op::neg:
+            if (auto& i = eval_stack.back())
+                i = uint16_t(-*i);
+            break;
+        default:
+            throw fatal_error("Invalid expression node");
+        }
+    if (eval_stack.size() != 1)
+        throw fatal_error("Invalid expression");
+    return eval_stack.back();
+}
+
+uint16_t assembler::eval_binop(expr_op op, uint16_t l, uint16_t r)
+{
+    switch (op) {
+    case expr_op::bit_or:
+        return uint16_t(l | r);
+    case expr_op::bit_xor:
+        return uint16_t(l ^ r);
+    case expr_op::bit_and:
+        return uint16_t(l & r);
+    case expr_op::shl:
+        return uint16_t(l << std::min(r, uint16_t(16)));
+    case expr_op::shr:
+        return uint16_t(l >> std::min(r, uint16_t(16)));
+    case expr_op::add:
+        return uint16_t(l + r);
+    case expr_op::sub:
+        return uint16_t(l - r);
+    case expr_op::mul:
+        return uint16_t(l * r);
+    case expr_op::div:
+        if (r == 0)
+            throw eval_error("Division by zero");
+        return uint16_t(l / r);
+    case expr_op::rem:
+        if (r == 0)
+            throw eval_error("Division by zero");
+        return uint16_t(l % r);
+    case expr_op::constant:
+    case expr_op::label:
+    case expr_op::addr:
+    case expr_op::reg:
+    case expr_op::bytes:
+    case expr_op::bit_not:
+    case expr_op::neg:
+    default:
+        break;
+    }
+    throw fatal_error("Not a binary operator");
+}
+
+constexpr std::string_view assembler::expr_op_str(expr_op op)
+{
+    switch (op) {
+    case expr_op::bit_or:
+        return "|";
+    case expr_op::bit_xor:
+        return "^";
+    case expr_op::bit_and:
+        return "&";
+    case expr_op::shl:
+        return "<<";
+    case expr_op::shr:
+        return ">>";
+    case expr_op::add:
+        return "+";
+    case expr_op::sub:
+        return "-";
+    case expr_op::mul:
+        return "*";
+    case expr_op::div:
+        return "/";
+    case expr_op::rem:
+        return "%";
+    case expr_op::constant:
+    case expr_op::label:
+    case expr_op::addr:
+    case expr_op::reg:
+    case expr_op::bytes:
+    case expr_op::bit_not:
+    case expr_op::neg:
+    default:
+        break;
+    }
+    return {};
+}
+
+std::optional<std::vector<uint8_t>> assembler::eval_bytes(expr_t e)
+{
+    if (auto& n = expr_nodes[e.begin + e.size - 1]; n.op == expr_op::bytes) {
+        auto b = expr_bytes.begin() + n.bytes;
+        return std::vector<uint8_t>(b, b + n.value);
+    }
+    if (auto val = eval(e))
+        return {{uint8_t(*val % 256U)}};
+    else
+        return std::nullopt;
+}
+
+std::optional<std::pair<uint8_t, bool>> assembler::eval_reg(expr_t e) const
+{
+    if (auto& n = expr_nodes[e.begin + e.size - 1]; n.op == expr_op::reg)
+        return {{uint8_t(n.value), n.csr}};
+    return std::nullopt;
+}
+
+std::string assembler::eval_reg_str(expr_t e) const
+{
+    if (auto r = eval_reg(e))
+        return std::format("{}r{}", r->second ? "cs" : "", r->first);
+    return "?";
+}
+
 assembler::parse_expr_t
 assembler::parse_expr(std::string_view s, input::files_t::const_iterator file, macro_args_t* macro_args,
                       parser::id_macro_t macro_id)
@@ -983,45 +1928,48 @@ std::pair<assembler::parse_expr_t, std::string_view>
 assembler::parse_expr0_or(std::string_view s, input::files_t::const_iterator file, macro_args_t* macro_args,
                           parser::id_macro_t macro_id)
 {
-    return parse_expr_binary<&assembler::parse_expr1_xor, expr_or>(s, file, macro_args, macro_id);
+    return parse_expr_binary<&assembler::parse_expr1_xor, expr_op::bit_or>(s, file, macro_args, macro_id);
 }
 
 std::pair<assembler::parse_expr_t, std::string_view>
 assembler::parse_expr1_xor(std::string_view s, input::files_t::const_iterator file, macro_args_t* macro_args,
                            parser::id_macro_t macro_id)
 {
-    return parse_expr_binary<&assembler::parse_expr2_and, expr_xor>(s, file, macro_args, macro_id);
+    return parse_expr_binary<&assembler::parse_expr2_and, expr_op::bit_xor>(s, file, macro_args, macro_id);
 }
 
 std::pair<assembler::parse_expr_t, std::string_view>
 assembler::parse_expr2_and(std::string_view s, input::files_t::const_iterator file, macro_args_t* macro_args,
                            parser::id_macro_t macro_id)
 {
-    return parse_expr_binary<&assembler::parse_expr3_shift, expr_and>(s, file, macro_args, macro_id);
+    return parse_expr_binary<&assembler::parse_expr3_shift, expr_op::bit_and>(s, file, macro_args, macro_id);
 }
 
 std::pair<assembler::parse_expr_t, std::string_view>
 assembler::parse_expr3_shift(std::string_view s, input::files_t::const_iterator file, macro_args_t* macro_args,
                              parser::id_macro_t macro_id)
 {
-    return parse_expr_binary<&assembler::parse_expr4_additive, expr_shl, expr_shr>(s, file, macro_args, macro_id);
+    return parse_expr_binary<&assembler::parse_expr4_additive, expr_op::shl,
+                             expr_op::shr>(s, file, macro_args, macro_id);
 }
 
 std::pair<assembler::parse_expr_t, std::string_view>
 assembler::parse_expr4_additive(std::string_view s, input::files_t::const_iterator file, macro_args_t* macro_args,
                                 parser::id_macro_t macro_id)
 {
-    return parse_expr_binary<&assembler::parse_expr5_multiplicative, expr_add, expr_sub>(s, file, macro_args, macro_id);
+    return parse_expr_binary<&assembler::parse_expr5_multiplicative, expr_op::add,
+                             expr_op::sub>(s, file, macro_args, macro_id);
 }
 
 std::pair<assembler::parse_expr_t, std::string_view>
 assembler::parse_expr5_multiplicative(std::string_view s, input::files_t::const_iterator file, macro_args_t* macro_args,
                                       parser::id_macro_t macro_id)
 {
-    return parse_expr_binary<&assembler::parse_expr_unary, expr_mul, expr_div, expr_rem>(s, file, macro_args, macro_id);
+    return parse_expr_binary<&assembler::parse_expr_unary, expr_op::mul, expr_op::div,
+                             expr_op::rem>(s, file, macro_args, macro_id);
 }
 
-template<assembler::parse_fun_t F, std::derived_from<assembler::expr_base> ...E>
+template<assembler::parse_fun_t F, assembler::expr_op ...Op>
 std::pair<assembler::parse_expr_t, std::string_view>
 assembler::parse_expr_binary(std::string_view s, input::files_t::const_iterator file, macro_args_t* macro_args,
                              parser::id_macro_t macro_id)
@@ -1035,23 +1983,25 @@ assembler::parse_expr_binary(std::string_view s, input::files_t::const_iterator
             ++it;
         if (it == result.second.end())
             return result;
-        auto branch = [&]<class T>(T*) -> bool {
-            if (!std::string_view(it, result.second.end()).starts_with(T::op))
+        auto branch = [&](expr_op op) -> bool {
+            std::string_view op_str = expr_op_str(op);
+            if (!std::string_view(it, result.second.end()).starts_with(op_str))
                 return false;
-            if (!dynamic_cast<expr_number*>(result.first->get())) {
+            if (!is_number(*result.first)) {
                 result =
                     {std::unexpected(std::format("Unexpected '{}' after non-numeric expression", *it)), result.second};
-            } else if (auto right = (this->*F)({it  + T::op.size(),  result.second.end()}, file, macro_args, macro_id);
+            } else if (auto right = (this->*F)({it  + op_str.size(),  result.second.end()}, file, macro_args, macro_id);
                        !right.first)
             {
                 result = std::move(right);
-            } else if (!dynamic_cast<expr_number*>(right.first->get()))
-                result = {std::unexpected(std::format("Unexpected non-numeric expression after '{}'", *it)), right.second};
-            else
-                result = {std::make_shared<T>(std::move(*result.first), std::move(*right.first)), right.second};
+            } else if (!is_number(*right.first)) {
+                result =
+                    {std::unexpected(std::format("Unexpected non-numeric expression after '{}'", *it)), right.second};
+            } else
+                result = {expr_binop(op, *result.first, *right.first), right.second};
             return true;
         };
-        if (!(... || branch(static_cast<E*>(nullptr))) || !result.first)
+        if (!(... || branch(Op)) || !result.first)
             return result;
     }
 }
@@ -1078,30 +2028,50 @@ assembler::parse_expr_term(std::string_view s, input::files_t::const_iterator fi
         return {inner.first, {++it, inner.second.end()}};
     }
     if (auto ident = parser::identifier(s, false, macro_id); ident.first) {
-        if (auto ma = macro_args && !ident.first->name_space ?
-            std::optional{macro_args->find(ident.first->name)} : std::nullopt; ma && *ma != macro_args->end())
-        {
-            return {(*ma)->second, ident.second};
-        }
+        if (auto name = macro_args && !ident.first->name_space ? names.find(ident.first->name) : std::nullopt)
+            if (auto arg = macro_args->find(*name))
+                return {expr_copy(*arg), ident.second};
         auto [symbol, defined] = find_symbol(file, *ident.first, true);
         if (!symbol && defined)
             return {std::unexpected(std::format("Multiple definitions of unqualified value name \"{}\"",
                                                 *ident.first)), s};
         if (!symbol)
             return {std::unexpected(std::format("Undefined symbol \"{}\"", *ident.first)), s};
-        if (auto label = std::get_if<label_t>(symbol))
-            return {{std::make_shared<expr_label>(*label)}, ident.second};
-        else if (auto var = std::get_if<var_t>(symbol))
-            return {{var->expr->fixed_clone(var->expr)}, ident.second};
+        if (auto label = std::get_if<label_t>(symbol)) {
+            // only labels not defined yet remain for the second phase, all labels in a relocatable object
+            if (auto v = label->value(); v && !relocatable)
+                return {expr_leaf({.op = expr_op::constant, .addr = true, .value = *v}), ident.second};
+            return {expr_leaf({.op = expr_op::label, .label = label}), ident.second};
+        }
+        else if (auto var = std::get_if<var_t>(symbol)) {
+            // symbol __addr referenced by a constant gets the address at the point of the reference
+            if (var->expr.size == 1 && expr_nodes[var->expr.begin].op == expr_op::addr) {
+                if (relocatable) {
+                    // the address is known only after linking
+                    const label_t& l = addr_labels.emplace_back(cur_addr);
+                    if (declaring == 0)
+                        local_labels.insert(&l);
+                    return {expr_leaf({.op = expr_op::label, .label = &l}), ident.second};
+                }
+                return {expr_leaf({.op = expr_op::constant, .addr = true, .value = cur_addr}), ident.second};
+            }
+            return {expr_copy(var->expr), ident.second};
+        }
         else if (std::get_if<macro_t>(symbol))
             return {std::unexpected(std::format("Reference to macro \"{}\" in expression", *ident.first)), s};
         else
             throw fatal_error{"Unexpected type of symbol in expression"};
     }
     if (auto number = parser::number_unsigned(s, false); number.first)
-        return {{std::make_shared<expr_const>(number.first->val)}, number.second};
-    if (auto bytes = parser::bytes(s, false); bytes.first)
-        return {{std::make_shared<expr_bytes>(*bytes.first)}, bytes.second};
+        return {expr_leaf({.op = expr_op::constant, .value = number.first->val}), number.second};
+    if (auto bytes = parser::bytes(s, false); bytes.first) {
+        if (bytes.first->size() > std::numeric_limits<uint16_t>::max())
+            return {std::unexpected("Too long sequence of bytes"), s};
+        auto begin = uint32_t(expr_bytes.size());
+        expr_bytes.insert(expr_bytes.end(), bytes.first->begin(), bytes.first->end());
+        return {expr_leaf({.op = expr_op::bytes, .value = uint16_t(bytes.first->size()), .bytes = begin}),
+                bytes.second};
+    }
     return {std::unexpected("Expected symbol, constant, or parenthesized subexpression in expression"), s};
 }
 
@@ -1119,105 +2089,648 @@ assembler::parse_expr_unary(std::string_view s, input::files_t::const_iterator f
         auto inner = parse_expr_term(s.substr(1), file, macro_args, macro_id);
         if (!inner.first)
             return inner;
-        if (!dynamic_cast<expr_number*>(inner.first->get()))
+        if (!is_number(*inner.first))
             return {std::unexpected(std::format("Unexpected non-numeric expression after '{}'", *it)), inner.second};
         switch (*it) {
         case '~':
-            return {std::make_shared<expr_not>(*inner.first), inner.second};
+            return {expr_unop(expr_op::bit_not, *inner.first), inner.second};
         case '-':
-            return {std::make_shared<expr_neg>(*inner.first), inner.second};
+            return {expr_unop(expr_op::neg, *inner.first), inner.second};
         default:
             std::unreachable();
         }
-    } else
-        return parse_expr_term(s, file, macro_args, macro_id);
+    } else
+        return parse_expr_term(s, file, macro_args, macro_id);
+}
+
+std::string_view assembler::remove_comment(std::string_view line)
+{
+    bool in_char = false;
+    bool in_str = false;
+    size_t i = 0;
+    for (; (i = scan_special(line, i)) < line.size() && (in_char || in_str || line[i] != '#'); ++i) {
+        switch (line[i]) {
+        case '\'':
+            if (in_char)
+                in_char = false;
+            else if (!in_str)
+                in_char = true;
+            break;
+        case '"':
+            if (in_str)
+                in_str = false;
+            else if (!in_char)
+                in_str = true;
+            break;
+        case '\\':
+            if (i + 1 != line.size())
+                ++i;
+            break;
+        default:
+            break;
+        }
+    }
+    std::string_view result = line.substr(0, i);
+    if (result.find_first_not_of(whitespace_chars) == std::string_view::npos)
+        return {};
+    return result;
+}
+
+void assembler::run()
+{
+    if (verbose)
+        *diag << "Begin compilation" << std::endl;
+    const input::files_t& files = in.files();
+    symbols.emplace(std::piecewise_construct, std::forward_as_tuple(top), std::forward_as_tuple());
+    run_file(files, top);
+    if (verbose)
+        *diag << "End compilation" << std::endl;
+    // Symbol tables are not ordered, undefined labels are reported sorted by name
+    auto undef_labels = [this](const symbol_table_t& table) {
+        std::set<std::string_view> result;
+        for (auto&& s: table)
+            if (auto l = std::get_if<label_t>(s.second.get()); l && !l->value())
+                result.insert(names.name(s.first));
+        return result;
+    };
+    bool undef = false;
+    for (auto&& t: symbols)
+        for (auto&& s: undef_labels(t.second)) {
+            if (!undef) {
+                *diag << "Undefined labels:" << std::endl;
+                undef = true;
+            }
+            *diag << t.first->first.string() << ": " << s << std::endl;
+        }
+    bool undef_gl = false;
+    // In a relocatable object, global labels can be defined by other objects
+    for (auto&& s: relocatable ? std::set<std::string_view>{} : undef_labels(global_symbols)) {
+        if (!undef_gl) {
+            *diag << "Undefined unqualified (global) labels:" << std::endl;
+            undef_gl = true;
+        }
+        *diag << '.' << s << std::endl;
+    }
+    if (undef || undef_gl) {
+        *diag << "Cannot resolve labels in the second phase" << std::endl;
+        throw silent_error{};
+    }
+    if (relocatable)
+        return; // the second phase is done by the linker
+    for (auto&& p: phase2)
+        try {
+            if (auto v = eval(p.expr)) {
+                if (p.word)
+                    out.set_word(p.addr, *v);
+                else
+                    out.set_byte(p.addr, uint8_t(*v % 256));
+            } else
+                throw fatal_error{"Cannot evaluate an expression in the second phase"};
+        } catch (eval_error& e) {
+            *diag << src_pos(p.path, p.line) << "Cannot evaluate an expression in the second phase: " <<
+                e.what() << std::endl;
+            throw silent_error{};
+        }
+    // Jumps redirected by the optimizer
+    for (auto&& [i, c]: changes)
+        if (c.target)
+            out.set_word(items[i].addr, items[*c.target].addr);
+    // Labels and constants for debug information, qualified by all namespaces of their files
+    std::map<const input::files_t::value_type*, std::set<std::string>> name_spaces{{&*top, {""}}};
+    for (auto&& f: files)
+        for (auto&& ns: f.second.name_spaces)
+            name_spaces[&*ns.second].insert(ns.first);
+    auto add_symbol = [this](std::string name, const symbol_t* sym) {
+        if (auto l = std::get_if<label_t>(sym); l && l->value())
+            out.add_symbol(std::move(name), *l->value(), true);
+        else if (auto v = std::get_if<var_t>(sym))
+            try {
+                if (auto val = eval(v->expr))
+                    out.add_symbol(std::move(name), *val, false);
+            } catch (const eval_error&) {
+                ; // not a numeric constant
+            }
+    };
+    for (auto&& t: symbols)
+        for (auto&& ns: name_spaces[&*t.first])
+            for (auto&& s: t.second)
+                add_symbol(ns.empty() ? names.name(s.first) : std::format("{}.{}", ns, names.name(s.first)),
+                           s.second.get());
+    for (auto&& s: global_symbols)
+        if (s.second)
+            add_symbol("."s.append(names.name(s.first)), s.second.get());
+}
+
+void assembler::write_object()
+{
+    namespace of = object_file;
+    std::vector<char> strings;
+    auto add_string = [&strings](std::string_view s) {
+        of::string_t result{.offset = uint32_t(strings.size()), .size = uint32_t(s.size())};
+        strings.insert(strings.end(), s.begin(), s.end());
+        return result;
+    };
+    std::vector<of::string_t> files;
+    std::map<const sfs::path*, uint32_t> file_idx;
+    auto add_file = [&](const sfs::path* f) {
+        auto [it, added] = file_idx.try_emplace(f, uint32_t(files.size()));
+        if (added)
+            files.push_back(add_string(f->native()));
+        return it->second;
+    };
+    // Labels of other modules are referenced by the file and the name, or by the unqualified name
+    std::map<const label_t*, std::pair<const sfs::path*, name_id_t>> ref_labels;
+    for (auto&& [f, table]: symbols)
+        for (auto&& s: table)
+            if (auto l = std::get_if<label_t>(s.second.get()))
+                ref_labels.try_emplace(l, &f->first, s.first);
+    for (auto&& s: global_symbols)
+        if (auto l = std::get_if<label_t>(s.second.get()))
+            ref_labels.try_emplace(l, nullptr, s.first);
+    std::vector<of::ref_t> refs;
+    std::map<std::pair<const sfs::path*, name_id_t>, uint32_t> ref_idx;
+    std::vector<of::node_t> nodes;
+    auto add_expr = [&](expr_t e) -> std::expected<of::expr_t, std::string> {
+        of::expr_t result{.begin = uint32_t(nodes.size()), .size = e.size};
+        for (auto&& n: std::span(expr_nodes).subspan(e.begin, e.size)) {
+            of::node_t node{.op = of::op_t::constant, .value = n.value, .ref = 0};
+            switch (n.op) {
+            case expr_op::constant:
+                break;
+            case expr_op::label:
+                if (local_labels.contains(n.label))
+                    node = {.op = of::op_t::local, .value = n.label->value().value_or(0), .ref = 0};
+                else if (auto it = ref_labels.find(n.label); it != ref_labels.end()) {
+                    auto [r, added] = ref_idx.try_emplace(it->second, uint32_t(refs.size()));
+                    if (added)
+                        refs.push_back({.file = add_string(it->second.first ? it->second.first->native() : ""),
+                                        .name = add_string(names.name(it->second.second))});
+                    node = {.op = of::op_t::ref, .value = 0, .ref = r->second};
+                } else
+                    return std::unexpected("Address in another module is not a label");
+                break;
+            case expr_op::bit_or:
+                node.op = of::op_t::bit_or;
+                break;
+            case expr_op::bit_xor:
+                node.op = of::op_t::bit_xor;
+                break;
+            case expr_op::bit_and:
+                node.op = of::op_t::bit_and;
+                break;
+            case expr_op::shl:
+                node.op = of::op_t::shl;
+                break;
+            case expr_op::shr:
+                node.op = of::op_t::shr;
+                break;
+            case expr_op::add:
+                node.op = of::op_t::add;
+                break;
+            case expr_op::sub:
+                node.op = of::op_t::sub;
+                break;
+            case expr_op::mul:
+                node.op = of::op_t::mul;
+                break;
+            case expr_op::div:
+                node.op = of::op_t::div;
+                break;
+            case expr_op::rem:
+                node.op = of::op_t::rem;
+                break;
+            case expr_op::bit_not:
+                node.op = of::op_t::bit_not;
+                break;
+            case expr_op::neg:
+                node.op = of::op_t::neg;
+                break;
+            case expr_op::addr:
+            case expr_op::reg:
+            case expr_op::bytes:
+            default:
+                return std::unexpected("Expression is not a number");
+            }
+            nodes.push_back(node);
+        }
+        return result;
+    };
+    std::vector<of::fixup_t> fixups;
+    for (auto&& p: phase2)
+        if (auto e = add_expr(p.expr))
+            fixups.push_back({.expr = *e, .offset = p.addr, .word = uint16_t(p.word), .file = add_file(&p.path),
+                              .line = uint32_t(p.line)});
+        else {
+            *diag << src_pos(p.path, p.line) << "Cannot create relocation: " << e.error() << std::endl;
+            throw silent_error{};
+        }
+    // Labels and constants of the top level scope; constants that are not numbers are omitted
+    std::vector<of::symbol_t> exports;
+    for (auto&& s: symbols.find(top)->second)
+        if (auto l = std::get_if<label_t>(s.second.get()); l && local_labels.contains(l)) {
+            exports.push_back({.name = add_string(names.name(s.first)),
+                               .expr = {.begin = uint32_t(nodes.size()), .size = 1}, .label = 1});
+            nodes.push_back({.op = of::op_t::local, .value = l->value().value_or(0), .ref = 0});
+        } else if (auto v = std::get_if<var_t>(s.second.get())) {
+            auto nodes_size = nodes.size();
+            if (auto e = add_expr(v->expr))
+                exports.push_back({.name = add_string(names.name(s.first)), .expr = *e, .label = 0});
+            else
+                nodes.resize(nodes_size);
+        }
+    std::vector<of::use_t> uses;
+    for (auto&& u: object_uses)
+        uses.push_back({.name_space = add_string(u.first), .file = add_string(u.second->first.native())});
+    // Code and debug information of the module, without included files
+    auto seg = out.segment(object_mark);
+    size_t code_begin = 0x10000;
+    size_t code_end = 0;
+    for (auto&& l: seg.text)
+        if (l.addr && !l.bytes.empty()) {
+            code_begin = std::min(code_begin, size_t{*l.addr});
+            code_end = std::max(code_end, *l.addr + l.bytes.size());
+        }
+    code_begin = std::min(code_begin, code_end);
+    std::vector<uint8_t> code(code_end - code_begin);
+    for (auto&& l: seg.text)
+        if (l.addr)
+            std::ranges::copy(l.bytes, code.begin() + ptrdiff_t(*l.addr - code_begin));
+    std::vector<debug_info::line_t> lines;
+    for (auto&& l: seg.dbg_lines)
+        lines.push_back({.addr = l.addr, .size = l.size, .level = l.level, .reserved = 0, .file = add_file(l.loc.file),
+                         .line = uint32_t(l.loc.line)});
+
+    of::header_t header{};
+    header.magic = of::magic;
+    header.source = add_string(top->first.native());
+    header.size = uint32_t(std::max(size_t{cur_addr}, code_end));
+    header.code_offset = uint32_t(code_begin);
+    std::vector<of::block_t> blocks;
+    if (object_split)
+        blocks = object_blocks;
+    blocks.push_back({.offset = header.size, .falls = !object_split || object_falls});
+    // Tables with entry sizes that are multiples of 4 precede tables of bytes, hence all tables are aligned
+    auto offset = uint32_t(sizeof(header));
+    auto place = [&offset]<class T>(const std::vector<T>& v) {
+        of::table_t t{.offset = offset, .size = uint32_t(v.size())};
+        offset += uint32_t(v.size() * sizeof(T));
+        return t;
+    };
+    header.uses = place(uses);
+    header.symbols = place(exports);
+    header.fixups = place(fixups);
+    header.nodes = place(nodes);
+    header.refs = place(refs);
+    header.files = place(files);
+    header.lines = place(lines);
+    header.blocks = place(blocks);
+    header.code = place(code);
+    header.strings = place(strings);
+
+    std::string data(reinterpret_cast<const char*>(&header), sizeof(header));
+    auto write_table = [&data]<class T>(const std::vector<T>& v) {
+        data.append(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+    };
+    write_table(uses);
+    write_table(exports);
+    write_table(fixups);
+    write_table(nodes);
+    write_table(refs);
+    write_table(files);
+    write_table(lines);
+    write_table(blocks);
+    write_table(code);
+    write_table(strings);
+    out.write_object(data);
+}
+
+assembler::changes_t assembler::peephole() const
+{
+    using enum isa::access;
+    // Addresses of labels and values of data words computed from addresses, where execution may continue from
+    // elsewhere
+    std::vector<uint8_t> targets(0x10000, 0);
+    auto add_targets = [&targets](auto&& table) {
+        for (auto&& s: table)
+            if (auto l = s.second ? std::get_if<label_t>(s.second.get()) : nullptr; l && l->value())
+                targets[*l->value()] = 1;
+    };
+    for (auto&& t: symbols)
+        add_targets(t.second);
+    add_targets(global_symbols);
+    std::vector<const item_t*> live;
+    for (size_t i = 0; i < items.size(); ++i)
+        if (auto c = changes.find(i); c == changes.end() || !c->second.removes()) {
+            live.push_back(&items[i]);
+            if (items[i].words && !items[i].fixed)
+                for (uint16_t a = 0; a < items[i].size; a += 2)
+                    targets[out.word(uint16_t(items[i].addr + a))] = 1;
+        }
+    constexpr size_t npos = std::numeric_limits<size_t>::max();
+    // Indices to live of instructions by addresses
+    std::vector<size_t> at(0x10000, npos);
+    for (size_t k = 0; k < live.size(); ++k)
+        if (live[k]->instr)
+            at[live[k]->addr] = k;
+    changes_t result = changes;
+    auto index = [this](const item_t* it) { return size_t(it - items.data()); };
+    auto remove = [&](const item_t& it) { result.emplace(index(&it), change_t{.item = it}); };
+    auto replace = [&](const item_t& it, const isa::instr_t* instr, uint8_t regs) {
+        result.emplace(index(&it), change_t{.item = it, .instr = instr, .regs = regs});
+    };
+    // Stores the address of live[k] in the data word live[w]
+    auto redirect = [&](size_t w, size_t k) {
+        result.emplace(index(live[w]), change_t{.item = *live[w], .target = index(live[k])});
+    };
+    // Whether the items live[k]...live[k + n - 1] are not changed yet
+    auto unchanged = [&](size_t k, size_t n) {
+        return std::ranges::none_of(std::span(live).subspan(k, n),
+                                    [&](auto&& it) { return result.contains(index(it)); });
+    };
+    // The item following live[k], if execution can continue to it only from live[k]
+    auto follows = [&](size_t k) -> const item_t* {
+        return k + 1 < live.size() && live[k + 1]->addr == live[k]->addr + live[k]->size &&
+            !targets[live[k + 1]->addr] ? live[k + 1] : nullptr;
+    };
+    // Whether live[k] is followed by a single data word
+    auto word = [&](size_t k) {
+        auto n = follows(k);
+        return n && n->words && n->size == 2;
+    };
+    // Whether live[k] is a jump to the address in the following word: 0 = no, 1 = unconditional, 2 = conditional
+    auto jump = [&](size_t k) {
+        if (k >= live.size())
+            return 0;
+        const item_t& it = *live[k];
+        if (!it.instr || it.regs != (isa::reg_pc << 4U | isa::reg_pc) || !word(k))
+            return 0;
+        if (it.instr->opcode == isa::opcode("ld") || it.instr->opcode == isa::opcode("ldis"))
+            return 1;
+        return (it.instr->opcode & 0xf0U) == isa::cond_ldis ? 2 : 0;
+    };
+    constexpr uint8_t ca_pc = isa::reg_ca << 4U | isa::reg_pc;
+    constexpr uint8_t pc_ca = isa::reg_pc << 4U | isa::reg_ca;
+    // Whether live[k] is a subroutine call, that is, set ca to the address in the following word and exch pc, ca
+    auto call = [&](size_t k) {
+        return live[k]->instr && live[k]->instr->opcode == isa::opcode("ldis") && live[k]->regs == ca_pc &&
+            word(k) && follows(k + 1) && follows(k + 1)->instr &&
+            follows(k + 1)->instr->opcode == isa::opcode("exch") && follows(k + 1)->regs == pc_ca;
+    };
+    // Whether live[k] is an unconditional return from a subroutine
+    auto ret = [&](size_t k) {
+        return live[k]->instr && live[k]->instr->opcode == isa::opcode("mv") && live[k]->regs == pc_ca;
+    };
+    // The index to live of the instruction at addr after following unconditional jumps, npos if there is none
+    auto resolve = [&](uint16_t addr) {
+        size_t k = at[addr];
+        for (size_t n = 0; k != npos && jump(k) == 1 && n < live.size(); ++n)
+            k = at[out.word(live[k + 1]->addr)];
+        return k;
+    };
+    auto writes = [](isa::access a) { return a == write || a == read_write; };
+    // Whether an instruction loads the following word
+    auto immediate = [](const item_t& it) {
+        return (it.regs & 0x0fU) == isa::reg_pc && (it.instr->opcode == isa::opcode("ldis") ||
+                                                     (it.instr->opcode & 0xf0U) == isa::cond_ldis);
+    };
+    // Whether an instruction may continue elsewhere than at the following address
+    auto leaves = [&writes](const item_t& it) {
+        uint8_t op = it.instr->opcode;
+        return (writes(it.instr->dst) && !it.instr->dst_csr && it.regs >> 4U == isa::reg_pc) ||
+            (op == isa::opcode("exch") && (it.regs >> 4U == isa::reg_pc || (it.regs & 0x0fU) == isa::reg_pc)) ||
+            op == isa::opcode("reti") || op == isa::opcode("brk") || op == isa::opcode("ill");
+    };
+    // Whether the flags are overwritten before being read by the code starting at live[k]
+    auto flags_dead = [&](size_t k) {
+        for (auto addr = live[k]->addr; k < live.size() && live[k]->addr == addr && live[k]->instr; ++k) {
+            const item_t& it = *live[k];
+            if (isa::conditional(*it.instr) ||
+                (it.instr->dst != none && !it.instr->dst_csr && it.regs >> 4U == isa::reg_f) ||
+                (it.instr->src != none && !it.instr->src_csr && (it.regs & 0x0fU) == isa::reg_f))
+            {
+                return false;
+            }
+            if (it.instr->flags)
+                return true;
+            if (leaves(it))
+                return false;
+            addr += 2;
+            if (immediate(it) && k + 1 < live.size() && live[k + 1]->addr == addr && !live[k + 1]->instr) {
+                addr += live[k + 1]->size;
+                ++k;
+            }
+        }
+        return false;
+    };
+    // Instructions computing a value from a register, which may replace a set if the flags are not needed
+    constexpr std::array<std::pair<std::string_view, uint16_t (*)(uint16_t)>, 5> derived{{
+        {"inc1", [](uint16_t v) { return uint16_t(v + 1); }},
+        {"inc2", [](uint16_t v) { return uint16_t(v + 2); }},
+        {"dec1", [](uint16_t v) { return uint16_t(v - 1); }},
+        {"dec2", [](uint16_t v) { return uint16_t(v - 2); }},
+        {"not", [](uint16_t v) { return uint16_t(~v); }},
+    }};
+    // Values of registers known at the current item, the flags register is never known
+    std::array<std::optional<uint16_t>, 16> known{};
+    for (size_t j = 0; j < live.size(); ++j) {
+        const item_t& it = *live[j];
+        if (targets[it.addr])
+            known = {};
+        if (!it.instr) {
+            known = {};
+            continue;
+        }
+        const item_t* next = follows(j);
+        uint8_t op = it.instr->opcode;
+        uint8_t dst = it.regs >> 4U;
+        uint8_t src = it.regs & 0x0fU;
+        if (op == isa::opcode("mv") && dst == src && dst != isa::reg_pc) {
+            // nop
+            remove(it);
+            continue;
+        }
+        if (auto kind = jump(j)) {
+            auto target = out.word(next->addr);
+            if (target == next->addr + 2) {
+                // a jump to the next instruction
+                remove(it);
+                remove(*next);
+            } else if (kind == 2 && jump(j + 2) == 1 && follows(j + 1) == live[j + 2] &&
+                       target == live[j + 3]->addr + 2 && unchanged(j, 4))
+            {
+                // a conditional jump over an unconditional jump, replaced by the inverse conditional jump
+                if (auto k = at[out.word(live[j + 3]->addr)]; k != npos) {
+                    replace(it, isa::decode(op ^ isa::cond_value), it.regs);
+                    redirect(j + 1, k);
+                    remove(*live[j + 2]);
+                    remove(*live[j + 3]);
+                    j += 2;
+                }
+            } else if (auto k = resolve(target); k != npos && unchanged(j, 2)) {
+                if (ret(k)) {
+                    // a jump to a return, replaced by the return with the same condition
+                    replace(it, kind == 1 ? isa::find("mv") :
+                            isa::decode(uint8_t(isa::cond_mv | (op & (isa::cond_flag | isa::cond_value)))), pc_ca);
+                    remove(*next);
+                } else if (k != at[target])
+                    // a jump to a jump, replaced by a jump to the final target
+                    redirect(j + 1, k);
+            }
+            known = {};
+            ++j;
+            continue;
+        }
+        if (call(j)) {
+            auto k = resolve(out.word(next->addr));
+            // The final target of an unconditional jump following the call
+            auto g = follows(j + 2) && jump(j + 3) == 1 ? resolve(out.word(live[j + 4]->addr)) : npos;
+            if (k != npos && ret(k) && unchanged(j, 3)) {
+                // a call of a subroutine that only returns
+                remove(it);
+                remove(*live[j + 1]);
+                remove(*live[j + 2]);
+                known[isa::reg_ca].reset();
+                j += 2;
+                continue;
+            }
+            if (k != npos && g != npos && unchanged(j + 1, 4)) {
+                // a call followed by an unconditional jump, replaced by setting the return address to the target
+                // of the jump and jumping to the subroutine
+                redirect(j + 1, g);
+                replace(*live[j + 2], isa::find("ld"), isa::reg_pc << 4U | isa::reg_pc);
+                remove(*live[j + 3]);
+                redirect(j + 4, k);
+                j += 2;
+            } else if (k != npos && k != at[out.word(next->addr)] && unchanged(j + 1, 1))
+                // a call of a jump, replaced by a call of the final target
+                redirect(j + 1, k);
+            known = {};
+            j += 2;
+            continue;
+        }
+        if (op == isa::opcode("ddsto") && dst == isa::reg_sp && src != isa::reg_sp && src != isa::reg_pc && next &&
+            next->instr && next->instr->opcode == isa::opcode("ldis") && next->regs == (src << 4U | isa::reg_sp))
+        {
+            // push immediately followed by pop of the same register
+            remove(it);
+            remove(*next);
+            ++j;
+            continue;
+        }
+        if (op == isa::opcode("ldis") && src == isa::reg_pc && dst != isa::reg_pc && word(j)) {
+            // set of a register
+            ++j;
+            if (!next->fixed || dst == isa::reg_f) {
+                known[dst].reset();
+                continue;
+            }
+            auto v = out.word(next->addr);
+            if (known[dst] == v) {
+                remove(it);
+                remove(*next);
+                continue;
+            }
+            // The cheapest replacement: a copy of a register, then a value computed by an instruction that
+            // modifies the flags
+            std::optional<std::pair<const isa::instr_t*, uint8_t>> subst{};
+            if (auto r = std::ranges::find(known, v); r != known.end())
+                subst = {isa::find("mv"), uint8_t(dst << 4U | (r - known.begin()))};
+            else if (j + 1 < live.size() && flags_dead(j + 1)) {
+                if (v == 0)
+                    subst = {isa::find("xor"), uint8_t(dst << 4U | dst)};
+                for (auto&& [name, f]: derived)
+                    for (uint8_t r = 0; !subst && r < known.size(); ++r)
+                        if (known[r] && f(*known[r]) == v)
+                            subst = {isa::find(name), uint8_t(dst << 4U | r)};
+            }
+            if (subst) {
+                result.emplace(size_t(&it - items.data()),
+                               change_t{.item = it, .instr = subst->first, .regs = subst->second});
+                remove(*next);
+            }
+            known[dst] = v;
+            continue;
+        }
+        if (leaves(it))
+            // a jump, a call, or the end of execution
+            known = {};
+        else {
+            // The result of an instruction replacing a set, or of an instruction used by set0
+            std::optional<uint16_t> value{};
+            if (op == isa::opcode("xor") && dst == src)
+                value = 0;
+            else if (op == isa::opcode("mv"))
+                value = known[src];
+            else if (auto d = std::ranges::find(derived, op, [](auto&& p) { return isa::find(p.first)->opcode; });
+                     d != derived.end() && known[src])
+            {
+                value = d->second(*known[src]);
+            }
+            if (writes(it.instr->dst) && !it.instr->dst_csr)
+                known[dst].reset();
+            if (writes(it.instr->src) && !it.instr->src_csr)
+                known[src].reset();
+            if (value && dst != isa::reg_f)
+                known[dst] = value;
+        }
+        // An immediate operand is data, not an instruction
+        if (immediate(it) && next && !next->instr)
+            ++j;
+    }
+    return result;
 }
 
-std::string assembler::remove_comment(std::string_view line)
+void assembler::report() const
 {
-    std::string result{};
-    result.reserve(line.size());
-    bool in_char = false;
-    bool in_str = false;
-    for (auto it = line.begin(); it != line.end() && (in_char || in_str || *it != '#'); ++it) {
-        switch (*it) {
-        case '\'':
-            if (in_char)
-                in_char = false;
-            else if (!in_str)
-                in_char = true;
-            break;
-        case '"':
-            if (in_str)
-                in_str = false;
-            else if (!in_char)
-                in_str = true;
-            break;
-        case '\\':
-            result.push_back(*it);
-            if (it + 1 != line.end())
-                ++it;
-            break;
-        default:
-            break;
+    if (changes.empty())
+        return;
+    struct saved_t {
+        ptrdiff_t bytes = 0;
+        ptrdiff_t cycles = 0;
+        size_t jumps = 0;
+    };
+    // Keyed by file names, for a stable order
+    std::map<std::string, saved_t> modules;
+    saved_t total{};
+    for (auto&& c: changes | std::views::values) {
+        saved_t d{};
+        if (c.target)
+            d.jumps = 1;
+        else if (c.item.instr) {
+            d.bytes = c.instr ? 0 : 2;
+            d.cycles = c.item.instr->cycles - (c.instr ? c.instr->cycles : 0);
+        } else
+            d.bytes = c.item.size;
+        for (auto* s: {&modules[c.item.module->first.string()], &total}) {
+            s->bytes += d.bytes;
+            s->cycles += d.cycles;
+            s->jumps += d.jumps;
         }
-        result.push_back(*it);
     }
-    if (result.find_first_not_of(whitespace_chars) == std::string::npos)
-        result.clear();
-    return result;
+    *diag << "Optimization saved " << total.bytes << " bytes, " << total.cycles <<
+        " cycles if each changed instruction was executed once, and redirected " << total.jumps << " jumps" <<
+        std::endl;
+    for (auto&& [file, m]: modules)
+        *diag << file << ": " << m.bytes << " bytes, " << m.cycles << " cycles, " << m.jumps << " jumps" << std::endl;
 }
 
-void assembler::run()
+const assembler::change_t* assembler::add_item(item_t item)
 {
-    if (verbose)
-        std::cerr << "Begin compilation" << std::endl;
-    auto [files, top] = in.files();
-    symbols.emplace(std::piecewise_construct, std::forward_as_tuple(top), std::forward_as_tuple());
-    run_file(files, top);
-    if (verbose)
-        std::cerr << "End compilation" << std::endl;
-    bool undef = false;
-    for (auto&& t: symbols)
-        for (auto&& s: t.second)
-            if (auto l = std::get_if<label_t>(s.second.get()); l && !l->value()) {
-                if (!undef) {
-                    std::cerr << "Undefined labels:" << std::endl;
-                    undef = true;
-                }
-                std::cerr << t.first->first.string() << ": " << s.first << std::endl;
-            }
-    bool undef_gl = false;
-    for (auto&& s: global_symbols)
-        if (auto l = std::get_if<label_t>(s.second.get()); l && !l->value()) {
-            if (!undef_gl) {
-                std::cerr << "Undefined unqualified (global) labels:" << std::endl;
-                undef_gl = true;
-            }
-            std::cerr << '.' << s.first << std::endl;
-        }
-    if (undef || undef_gl) {
-        std::cerr << "Cannot resolve labels in the second phase" << std::endl;
-        throw silent_error{};
+    items.push_back(item);
+    auto c = changes.find(items.size() - 1);
+    if (c == changes.end())
+        return nullptr;
+    if (c->second.item.instr != item.instr || c->second.item.regs != item.regs)
+        throw fatal_error{"Inconsistent changed items in assembler::add_item"};
+    if (c->second.instr) {
+        items.back().instr = c->second.instr;
+        items.back().regs = c->second.regs;
     }
-    for (auto&& p: phase2)
-        try {
-            if (auto v = p.expr->eval()) {
-                if (p.word)
-                    out.set_word(p.addr, *v);
-                else
-                    out.set_byte(p.addr, uint8_t(*v % 256));
-            } else
-                throw fatal_error{"Cannot evaluate an expression in the second phase"};
-        } catch (eval_error& e) {
-            std::cerr << src_pos(p.path, p.line) << "Cannot evaluate an expression in the second phase: " <<
-                e.what() << std::endl;
-            throw silent_error{};
-        }
+    return &c->second;
 }
 
 void assembler::run_lines(const input::files_t& files, input::files_t::const_iterator current,
-                          std::span<const std::string> full_text, std::span<const std::string> text,
+                          input::text_span full_text, input::text_span text, std::span<const line_t> split_text,
                           size_t macro_idx, macro_args_t* macro_args, size_t macro_level)
 {
     std::string line_prefix = std::string(4 * macro_level, ' ');
@@ -1230,79 +2743,97 @@ void assembler::run_lines(const input::files_t& files, input::files_t::const_ite
     ) {
         // Add source line to text output
         size_t line_num = size_t(full_it - current->second.full_text.begin()) + 1;
+        out.set_location(current->first, line_num, macro_level);
         if (!full_it->empty() && full_it->front() != '#') {
             out.add_src_line(current->first, line_num, *full_it, line_prefix, macro_prefix);
             macro_prefix = ""sv;
-        } else
+        } else if (line_num == out.last_line + 1)
+            // Skipped lines continue a run of printed lines, but must not hide a gap left by a macro definition
             out.last_line = line_num;
         if (text_it->empty())
             continue;
-        // Split to label: cmd args...
-        auto parts = split(*text_it);
+        // Line already split to label: cmd args...
+        const line_t& parts = split_text[size_t(text_it - text.begin())];
         // Process label
         if (!parts.label.empty()) {
             auto id = parser::identifier(parts.label, true, {{cur_macro, last_macro}});
             if (!id.first || id.first->name_space) {
-                std::cerr << src_pos(current->first, line_num) <<
+                *diag << src_pos(current->first, line_num) <<
                     "Expected identifier without namespace as the label" << std::endl;
                 throw silent_error{};
             }
-            if (!define_label(current, std::string(id.first->name), cur_addr, false)) {
-                std::cerr << src_pos(current->first, line_num) << "Symbol \"" << id.first->name <<
+            auto name = names.intern(id.first->name);
+            if (!define_label(current, name, cur_addr, false)) {
+                *diag << src_pos(current->first, line_num) << "Symbol \"" << id.first->name <<
                     "\" already defined" << std::endl;
                 throw silent_error{};
             }
+            if (relocatable && declaring == 0) {
+                local_labels.insert(&std::get<label_t>(*symbols.find(current)->second.find(name)->get()));
+                if (object_blocks.empty() || object_blocks.back().offset != cur_addr)
+                    object_blocks.push_back({.offset = cur_addr, .falls = object_falls});
+                object_falls = true; // a block without instructions continues to the next one
+            }
         }
         if (parts.cmd.empty())
             continue;
         // Process directives
         if (parts.cmd == "$addr"sv) {
             if (parts.args.size() != 1) {
-                std::cerr << src_pos(current->first, line_num) << "$addr requires one argument" << std::endl;
+                *diag << src_pos(current->first, line_num) << "$addr requires one argument" << std::endl;
                 throw silent_error{};
             }
             if (auto e = parse_expr(parts.args[0], current, macro_args, {{cur_macro, last_macro}}); !e) {
-                std::cerr << src_pos(current->first, line_num) << "Invalid argument: " << e.error() << std::endl;
+                *diag << src_pos(current->first, line_num) << "Invalid argument: " << e.error() << std::endl;
                 throw silent_error{};
             } else {
                 try {
-                    if (!dynamic_cast<expr_number*>(e->get())) {
-                        std::cerr << src_pos(current->first, line_num) << "Expression cannot be evaluated as number" <<
+                    if (!is_number(*e)) {
+                        *diag << src_pos(current->first, line_num) << "Expression cannot be evaluated as number" <<
                             std::endl;
                         throw silent_error{};
-                    } else if (auto v = (*e)->eval()) {
+                    } else if (relocatable && declaring == 0 &&
+                               std::ranges::none_of(std::span(expr_nodes).subspan(e->begin, e->size),
+                                                    [](auto&& n) { return n.op == expr_op::label; }))
+                    {
+                        *diag << src_pos(current->first, line_num) <<
+                            "$addr in a relocatable object must be relative to a label or __addr" << std::endl;
+                        throw silent_error{};
+                    } else if (auto v = eval(*e, true)) {
+                        if (relocatable && declaring == 0 && *v < cur_addr)
+                            object_split = false;
                         cur_addr = *v;
                         out.add_txt_line(std::format("$addr {:#06x}", cur_addr), line_prefix);
                     } else {
-                        std::cerr << src_pos(current->first, line_num) << "Cannot evaluate $addr in the first phase" <<
+                        *diag << src_pos(current->first, line_num) << "Cannot evaluate $addr in the first phase" <<
                             std::endl;
                         throw silent_error{};
                     }
                 } catch (eval_error& e) {
-                    std::cerr << src_pos(current->first, line_num) << "Cannot evaluate expression: " << e.what() <<
+                    *diag << src_pos(current->first, line_num) << "Cannot evaluate expression: " << e.what() <<
                         std::endl;
                     throw silent_error{};
                 }
             }
         } else if (parts.cmd == "$const"sv) {
             if (parts.args.size() != 2) {
-                std::cerr << src_pos(current->first, line_num) << "$const requires two arguments" << std::endl;
+                *diag << src_pos(current->first, line_num) << "$const requires two arguments" << std::endl;
                 throw silent_error{};
             }
             auto id = parser::identifier(parts.args[0], true, {{cur_macro, last_macro}});
             if (!id.first || id.first->name_space) {
-                std::cerr << src_pos(current->first, line_num) <<
+                *diag << src_pos(current->first, line_num) <<
                     "Expected identifier without namespace as the first argument of $const" << std::endl;
                 throw silent_error{};
             }
             auto e = parse_expr(parts.args[1], current, macro_args, {{cur_macro, last_macro}});
             if (!e) {
-                std::cerr << src_pos(current->first, line_num) << "Invalid expression in $const: " << e.error() <<
+                *diag << src_pos(current->first, line_num) << "Invalid expression in $const: " << e.error() <<
                     std::endl;
                 throw silent_error{};
             }
-            if (!define_const(current, id.first->name, std::move(*e))) {
-                std::cerr << src_pos(current->first, line_num) << "Symbol \"" << id.first->name <<
+            if (!define_const(current, names.intern(id.first->name), *e)) {
+                *diag << src_pos(current->first, line_num) << "Symbol \"" << id.first->name <<
                     "\" already defined" << std::endl;
                 throw silent_error{};
             }
@@ -1312,49 +2843,63 @@ void assembler::run_lines(const input::files_t& files, input::files_t::const_ite
             for (size_t i = 0; auto&& a: parts.args) {
                 ++i;
                 if (auto b = parse_expr(a, current, macro_args, {{cur_macro, last_macro}}); !b) {
-                    std::cerr << src_pos(current->first, line_num) << "Invalid argument " << i << " of $data_b: " <<
+                    *diag << src_pos(current->first, line_num) << "Invalid argument " << i << " of $data_b: " <<
                         b.error() << std::endl;
                     throw silent_error{};
                 } else
                     try {
-                        if (!dynamic_cast<expr_number*>(b->get()) && !dynamic_cast<expr_bytes*>(b->get())) {
-                            std::cerr << src_pos(current->first, line_num) <<
+                        if (eval_reg(*b)) {
+                            *diag << src_pos(current->first, line_num) <<
                                 "Expression cannot be evaluated as bytes" << std::endl;
                             throw silent_error{};
-                        } else if (auto v = (*b)->eval_bytes()) {
+                        } else if (auto v = eval_bytes(*b)) {
                             bytes.append_range(*v);
                             cur_addr += v->size();
                         } else {
                             bytes.push_back(0);
                             phase2.push_back({
                                 .path = current->first, .line = line_num,
-                                .expr = std::move(*b), .addr = cur_addr, .word = false
+                                .expr = *b, .addr = cur_addr, .word = false
                             });
                             ++cur_addr;
                         }
                     } catch (eval_error& e) {
-                        std::cerr << src_pos(current->first, line_num) << "Cannot evaluate expression: " << e.what() <<
+                        *diag << src_pos(current->first, line_num) << "Cannot evaluate expression: " << e.what() <<
                             std::endl;
                         throw silent_error{};
                     }
             }
+            if (optimize)
+                add_item({.module = module, .addr = start_addr, .size = uint16_t(bytes.size()), .instr = nullptr,
+                          .regs = 0, .words = false, .fixed = false});
             out.add_bytes(start_addr, bytes, ""sv, line_prefix);
         } else if (parts.cmd == "$data_w"sv) {
             std::vector<uint8_t> bytes{};
             auto start_addr = cur_addr;
+            auto item = items.size();
+            if (auto c = optimize ? add_item({.module = module, .addr = start_addr, .size = 0, .instr = nullptr,
+                                              .regs = 0, .words = true, .fixed = true}) : nullptr)
+            {
+                if (c->removes()) {
+                    out.add_txt_line("$data_w removed by optimization", line_prefix);
+                    continue;
+                }
+                // The value is replaced by run() after the second phase
+                out.add_txt_line("$data_w target changed by optimization", line_prefix);
+            }
             for (size_t i = 0; auto&& a: parts.args) {
                 ++i;
                 if (auto w = parse_expr(a, current, macro_args, {{cur_macro, last_macro}}); !w) {
-                    std::cerr << src_pos(current->first, line_num) << "Invalid argument " << i << " of $data_w: " <<
+                    *diag << src_pos(current->first, line_num) << "Invalid argument " << i << " of $data_w: " <<
                         w.error() << std::endl;
                     throw silent_error{};
                 } else {
                     try {
-                        if (!dynamic_cast<expr_number*>(w->get())) {
-                            std::cerr << src_pos(current->first, line_num) <<
+                        if (!is_number(*w)) {
+                            *diag << src_pos(current->first, line_num) <<
                                 "Expression cannot be evaluated as number" << std::endl;
                             throw silent_error{};
-                        } if (auto v = (*w)->eval()) {
+                        } if (auto v = eval(*w)) {
                             bytes.push_back(uint8_t(*v % 256));
                             bytes.push_back(uint8_t(*v / 256));
                         } else {
@@ -1362,52 +2907,64 @@ void assembler::run_lines(const input::files_t& files, input::files_t::const_ite
                             bytes.push_back(0);
                             phase2.push_back({
                                 .path = current->first, .line = line_num,
-                                .expr = std::move(*w), .addr = cur_addr, .word = true
+                                .expr = *w, .addr = cur_addr, .word = true
                             });
                         }
                     } catch (eval_error& e) {
-                        std::cerr << src_pos(current->first, line_num) << "Cannot evaluate expression: " << e.what() <<
+                        *diag << src_pos(current->first, line_num) << "Cannot evaluate expression: " << e.what() <<
                             std::endl;
                         throw silent_error{};
                     }
+                    if (optimize && std::ranges::any_of(std::span(expr_nodes).subspan(w->begin, w->size),
+                                                        [](auto&& n) {
+                                                            return n.op == expr_op::label || n.op == expr_op::addr ||
+                                                                n.addr;
+                                                        }))
+                    {
+                        items[item].fixed = false;
+                    }
                     cur_addr += 2;
                 }
             }
+            if (optimize)
+                items[item].size = uint16_t(bytes.size());
             out.add_bytes(start_addr, bytes, ""sv, line_prefix);
         } else if (parts.cmd == "$macro"sv) {
             if (macro_args) {
-                std::cerr << src_pos(current->first, line_num) << "Nested macro definition not allowed" << std::endl;
+                *diag << src_pos(current->first, line_num) << "Nested macro definition not allowed" << std::endl;
                 throw silent_error{};
             }
             if (parts.args.empty()) {
-                std::cerr << src_pos(current->first, line_num) << "Missing macro name in $macro" << std::endl;
+                *diag << src_pos(current->first, line_num) << "Missing macro name in $macro" << std::endl;
                 throw silent_error{};
             }
             auto id = parser::identifier(parts.args[0], true);
             if (!id.first || id.first->name_space) {
-                std::cerr << src_pos(current->first, line_num) <<
+                *diag << src_pos(current->first, line_num) <<
                     "Expected identifier without namespace as the macro name in $macro" << std::endl;
                 throw silent_error{};
             }
-            std::vector<std::string> params;
+            std::vector<name_id_t> params;
             for (size_t i = 1; i < parts.args.size(); ++i) {
                 auto p = parser::identifier(parts.args[i], true);
                 if (!p.first || p.first->name_space) {
-                    std::cerr << src_pos(current->first, line_num) <<
+                    *diag << src_pos(current->first, line_num) <<
                         "Expected identifier without namespace as parameter " << i << " of $macro" << std::endl;
                     throw silent_error{};
                 }
-                params.push_back(std::move(p.first->name));
+                params.push_back(names.intern(p.first->name));
             }
             for (auto [full_begin, text_begin] = std::pair{++full_it, ++text_it};
                  full_it != full_text.end() && text_it != text.end();
                  ++full_it, ++text_it)
             {
-                if (auto parts = split(*text_it); parts.cmd == "$end_macro"sv) {
-                    if (!define_macro(current, id.first->name, {full_begin, full_it},
-                                      {text_begin, text_it}, std::move(params)))
+                if (split_text[size_t(text_it - text.begin())].cmd == "$end_macro"sv) {
+                    auto split_begin = split_text.begin() + (text_begin - text.begin());
+                    if (!define_macro(current, names.intern(id.first->name), {full_begin, full_it},
+                                      {text_begin, text_it}, {split_begin, split_begin + (text_it - text_begin)},
+                                      std::move(params)))
                     {
-                        std::cerr << src_pos(current->first, line_num) <<
+                        *diag << src_pos(current->first, line_num) <<
                             "Symbol \"" << id.first->name << "\" already defined" << std::endl;
                         throw silent_error{};
                     }
@@ -1416,10 +2973,49 @@ void assembler::run_lines(const input::files_t& files, input::files_t::const_ite
                 }
             }
             if (full_it == full_text.end() || text_it == text.end()) {
-                std::cerr << src_pos(current->first, line_num) <<
+                *diag << src_pos(current->first, line_num) <<
                     "Missing $end_macro at the end of macro definition" << std::endl;
                 throw silent_error{};
             }
+        } else if (parts.cmd == "$loop_bound"sv || parts.cmd == "$targets"sv || parts.cmd == "$intr_deadline"sv) {
+            using enum output::annotation_t::kind_t;
+            auto kind = parts.cmd == "$loop_bound"sv ? loop_bound : parts.cmd == "$targets"sv ? target : intr_deadline;
+            if (kind == target ? parts.args.empty() : parts.args.size() != 1) {
+                *diag << src_pos(current->first, line_num) << parts.cmd << " requires " <<
+                    (kind == target ? "at least one argument" : "one argument") << std::endl;
+                throw silent_error{};
+            }
+            if (relocatable)
+                continue; // the cost analysis is done only for programs, labels of other modules are not known
+            for (size_t i = 0; auto&& a: parts.args) {
+                ++i;
+                auto e = parse_expr(a, current, macro_args, {{cur_macro, last_macro}});
+                if (!e) {
+                    *diag << src_pos(current->first, line_num) << "Invalid argument " << i << " of " << parts.cmd <<
+                        ": " << e.error() << std::endl;
+                    throw silent_error{};
+                }
+                std::optional<uint16_t> v{};
+                try {
+                    if (is_number(*e))
+                        v = eval(*e);
+                } catch (eval_error& err) {
+                    *diag << src_pos(current->first, line_num) << "Cannot evaluate expression: " << err.what() <<
+                        std::endl;
+                    throw silent_error{};
+                }
+                if (!v) {
+                    *diag << src_pos(current->first, line_num) << "Cannot evaluate argument " << i << " of " <<
+                        parts.cmd << " in the first phase" << std::endl;
+                    throw silent_error{};
+                }
+                if (kind != target && *v == 0) {
+                    *diag << src_pos(current->first, line_num) << parts.cmd << " requires a positive argument" <<
+                        std::endl;
+                    throw silent_error{};
+                }
+                out.add_annotation(kind, cur_addr, *v);
+            }
         } else if (parts.cmd == "$use"sv) {
             if (parts.args.size() != 2)
                 throw fatal_error{"Invalid $use in assembler::run_file"};
@@ -1430,107 +3026,156 @@ void assembler::run_lines(const input::files_t& files, input::files_t::const_ite
                 ns_it == current->second.name_spaces.end())
             {
                 throw fatal_error{std::format("Namespace {} not registered in input::files", id_ns.first->name)};
-            } else
+            } else if (prelude && current == top && prelude->uses < prelude->replay) {
+                if (prelude->next < prelude->segments.size() &&
+                    prelude->segments[prelude->next].file == ns_it->second)
+                {
+                    out.append(prelude->segments[prelude->next++].out);
+                }
+                ++prelude->uses;
+            } else if (relocatable && declaring == 0) {
+                if (cur_addr != 0 || !local_labels.empty()) {
+                    *diag << src_pos(current->first, line_num) <<
+                        "$use in a relocatable object must precede all labels and code" << std::endl;
+                    throw silent_error{};
+                }
+                object_uses.emplace_back(id_ns.first->name, ns_it->second);
                 if (auto sym_it = symbols.find(ns_it->second); sym_it == symbols.end()) {
                     symbols.emplace(std::piecewise_construct,
                                     std::forward_as_tuple(ns_it->second), std::forward_as_tuple());
+                    // The code of the included file belongs to another object, it is discarded
+                    auto fixups = phase2.size();
+                    ++declaring;
                     run_file(files, ns_it->second);
+                    --declaring;
+                    cur_addr = 0;
+                    while (phase2.size() > fixups)
+                        phase2.pop_back();
+                    object_mark = out.mark();
                 }
+            } else
+                if (auto sym_it = symbols.find(ns_it->second); sym_it == symbols.end()) {
+                    auto mark = out.mark();
+                    symbols.emplace(std::piecewise_construct,
+                                    std::forward_as_tuple(ns_it->second), std::forward_as_tuple());
+                    run_file(files, ns_it->second);
+                    if (prelude && current == top) {
+                        prelude->segments.erase(prelude->segments.begin() + ptrdiff_t(prelude->next),
+                                                prelude->segments.end());
+                        prelude->segments.push_back({.file = ns_it->second, .out = out.segment(mark)});
+                        prelude->next = prelude->segments.size();
+                        auto key = prelude->keys[prelude->uses++];
+                        save_snapshot(snapshot_file(key), key);
+                    }
+                } else if (prelude && current == top)
+                    ++prelude->uses; // the state is the same as after the previous $use, no snapshot needed
         } else if (parts.cmd.front() == '$') {
-            std::cerr << src_pos(current->first, line_num) << "Unknown directive \"" << parts.cmd << '"' << std::endl;
+            *diag << src_pos(current->first, line_num) << "Unknown directive \"" << parts.cmd << '"' << std::endl;
             throw silent_error{};
         } else if (auto id = parser::identifier(parts.cmd, true, {{cur_macro, last_macro}}); !id.first) {
-            std::cerr << src_pos(current->first, line_num) << id.first.error() << std::endl;
+            *diag << src_pos(current->first, line_num) << id.first.error() << std::endl;
             throw silent_error{};
         } else {
             // Expand macros
             auto [symbol, defined] = find_symbol(current, *id.first);
             if (!symbol && defined) {
-                std::cerr << src_pos(current->first, line_num) << "Multiple definitions of unqualified macro name \"" <<
+                *diag << src_pos(current->first, line_num) << "Multiple definitions of unqualified macro name \"" <<
                     *id.first << '"' << std::endl;
                 throw silent_error{};
             }
             if (symbol) {
                 if (const macro_t* macro = std::get_if<macro_t>(symbol)) {
                     if (macro->order > macro_idx) {
-                        std::cerr << src_pos(current->first, line_num) << "Macro \"" << *id.first <<
+                        *diag << src_pos(current->first, line_num) << "Macro \"" << *id.first <<
                             "\" not defined before the current macro" << std::endl;
                         throw silent_error{};
                     }
                     if (macro->params.size() != parts.args.size()) {
-                        std::cerr << src_pos(current->first, line_num) << "Macro \"" << *id.first << "\" expects " <<
+                        *diag << src_pos(current->first, line_num) << "Macro \"" << *id.first << "\" expects " <<
                             macro->params.size() << " arguments, " << parts.args.size() << " passed" << std::endl;
                         throw silent_error{};
                     }
                     macro_args_t args{};
                     for (size_t i = 0; i < parts.args.size(); ++i) {
                         if (auto a = parse_expr(parts.args[i], current, macro_args, {{cur_macro, last_macro}}); !a) {
-                            std::cerr << src_pos(current->first, line_num) << "Invalid argument " << (i + 1) <<
+                            *diag << src_pos(current->first, line_num) << "Invalid argument " << (i + 1) <<
                                 " of macro: " << a.error() << std::endl;
                             throw silent_error{};
                         } else
-                            args.emplace(macro->params[i], std::move(*a));
+                            args.emplace(macro->params[i], *a);
                     }
                     try {
-                        run_lines(files, macro->file, macro->full_replace, macro->replace, macro->order, &args,
-                                  macro_level + 1);
+                        run_lines(files, macro->file, macro->full_replace, macro->replace, macro->split_replace,
+                                  macro->order, &args, macro_level + 1);
                         // On macro level 0, we cannot strip 2 spaces from (empty) line_prefix
                         macro_prefix = macro_level > 0 ? "    END_MACRO "sv : "  END_MACRO "sv;
                     } catch (const silent_error&) {
-                        std::cerr << src_pos(current->first, line_num) << "Error in macro expansion" << std::endl;
+                        *diag << src_pos(current->first, line_num) << "Error in macro expansion" << std::endl;
                         throw;
                     }
                 } else {
-                    std::cerr << src_pos(current->first, line_num) << "Symbol \"" << *id.first << "\" is not a macro" <<
+                    *diag << src_pos(current->first, line_num) << "Symbol \"" << *id.first << "\" is not a macro" <<
                         std::endl;
                     throw silent_error{};
                 }
             } else if (!id.first->name_space) {
                 // Generate instructions
                 if (parts.args.size() != 2) {
-                    std::cerr << src_pos(current->first, line_num) << "Instruction requires two arguments" << std::endl;
+                    *diag << src_pos(current->first, line_num) << "Instruction requires two arguments" << std::endl;
                     throw silent_error{};
                 }
-                auto instr = opcodes.find(id.first->name);
-                if (instr == opcodes.end()) {
-                    std::cerr << src_pos(current->first, line_num) << "Unknown instruction \"" << id.first->name <<
+                auto instr = isa::find(id.first->name);
+                if (!instr) {
+                    *diag << src_pos(current->first, line_num) << "Unknown instruction \"" << id.first->name <<
                         '"' << std::endl;
                     throw silent_error{};
                 }
                 auto dst = parse_expr(parts.args[0], current, macro_args, {{cur_macro, last_macro}});
                 if (!dst) {
-                    std::cerr << src_pos(current->first, line_num) << "Invalid destination register of instruction: " <<
+                    *diag << src_pos(current->first, line_num) << "Invalid destination register of instruction: " <<
                         dst.error() << std::endl;
                     throw silent_error{};
                 }
-                auto dst_reg = (*dst)->eval_reg();
-                if (!dst_reg || dst_reg->second != instr->second.dst_csr) {
-                    std::cerr << src_pos(current->first, line_num) << "Invalid destination register of instruction" <<
+                auto dst_reg = eval_reg(*dst);
+                if (!dst_reg || dst_reg->second != instr->dst_csr) {
+                    *diag << src_pos(current->first, line_num) << "Invalid destination register of instruction" <<
                         std::endl;
                     throw silent_error{};
                 }
                 auto src = parse_expr(parts.args[1], current, macro_args, {{cur_macro, last_macro}});
                 if (!src) {
-                    std::cerr << src_pos(current->first, line_num) << "Invalid source register of instruction: " <<
+                    *diag << src_pos(current->first, line_num) << "Invalid source register of instruction: " <<
                         src.error() << std::endl;
                     throw silent_error{};
                 }
-                auto src_reg = (*src)->eval_reg();
-                if (!src_reg || src_reg->second != instr->second.src_csr) {
-                    std::cerr << src_pos(current->first, line_num) << "Invalid source register of instruction" <<
+                auto src_reg = eval_reg(*src);
+                if (!src_reg || src_reg->second != instr->src_csr) {
+                    *diag << src_pos(current->first, line_num) << "Invalid source register of instruction" <<
                         std::endl;
                     throw silent_error{};
                 }
                 std::array<uint8_t, 2> bytes{};
-                bytes[0] = instr->second.opcode;
+                bytes[0] = instr->opcode;
                 bytes[1] = uint8_t(dst_reg->first << 4U) | (src_reg->first);
-                out.add_bytes(cur_addr, bytes,
-                              std::format("{} {}, {}", id.first->name, (*dst)->eval_reg_str(), (*src)->eval_reg_str()),
-                              line_prefix);
+                auto text = std::format("{} {}, {}", id.first->name, eval_reg_str(*dst), eval_reg_str(*src));
+                if (auto c = optimize ? add_item({.module = module, .addr = cur_addr, .size = 2, .instr = instr,
+                                                  .regs = bytes[1], .words = false, .fixed = true}) : nullptr)
+                {
+                    if (c->removes()) {
+                        out.add_txt_line(text.append(" removed by optimization"), line_prefix);
+                        continue;
+                    }
+                    instr = c->instr;
+                    bytes = {instr->opcode, c->regs};
+                    text = std::format("{} optimized from {}", isa::disassemble(bytes[0], bytes[1]), text);
+                }
+                out.add_bytes(cur_addr, bytes, text, line_prefix);
+                if (relocatable && declaring == 0)
+                    object_falls = !isa::jumps(*instr, bytes[1]);
                 cur_addr += 2;
             } else {
                     // Unknown name
-                std::cerr << src_pos(current->first, line_num) << "Name \"" << *id.first <<
+                *diag << src_pos(current->first, line_num) << "Name \"" << *id.first <<
                     "\" is not a known instruction or macro" << std::endl;
                 throw silent_error{};
             }
@@ -1546,10 +3191,15 @@ void assembler::run_lines(const input::files_t& files, input::files_t::const_ite
 void assembler::run_file(const input::files_t& files, input::files_t::const_iterator current)
 {
     if (verbose)
-        std::cerr << "Compiling file \"" << current->first.string() << '"' << std::endl;
-    run_lines(files, current, current->second.full_text, current->second.text);
+        *diag << "Compiling file \"" << current->first.string() << '"' << std::endl;
+    size_t prelude_lines = current == top ? run_prelude(files) : 0;
+    const input::file_t& f = current->second;
+    auto caller = std::exchange(module, current);
+    run_lines(files, current, input::text_span(f.full_text).subspan(prelude_lines),
+              input::text_span(f.text).subspan(prelude_lines), std::span(f.split).subspan(prelude_lines));
+    module = caller;
     if (verbose)
-        std::cerr << "Done file \"" << current->first.string() << '"' << std::endl;
+        *diag << "Done file \"" << current->first.string() << '"' << std::endl;
 }
 
 assembler::line_t assembler::split(std::string_view line)
@@ -1587,7 +3237,10 @@ assembler::line_t assembler::split(std::string_view line)
         auto arg_e = arg_b;
         bool in_char = false;
         bool in_str = false;
-        for (; arg_e != line.end() && (in_char || in_str || *arg_e != ','); ++arg_e)
+        for (; (arg_e = line.begin() + ptrdiff_t(scan_special(line, size_t(arg_e - line.begin())))) != line.end() &&
+             (in_char || in_str || *arg_e != ',');
+             ++arg_e)
+        {
              switch (*arg_e) {
              case '\'':
                  if (in_char)
@@ -1608,6 +3261,7 @@ assembler::line_t assembler::split(std::string_view line)
              default:
                  break;
              }
+        }
         if (arg_e != line.end() || arg_e != arg_b) {
             // comma or non-empty argument after last comma
             result.args.emplace_back(arg_b, arg_e);
@@ -1621,30 +3275,630 @@ assembler::line_t assembler::split(std::string_view line)
     return result;
 }
 
+size_t assembler::scan_special(std::string_view s, size_t pos)
+{
+    // Vector code compares 32 or 16 characters with each special character at once
+#if defined(__AVX2__)
+    for (; pos + 32 <= s.size(); pos += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s.data() + pos));
+        __m256i m = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('#'));
+        for (char c: {'"', '\'', '\\', ',', ':'})
+            m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+        if (auto bits = uint32_t(_mm256_movemask_epi8(m)); bits != 0)
+            return pos + size_t(std::countr_zero(bits));
+    }
+#endif
+#if defined(__SSE2__)
+    for (; pos + 16 <= s.size(); pos += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s.data() + pos));
+        __m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8('#'));
+        for (char c: {'"', '\'', '\\', ',', ':'})
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+        if (auto bits = uint32_t(_mm_movemask_epi8(m)); bits != 0)
+            return pos + size_t(std::countr_zero(bits));
+    }
+#endif
+    for (; pos < s.size(); ++pos)
+        switch (s[pos]) {
+        case '#':
+        case '"':
+        case '\'':
+        case '\\':
+        case ',':
+        case ':':
+            return pos;
+        default:
+            break;
+        }
+    return s.size();
+}
+
+/*** Prelude snapshots *******************************************************/
+
+// State of the assembler and output after running files included by a prefix
+// of the prelude of the top level file, stored in the cache directory in a
+// file named by a hash of the canonical paths of the included files. A
+// snapshot is written after each $use that runs a file, so that a change of a
+// file causes reassembling only from the first $use that depends on it.
+// Programs starting by the same $use directives share snapshots, therefore a
+// snapshot must not refer to the top level file. The snapshot is a sequence of
+// values in the byte order of the host, pointers are replaced by indices.
+namespace snapshot {
+
+// Identification of the file format, the last character is the version
+constexpr std::array<char, 8> magic{'M', 'B', '5', '0', 'S', 'N', 'P', '3'};
+
+// Index representing nullptr
+constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+
+// A snapshot cannot be created, or a snapshot file is invalid or does not match source files
+struct invalid {};
+
+class writer {
+public:
+    template<class T> requires std::is_arithmetic_v<T> void put(T v) {
+        data.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+    void put(std::string_view s) {
+        put(uint32_t(s.size()));
+        data.append(s);
+    }
+    std::string data{};
+};
+
+class reader {
+public:
+    explicit reader(std::string_view data): data(data) {}
+    template<class T> requires std::is_arithmetic_v<T> T get() {
+        T v{};
+        if (data.size() < sizeof(v))
+            throw invalid{};
+        std::memcpy(&v, data.data(), sizeof(v));
+        data.remove_prefix(sizeof(v));
+        return v;
+    }
+    std::string_view str() {
+        auto size = get<uint32_t>();
+        if (size > data.size())
+            throw invalid{};
+        std::string_view result = data.substr(0, size);
+        data.remove_prefix(size);
+        return result;
+    }
+    // An index that must be less than size, or none if allowed
+    uint32_t index(size_t size, bool allow_none = false) {
+        auto i = get<uint32_t>();
+        if (i >= size && !(allow_none && i == none))
+            throw invalid{};
+        return i;
+    }
+    [[nodiscard]] bool end() const { return data.empty(); }
+private:
+    std::string_view data;
+};
+
+} // namespace snapshot
+
+size_t assembler::run_prelude(const input::files_t& files)
+{
+    const input::file_t& f = top->second;
+    // A restored prelude would not record items for the optimizer
+    if (in.cache_dir().empty() || relocatable || optimize)
+        return 0;
+    std::string key_data(parse_cache::build.begin(), parse_cache::build.end());
+    size_t lines = 0;
+    std::vector<uint64_t> keys;
+    for (; lines < f.split.size(); ++lines)
+        if (auto&& parts = f.split[lines]; parts.cmd == "$use"sv) {
+            auto id_ns = parts.args.empty() ? decltype(parser::identifier(""sv, true)){} :
+                parser::identifier(parts.args[0], true);
+            auto ns_it = id_ns.first ? f.name_spaces.find(id_ns.first->name) : f.name_spaces.end();
+            if (ns_it == f.name_spaces.end())
+                return 0; // reported by run_lines()
+            key_data.append(ns_it->first).append(1, '\0').append(ns_it->second->first.string()).append(1, '\0');
+            keys.push_back(parse_cache::hash(key_data));
+        } else if (!f.text[lines].empty())
+            break;
+    if (keys.empty())
+        return 0;
+    prelude.emplace(prelude_t{.keys = std::move(keys), .replay = 0, .uses = 0, .segments = {}, .next = 0});
+    // A change of a file invalidates only snapshots of prefixes that run it, files run by a shorter prefix are not
+    // assembled again
+    for (size_t i = prelude->keys.size(); i > 0; --i)
+        if (auto file = snapshot_file(prelude->keys[i - 1]); load_snapshot(files, file, prelude->keys[i - 1])) {
+            prelude->replay = i;
+            if (verbose)
+                *diag << "Using prelude snapshot \"" << file.string() << '"' << std::endl;
+            break;
+        }
+    run_lines(files, top, input::text_span(f.full_text).first(lines), input::text_span(f.text).first(lines),
+              std::span(f.split).first(lines));
+    prelude.reset();
+    return lines;
+}
+
+void assembler::save_snapshot(const sfs::path& file, uint64_t key)
+{
+    snapshot::writer w{};
+    try {
+        w.put(std::string_view(snapshot::magic.data(), snapshot::magic.size()));
+        w.put(std::string_view(parse_cache::build.data(), parse_cache::build.size()));
+        w.put(key);
+        // Files run by the prelude
+        std::map<const sfs::path*, uint32_t> file_idx;
+        for (auto&& [f, table]: symbols)
+            if (f == top) {
+                if (table.begin() != table.end())
+                    throw snapshot::invalid{};
+            } else
+                file_idx.emplace(&f->first, uint32_t(file_idx.size()));
+        auto file_ref = [&file_idx](const sfs::path* p) {
+            if (auto it = file_idx.find(p); it != file_idx.end())
+                return it->second;
+            throw snapshot::invalid{};
+        };
+        w.put(uint32_t(file_idx.size()));
+        for (auto&& f: symbols)
+            if (f.first != top) {
+                w.put(f.first->first.string());
+                w.put(f.first->second.hash);
+            }
+        w.put(uint32_t(names.size()));
+        for (name_id_t id = 0; id < names.size(); ++id)
+            w.put(names.name(id));
+        // Symbols, each shared object stored once
+        std::map<const symbol_t*, uint32_t> obj_idx;
+        std::map<const label_t*, uint32_t> label_idx;
+        std::vector<const symbol_t*> objs;
+        auto add_obj = [&](const symbol_t* sym) {
+            if (sym && obj_idx.emplace(sym, uint32_t(objs.size())).second) {
+                if (auto l = std::get_if<label_t>(sym))
+                    label_idx.emplace(l, uint32_t(objs.size()));
+                objs.push_back(sym);
+            }
+        };
+        for (auto&& [f, table]: symbols)
+            for (auto&& s: table)
+                add_obj(s.second.get());
+        for (auto&& s: global_symbols)
+            add_obj(s.second.get());
+        auto obj_ref = [&obj_idx](const symbol_t* sym) {
+            if (!sym)
+                return snapshot::none;
+            if (auto it = obj_idx.find(sym); it != obj_idx.end())
+                return it->second;
+            throw snapshot::invalid{};
+        };
+        w.put(uint32_t(objs.size()));
+        for (auto&& sym: objs) {
+            w.put(uint8_t(sym->index()));
+            if (auto l = std::get_if<label_t>(sym)) {
+                w.put(uint8_t(l->value().has_value()));
+                w.put(l->value().value_or(0));
+                w.put(uint8_t(l->fixed()));
+            } else if (auto v = std::get_if<var_t>(sym)) {
+                w.put(v->expr.begin);
+                w.put(v->expr.size);
+            } else if (auto m = std::get_if<macro_t>(sym)) {
+                w.put(uint32_t(m->params.size()));
+                for (auto p: m->params)
+                    w.put(p);
+                w.put(file_ref(&m->file->first));
+                w.put(uint32_t(m->full_replace.data() - m->file->second.full_text.data()));
+                w.put(uint32_t(m->full_replace.size()));
+                w.put(uint64_t(m->order));
+            }
+        }
+        w.put(uint32_t(expr_nodes.size()));
+        for (auto&& n: expr_nodes) {
+            w.put(uint8_t(n.op));
+            w.put(uint8_t((n.csr ? 1U : 0U) | (n.addr ? 2U : 0U)));
+            w.put(n.value);
+            w.put(n.bytes);
+            if (!n.label)
+                w.put(snapshot::none);
+            else if (auto it = label_idx.find(n.label); it != label_idx.end())
+                w.put(it->second);
+            else
+                throw snapshot::invalid{};
+        }
+        w.put(std::string_view(reinterpret_cast<const char*>(expr_bytes.data()), expr_bytes.size()));
+        w.put(uint32_t(file_idx.size()));
+        for (auto&& [f, table]: symbols)
+            if (f != top) {
+                w.put(file_ref(&f->first));
+                w.put(uint32_t(std::ranges::distance(table)));
+                for (auto&& s: table) {
+                    w.put(s.first);
+                    w.put(obj_ref(s.second.get()));
+                }
+            }
+        w.put(uint32_t(std::ranges::distance(global_symbols)));
+        for (auto&& s: global_symbols) {
+            w.put(s.first);
+            w.put(obj_ref(s.second.get()));
+        }
+        w.put(uint64_t(macro_def_order));
+        w.put(uint64_t(max_macro));
+        w.put(cur_addr);
+        w.put(uint32_t(phase2.size()));
+        for (auto&& p: phase2) {
+            w.put(file_ref(&p.path));
+            w.put(uint64_t(p.line));
+            w.put(p.expr.begin);
+            w.put(p.expr.size);
+            w.put(p.addr);
+            w.put(uint8_t(p.word));
+        }
+        // Output
+        w.put(uint32_t(prelude->segments.size()));
+        for (auto&& seg: prelude->segments) {
+            w.put(file_ref(&seg.file->first));
+            w.put(uint32_t(seg.out.text.size()));
+            for (auto&& l: seg.out.text) {
+                w.put(l.text);
+                w.put(uint8_t(uint8_t(l.addr.has_value()) | uint8_t(l.instr.has_value()) << 1U));
+                w.put(l.addr.value_or(0));
+                w.put(std::string_view(reinterpret_cast<const char*>(l.bytes.data()), l.bytes.size()));
+                w.put(l.instr.value_or(0));
+            }
+            w.put(uint32_t(seg.out.dbg_lines.size()));
+            for (auto&& l: seg.out.dbg_lines) {
+                w.put(l.addr);
+                w.put(l.size);
+                w.put(l.level);
+                w.put(file_ref(l.loc.file));
+                w.put(uint64_t(l.loc.line));
+            }
+            w.put(uint32_t(seg.out.annotations.size()));
+            for (auto&& a: seg.out.annotations) {
+                w.put(uint8_t(a.kind));
+                w.put(a.addr);
+                w.put(a.value);
+                w.put(file_ref(a.loc.file));
+                w.put(uint64_t(a.loc.line));
+            }
+            auto last_file = std::ranges::find(file_idx, seg.out.last_file, [](auto&& fi) { return *fi.first; });
+            w.put(last_file == file_idx.end() ? snapshot::none : last_file->second);
+            if (last_file == file_idx.end())
+                throw snapshot::invalid{};
+            w.put(uint64_t(seg.out.last_line));
+            w.put(uint32_t(seg.out.locations.size()));
+            for (auto&& l: seg.out.locations) {
+                w.put(file_ref(l.file));
+                w.put(uint64_t(l.line));
+            }
+        }
+    } catch (const snapshot::invalid&) {
+        if (verbose)
+            *diag << "Cannot create prelude snapshot" << std::endl;
+        return;
+    }
+    if (verbose)
+        *diag << "Writing prelude snapshot \"" << file.string() << '"' << std::endl;
+    parse_cache::write_file(file, w.data);
+}
+
+bool assembler::load_snapshot(const input::files_t& files, const sfs::path& file, uint64_t key)
+{
+    mapped_file map(file);
+    if (!map.ok())
+        return false;
+    try {
+        snapshot::reader r(map.text());
+        if (r.str() != std::string_view(snapshot::magic.data(), snapshot::magic.size()) ||
+            r.str() != std::string_view(parse_cache::build.data(), parse_cache::build.size()) ||
+            r.get<uint64_t>() != key)
+        {
+            return false;
+        }
+        // Files must be unchanged
+        std::vector<input::files_t::const_iterator> snap_files;
+        for (auto n = r.get<uint32_t>(); n > 0; --n) {
+            auto it = files.find(sfs::path(r.str()));
+            if (it == files.end() || it == top || it->second.hash != r.get<uint64_t>())
+                return false;
+            snap_files.push_back(it);
+        }
+        // Names interned before running the top level file must be the same
+        std::vector<std::string_view> snap_names;
+        for (auto n = r.get<uint32_t>(); n > 0; --n)
+            snap_names.push_back(r.str());
+        if (snap_names.size() < names.size())
+            return false;
+        for (name_id_t id = 0; id < names.size(); ++id)
+            if (snap_names[id] != names.name(id))
+                return false;
+        // Expressions are checked after reading all of them
+        std::vector<expr_t> exprs;
+        std::vector<std::shared_ptr<symbol_t>> objs;
+        for (auto n = r.get<uint32_t>(); n > 0; --n)
+            switch (r.get<uint8_t>()) {
+            case 0: {
+                auto has_value = r.get<uint8_t>() != 0;
+                auto value = r.get<uint16_t>();
+                auto fixed = r.get<uint8_t>() != 0;
+                objs.push_back(std::make_shared<symbol_t>(label_t{has_value ? std::optional(value) : std::nullopt,
+                                                                  fixed}));
+                break;
+            }
+            case 1: {
+                expr_t e{.begin = r.get<uint32_t>(), .size = r.get<uint32_t>()};
+                exprs.push_back(e);
+                objs.push_back(std::make_shared<symbol_t>(var_t{.expr = e}));
+                break;
+            }
+            case 2: {
+                std::vector<name_id_t> params;
+                for (auto p = r.get<uint32_t>(); p > 0; --p)
+                    params.push_back(r.index(snap_names.size()));
+                auto f = snap_files[r.index(snap_files.size())];
+                auto begin = r.get<uint32_t>();
+                auto size = r.get<uint32_t>();
+                if (begin > f->second.full_text.size() || f->second.full_text.size() - begin < size)
+                    return false;
+                objs.push_back(std::make_shared<symbol_t>(macro_t{
+                    .params = std::move(params),
+                    .file = f,
+                    .full_replace = input::text_span(f->second.full_text).subspan(begin, size),
+                    .replace = input::text_span(f->second.text).subspan(begin, size),
+                    .split_replace = std::span(f->second.split).subspan(begin, size),
+                    .order = r.get<uint64_t>(),
+                }));
+                break;
+            }
+            default:
+                return false;
+            }
+        std::vector<expr_node_t> nodes;
+        for (auto n = r.get<uint32_t>(); n > 0; --n) {
+            auto op = r.get<uint8_t>();
+            if (op > uint8_t(expr_op::neg))
+                return false;
+            auto flags = r.get<uint8_t>();
+            expr_node_t node{.op = expr_op(op), .csr = (flags & 1U) != 0, .addr = (flags & 2U) != 0,
+                             .value = r.get<uint16_t>(), .bytes = r.get<uint32_t>(), .label = nullptr};
+            if (auto l = r.index(objs.size(), true); l != snapshot::none)
+                if (node.label = std::get_if<label_t>(objs[l].get()); !node.label)
+                    return false;
+            nodes.push_back(node);
+        }
+        if (nodes.size() < expr_nodes.size())
+            return false;
+        auto bytes = r.str();
+        for (auto&& node: nodes)
+            if (node.op == expr_op::bytes && (node.bytes > bytes.size() || bytes.size() - node.bytes < node.value))
+                return false;
+        std::vector<std::pair<input::files_t::const_iterator, symbol_table_t>> tables;
+        for (auto n = r.get<uint32_t>(); n > 0; --n) {
+            auto& t = tables.emplace_back(snap_files[r.index(snap_files.size())], symbol_table_t{});
+            for (auto e = r.get<uint32_t>(); e > 0; --e) {
+                auto name = r.index(snap_names.size());
+                t.second.emplace(name, objs[r.index(objs.size())]);
+            }
+        }
+        global_symbol_table_t globals;
+        for (auto n = r.get<uint32_t>(); n > 0; --n) {
+            auto name = r.index(snap_names.size());
+            auto obj = r.index(objs.size(), true);
+            globals.emplace(name, obj == snapshot::none ? nullptr : objs[obj]);
+        }
+        auto snap_macro_def_order = r.get<uint64_t>();
+        auto snap_max_macro = r.get<uint64_t>();
+        auto snap_cur_addr = r.get<uint16_t>();
+        std::vector<phase2_t> snap_phase2;
+        for (auto n = r.get<uint32_t>(); n > 0; --n) {
+            const sfs::path& path = snap_files[r.index(snap_files.size())]->first;
+            auto line = r.get<uint64_t>();
+            expr_t e{.begin = r.get<uint32_t>(), .size = r.get<uint32_t>()};
+            exprs.push_back(e);
+            auto addr = r.get<uint16_t>();
+            snap_phase2.push_back({.path = path, .line = line, .expr = e, .addr = addr, .word = r.get<uint8_t>() != 0});
+        }
+        for (auto&& e: exprs)
+            if (e.size == 0 || e.begin > nodes.size() || nodes.size() - e.begin < e.size)
+                return false;
+        std::vector<prelude_t::segment_t> segments;
+        for (auto n = r.get<uint32_t>(); n > 0; --n) {
+            auto& seg = segments.emplace_back(prelude_t::segment_t{
+                .file = snap_files[r.index(snap_files.size())],
+                .out = {},
+            });
+            for (auto t = r.get<uint32_t>(); t > 0; --t) {
+                auto& l = seg.out.text.emplace_back(output::segment_t::text_line_t{.text = std::string(r.str()),
+                                                                                    .addr = {}, .bytes = {},
+                                                                                    .instr = {}});
+                auto has = r.get<uint8_t>();
+                auto addr = r.get<uint16_t>();
+                auto b = r.str();
+                auto instr = r.get<uint16_t>();
+                if (has & 1U)
+                    l.addr = addr;
+                if (has & 2U)
+                    l.instr = instr;
+                if (addr + b.size() > 0x10000)
+                    return false;
+                l.bytes.assign(b.begin(), b.end());
+            }
+            for (auto d = r.get<uint32_t>(); d > 0; --d)
+                seg.out.dbg_lines.push_back({.addr = r.get<uint16_t>(), .size = r.get<uint16_t>(),
+                                             .level = r.get<uint16_t>(),
+                                             .loc = {.file = &snap_files[r.index(snap_files.size())]->first,
+                                                     .line = r.get<uint64_t>()}});
+            for (auto a = r.get<uint32_t>(); a > 0; --a) {
+                auto kind = r.get<uint8_t>();
+                if (kind > uint8_t(output::annotation_t::kind_t::intr_deadline))
+                    return false;
+                seg.out.annotations.push_back({.kind = output::annotation_t::kind_t(kind), .addr = r.get<uint16_t>(),
+                                               .value = r.get<uint16_t>(),
+                                               .loc = {.file = &snap_files[r.index(snap_files.size())]->first,
+                                                       .line = r.get<uint64_t>()}});
+            }
+            seg.out.last_file = snap_files[r.index(snap_files.size())]->first;
+            seg.out.last_line = r.get<uint64_t>();
+            for (auto l = r.get<uint32_t>(); l > 0; --l)
+                seg.out.locations.push_back({.file = &snap_files[r.index(snap_files.size())]->first,
+                                             .line = r.get<uint64_t>()});
+        }
+        if (!r.end())
+            return false;
+        // The snapshot is valid, replace the state
+        for (auto id = names.size(); id < snap_names.size(); ++id)
+            if (names.intern(snap_names[id]) != id)
+                throw fatal_error("Invalid name interning in assembler::load_snapshot");
+        expr_nodes = std::move(nodes);
+        expr_bytes.assign(bytes.begin(), bytes.end());
+        for (auto&& t: tables)
+            symbols.insert_or_assign(t.first, std::move(t.second));
+        global_symbols = std::move(globals);
+        macro_def_order = snap_macro_def_order;
+        max_macro = snap_max_macro;
+        cur_addr = snap_cur_addr;
+        for (auto&& p: snap_phase2)
+            phase2.push_back(p);
+        prelude->segments = std::move(segments);
+        return true;
+    } catch (const snapshot::invalid&) {
+        return false;
+    }
+}
+
+/*** Watching files **********************************************************/
+
+// Waits for changes of files by inotify. Directories containing the files are
+// watched, because editors often replace a file by a new one instead of
+// modifying it.
+class file_watcher {
+public:
+    file_watcher();
+    file_watcher(const file_watcher&) = delete;
+    file_watcher(file_watcher&&) = delete;
+    file_watcher& operator=(const file_watcher&) = delete;
+    file_watcher& operator=(file_watcher&&) = delete;
+    ~file_watcher();
+    // Sets watched files, expects canonical paths
+    void watch(std::set<sfs::path> files);
+    // Waits until any watched file is created, written, moved, or deleted, returns all such files
+    std::set<sfs::path> wait();
+private:
+    // Changes are collected until there is no change for this time in milliseconds
+    static constexpr int settle_ms = 50;
+    int fd = -1;
+    std::map<int, sfs::path> dirs{}; // watch descriptor -> directory
+    std::set<sfs::path> files{};
+};
+
+file_watcher::file_watcher():
+    fd(inotify_init1(IN_CLOEXEC))
+{
+    if (fd < 0)
+        throw fatal_error("Cannot initialize watching files");
+}
+
+file_watcher::~file_watcher()
+{
+    close(fd);
+}
+
+void file_watcher::watch(std::set<sfs::path> files)
+{
+    this->files = std::move(files);
+    for (auto&& f: this->files) {
+        sfs::path dir = f.parent_path();
+        if (std::ranges::find(dirs, dir, [](auto&& d) -> auto& { return d.second; }) != dirs.end())
+            continue;
+        int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                   IN_MOVED_TO);
+        if (wd < 0)
+            throw fatal_error(std::format("Cannot watch directory \"{}\"", dir.string()));
+        dirs[wd] = std::move(dir);
+    }
+}
+
+std::set<sfs::path> file_watcher::wait()
+{
+    std::set<sfs::path> result{};
+    alignas(inotify_event) std::array<char, 4096> buf{};
+    for (;;) {
+        pollfd p{.fd = fd, .events = POLLIN, .revents = 0};
+        int ready = poll(&p, 1, result.empty() ? -1 : settle_ms);
+        if (ready < 0 && errno != EINTR)
+            throw fatal_error("Error watching files");
+        if (ready == 0)
+            return result;
+        if (ready < 0)
+            continue;
+        ssize_t n = read(fd, buf.data(), buf.size());
+        if (n < 0 && errno != EINTR)
+            throw fatal_error("Error watching files");
+        for (ssize_t i = 0; i < n;) {
+            inotify_event ev{};
+            std::memcpy(&ev, buf.data() + i, sizeof(ev));
+            // The name is terminated by '\0'
+            if (auto d = dirs.find(ev.wd); d != dirs.end() && ev.len > 0)
+                if (auto f = d->second / (buf.data() + i + sizeof(ev)); files.contains(f))
+                    result.insert(std::move(f));
+            i += ssize_t(sizeof(ev) + ev.len);
+        }
+    }
+}
+
 /*** Command line processing *************************************************/
 
 class cmdline_args: public cmdline_args_base {
 public:
     cmdline_args(int argc, char* argv[]);
     std::string usage();
-    [[nodiscard]] sfs::path input_file() const {
-        return _verbose ? args[2] : args[1];
-    }
+    [[nodiscard]] const std::vector<sfs::path>& input_files() const { return _input_files; }
+    [[nodiscard]] const sfs::path& cache_dir() const { return _cache_dir; }
+    [[nodiscard]] unsigned jobs() const { return _jobs; }
     [[nodiscard]] bool verbose() const { return _verbose; }
+    [[nodiscard]] bool watch() const { return _watch; }
+    [[nodiscard]] bool relocatable() const { return _relocatable; }
+    [[nodiscard]] bool optimize() const { return _optimize; }
 private:
+    std::vector<sfs::path> _input_files{};
+    sfs::path _cache_dir{};
+    unsigned _jobs = std::max(std::thread::hardware_concurrency(), 1U);
     bool _verbose = false;
+    bool _watch = false;
+    bool _relocatable = false;
+    bool _optimize = false;
 };
 
 cmdline_args::cmdline_args(int argc, char* argv[]):
     cmdline_args_base(argc, argv)
 {
     try {
-        if (args.size() < 2 || args.size() > 3)
-            throw invalid_cmdline_args{};
-        if (args[1] == "-v"sv)
-            _verbose = true;
-        if (args.size() != (_verbose ? 3 : 2))
+        size_t i = 1;
+        for (; i < args.size(); ++i) {
+            if (args[i] == "-v"sv)
+                _verbose = true;
+            else if (args[i] == "-w"sv)
+                _watch = true;
+            else if (args[i] == "-r"sv)
+                _relocatable = true;
+            else if (args[i] == "-O"sv)
+                _optimize = true;
+            else if (args[i] == "-c"sv && i + 1 < args.size() && *args[i + 1] != '\0')
+                _cache_dir = args[++i];
+            else if (args[i] == "-j"sv && i + 1 < args.size()) {
+                char* end = nullptr;
+                auto jobs = std::strtoul(args[++i], &end, 10);
+                if (*args[i] == '\0' || *end != '\0' || jobs == 0 || jobs > 1024)
+                    throw invalid_cmdline_args{};
+                _jobs = unsigned(jobs);
+            } else
+                break;
+        }
+        // Blocks of a relocatable object are not laid out until linking
+        if (i == args.size() || (_relocatable && _optimize))
             throw invalid_cmdline_args{};
+        for (; i < args.size(); ++i) {
+            if (*args[i] == '-')
+                throw invalid_cmdline_args{};
+            _input_files.emplace_back(args[i]);
+        }
     } catch (const invalid_cmdline_args&) {
         std::cerr << usage() << '\n';
         throw;
@@ -1653,24 +3907,134 @@ cmdline_args::cmdline_args(int argc, char* argv[]):
 
 std::string cmdline_args::usage()
 {
-    return cmdline_args_base::usage().append(R"([-v] input_file.s
+    return cmdline_args_base::usage().append(R"([-v] [-w] [-r | -O] [-c cache_dir] [-j jobs] input_file.s...
 
 -v ... verbose output
+-w ... watch source files and assemble again after any of them is changed,
+       only changed files are read again and only changed outputs are written
+-r ... assemble each input file to a relocatable object file input_file.o,
+       to be linked by mb50ld
+-O ... remove redundant instructions, replace set of a constant by shorter
+       instructions, and shorten and redirect jumps by peephole optimization,
+       report saved bytes and cycles
+-c ... cache parsed source files in directory cache_dir, a file is parsed again
+       only if it has been changed, or if the assembler has been rebuilt
+-j ... the number of programs assembled in parallel (default is the number of
+       CPU cores)
+input_file.s ... one or more programs, files included by more programs are read
+                 only once
 )"sv);
 }
 
 /*** Entry point *************************************************************/
 
+// Assembles a program or a relocatable object and writes output files, returns false after an error; if optimize,
+// the program is assembled repeatedly, until the peephole optimizer finds nothing more to remove
+bool assemble(const input& in, input::files_t::const_iterator top, bool verbose, bool keep_unchanged,
+              bool relocatable, bool optimize)
+{
+    try {
+        for (assembler::changes_t changes{};;) {
+            output out(top->second.orig_path, verbose, keep_unchanged);
+            assembler as(in, top, out, verbose, relocatable, optimize, changes);
+            as.run();
+            if (optimize) {
+                if (auto more = as.peephole(); more.size() > changes.size()) {
+                    changes = std::move(more);
+                    continue;
+                }
+                as.report();
+            }
+            if (relocatable)
+                as.write_object();
+            else
+                out.write();
+            return true;
+        }
+    } catch (const fatal_error& e) {
+        *diag << e.what() << std::endl;
+    } catch (const silent_error&) {
+        ; // already reported
+    }
+    return false;
+}
+
+// Assembles programs in parallel, they share only the immutable input; messages are written after all programs
+// are done, grouped by programs
+bool assemble_batch(const input& in, unsigned jobs, bool verbose, bool keep_unchanged, bool relocatable,
+                    bool optimize)
+{
+    const auto& tops = in.top_files();
+    std::vector<std::ostringstream> messages(tops.size());
+    std::vector<uint8_t> ok(tops.size(), 0);
+    std::atomic<size_t> next = 0;
+    auto worker = [&] {
+        for (size_t i = 0; (i = next++) < tops.size();) {
+            diag = &messages[i];
+            ok[i] = assemble(in, tops[i], verbose, keep_unchanged, relocatable, optimize);
+        }
+    };
+    std::vector<std::future<void>> workers;
+    for (unsigned j = 0; j < std::min(size_t{jobs}, tops.size()); ++j)
+        workers.push_back(std::async(std::launch::async, worker));
+    for (auto&& w: workers)
+        w.get();
+    for (size_t i = 0; i < tops.size(); ++i)
+        if (auto m = messages[i].view(); !m.empty())
+            std::cerr << "Program \"" << tops[i]->second.orig_path.string() << "\":\n" << m;
+    return std::ranges::all_of(ok, [](auto v) { return v != 0; });
+}
+
+// Assembles all programs, returns false after an error
+bool assemble_all(const input& in, const cmdline_args& args)
+{
+    return in.top_files().size() == 1 ?
+        assemble(in, in.top_files().front(), args.verbose(), args.watch(), args.relocatable(), args.optimize()) :
+        assemble_batch(in, args.jobs(), args.verbose(), args.watch(), args.relocatable(), args.optimize());
+}
+
+// Assembles programs repeatedly after changes of source files, until terminated; the parsed input is kept in
+// memory, only changed files are read again
+[[noreturn]] void watch(const cmdline_args& args)
+{
+    file_watcher watcher;
+    std::unique_ptr<input> in{};
+    input::files_t reuse{};
+    for (;;) {
+        // Top level files are watched even if they cannot be read
+        std::set<sfs::path> files{};
+        for (auto&& f: args.input_files())
+            files.insert(sfs::weakly_canonical(f));
+        try {
+            in = std::make_unique<input>(args.input_files(), args.cache_dir(), args.verbose(), std::move(reuse));
+            for (auto&& f: in->files())
+                files.insert(f.first);
+            assemble_all(*in, args);
+        } catch (const fatal_error& e) {
+            std::cerr << e.what() << std::endl;
+            in = nullptr;
+        } catch (const silent_error&) {
+            in = nullptr;
+        }
+        watcher.watch(std::move(files));
+        if (args.verbose())
+            std::cerr << "Waiting for changes" << std::endl;
+        auto changed = watcher.wait();
+        if (args.verbose())
+            for (auto&& f: changed)
+                std::cerr << "Changed file \"" << f.string() << '"' << std::endl;
+        reuse = in ? in->reusable(changed) : input::files_t{};
+    }
+}
+
 int main(int argc, char* argv[])
 {
     try {
         cmdline_args args{argc, argv};
-        input in(args.input_file(), args.verbose());
-        output out(args.input_file(), args.verbose());
-        assembler as(in, out, args.verbose());
-        as.run();
-        out.write();
-        return EXIT_SUCCESS;
+        if (args.watch())
+            watch(args);
+        input in(args.input_files(), args.cache_dir(), args.verbose());
+        return assemble_all(in, args) ? EXIT_SUCCESS : EXIT_FAILURE;
     } catch (const fatal_error& e) {
         std::cerr << e.what() << std::endl;
     } catch (const silent_error&) {
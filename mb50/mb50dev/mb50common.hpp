@@ -1,8 +1,13 @@
-// MB50 common declarations included by both mb50as and mb50dbg
+// MB50 common declarations included by the development tools in mb50dev
 
+#include <algorithm>
+#include <array>
 #include <cstdint>
+#include <cstring>
 #include <expected>
+#include <filesystem>
 #include <format>
+#include <map>
 #include <optional>
 #include <ostream>
 #include <ranges>
@@ -12,6 +17,11 @@
 #include <string_view>
 #include <vector>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 using namespace std::string_literals; // NOLINT
 using namespace std::string_view_literals; // NOLINT
 
@@ -436,6 +446,762 @@ result_t<bool> whitespace(std::string_view s, bool all)
 
 } // namespace parser
 
+/*** Instruction set *********************************************************/
+
+// Description of instructions of CPU MB5016, see mb5016_cu.vhd. All tables are
+// computed at compile time.
+namespace isa {
+
+// How an instruction uses an operand register
+enum class access: uint8_t {
+    none,
+    read,
+    write,
+    read_write, // also a conditional write, which may keep the old value
+};
+
+// The maximum length of a mnemonic
+constexpr size_t mnemonic_max = 7;
+
+// An instruction is encoded in two bytes: the opcode, then the destination
+// register in the upper 4 bits and the source register in the lower 4 bits
+struct instr_t {
+    std::array<char, mnemonic_max + 1> name{}; // mnemonic, terminated by '\0'
+    uint8_t opcode = 0x00; // the first (lower) byte of the instruction
+    access dst = access::none; // use of the destination register
+    access src = access::none; // use of the source register
+    bool flags = false; // sets ALU flags
+    bool dst_csr = false; // destination is CSR
+    bool src_csr = false; // source is CSR
+    uint8_t cycles = 5; // clock cycles of execution, of a conditional instruction if the condition is true
+    uint8_t cycles_false = 0; // clock cycles of execution of a conditional instruction if the condition is false
+    [[nodiscard]] constexpr std::string_view mnemonic() const {
+        return {name.data(), size_t(std::ranges::find(name, '\0') - name.begin())};
+    }
+};
+
+// Opcodes of conditional instructions, ORed with the condition
+constexpr uint8_t cond_ld = 0x90;
+constexpr uint8_t cond_ldis = 0xa0;
+constexpr uint8_t cond_mv = 0xc0;
+
+// The condition of a conditional instruction: a flag (bits 0-2) must have a value (bit 3)
+constexpr uint8_t cond_flag = 0x07;
+constexpr uint8_t cond_value = 0x08;
+
+// The numbers of registers with special roles: the stack pointer, the return address of a subroutine call, the
+// flags, and the program counter
+constexpr uint8_t reg_sp = 11;
+constexpr uint8_t reg_ca = 12;
+constexpr uint8_t reg_f = 14;
+constexpr uint8_t reg_pc = 15;
+
+// Clock cycles of entering an interrupt handler, added to the cycles of the instructions of the handler
+constexpr uint8_t intr_entry_cycles = 1;
+
+// The CPU clock frequency in Hz, system parameter CPU_HZ
+constexpr uint32_t cpu_hz = 50'000'000;
+
+namespace impl {
+
+constexpr std::array<char, mnemonic_max + 1> name(std::string_view s)
+{
+    if (s.size() > mnemonic_max)
+        throw std::length_error("Too long mnemonic");
+    std::array<char, mnemonic_max + 1> result{};
+    std::ranges::copy(s, result.begin());
+    return result;
+}
+
+using enum access;
+
+// Instructions with a fixed opcode
+constexpr std::array basic{
+    instr_t{.name = name("add"), .opcode = 0x01, .dst = read_write, .src = read, .flags = true},
+    instr_t{.name = name("and"), .opcode = 0x02, .dst = read_write, .src = read, .flags = true},
+    instr_t{.name = name("brk"), .opcode = 0x22},
+    instr_t{.name = name("cmps"), .opcode = 0x1b, .dst = read, .src = read, .flags = true},
+    instr_t{.name = name("cmpu"), .opcode = 0x19, .dst = read, .src = read, .flags = true},
+    instr_t{.name = name("csrr"), .opcode = 0x03, .dst = write, .src = read, .src_csr = true},
+    instr_t{.name = name("csrw"), .opcode = 0x04, .dst = write, .src = read, .dst_csr = true},
+    instr_t{.name = name("ddsto"), .opcode = 0x17, .dst = read_write, .src = read, .cycles = 7},
+    instr_t{.name = name("dec1"), .opcode = 0x05, .dst = write, .src = read, .flags = true},
+    instr_t{.name = name("dec2"), .opcode = 0x06, .dst = write, .src = read, .flags = true},
+    instr_t{.name = name("exch"), .opcode = 0x07, .dst = read_write, .src = read_write},
+    instr_t{.name = name("inc1"), .opcode = 0x08, .dst = write, .src = read, .flags = true},
+    instr_t{.name = name("inc2"), .opcode = 0x09, .dst = write, .src = read, .flags = true},
+    instr_t{.name = name("ill"), .opcode = 0x00},
+    instr_t{.name = name("ld"), .opcode = 0x0a, .dst = write, .src = read, .cycles = 7},
+    instr_t{.name = name("ldb"), .opcode = 0x0b, .dst = read_write, .src = read, .cycles = 6},
+    instr_t{.name = name("ldis"), .opcode = 0x0c, .dst = write, .src = read_write, .cycles = 8},
+    //instr_t{.name = name("ldisx"), .opcode = 0x0d},
+    instr_t{.name = name("mulss"), .opcode = 0x1e, .dst = read_write, .src = read_write, .flags = true},
+    instr_t{.name = name("mulsu"), .opcode = 0x1f, .dst = read_write, .src = read_write, .flags = true},
+    instr_t{.name = name("mulus"), .opcode = 0x20, .dst = read_write, .src = read_write, .flags = true},
+    instr_t{.name = name("muluu"), .opcode = 0x21, .dst = read_write, .src = read_write, .flags = true},
+    instr_t{.name = name("mv"), .opcode = 0x0e, .dst = write, .src = read},
+    instr_t{.name = name("neg"), .opcode = 0x0f, .dst = write, .src = read, .flags = true},
+    instr_t{.name = name("not"), .opcode = 0x10, .dst = write, .src = read, .flags = true},
+    instr_t{.name = name("or"), .opcode = 0x11, .dst = read_write, .src = read, .flags = true},
+    instr_t{.name = name("reti"), .opcode = 0x1c, .cycles = 8},
+    instr_t{.name = name("rev"), .opcode = 0x1d, .dst = write, .src = read, .flags = true},
+    instr_t{.name = name("shl"), .opcode = 0x12, .dst = read_write, .src = read, .flags = true},
+    instr_t{.name = name("shr"), .opcode = 0x13, .dst = read_write, .src = read, .flags = true},
+    instr_t{.name = name("shra"), .opcode = 0x14, .dst = read_write, .src = read, .flags = true},
+    instr_t{.name = name("sto"), .opcode = 0x15, .dst = read, .src = read, .cycles = 6},
+    instr_t{.name = name("stob"), .opcode = 0x16, .dst = read, .src = read},
+    instr_t{.name = name("sub"), .opcode = 0x18, .dst = read_write, .src = read, .flags = true},
+    instr_t{.name = name("xor"), .opcode = 0x1a, .dst = read_write, .src = read, .flags = true},
+};
+
+// Conditional instructions, the mnemonic is prefix, optional "n" (negation), flag, suffix
+struct cond_instr_t {
+    std::string_view prefix;
+    std::string_view suffix;
+    uint8_t opcode;
+    access dst;
+    access src;
+    uint8_t cycles;
+    uint8_t cycles_false;
+};
+
+constexpr std::array conditional{
+    //cond_instr_t{"exch", "", 0x80, read_write, read_write},
+    cond_instr_t{"ld", "", cond_ld, read_write, read, 7, 4},
+    cond_instr_t{"ld", "is", cond_ldis, read_write, read_write, 7, 5},
+    //cond_instr_t{"ldx", "is", 0xb0, read_write, read_write},
+    cond_instr_t{"mv", "", cond_mv, read_write, read, 5, 4},
+};
+
+// Names of flags tested by conditional instructions, indexed by the flag number
+constexpr std::array<std::string_view, 8> flags{"f0", "f1", "f2", "f3", "z", "c", "s", "o"};
+
+} // namespace impl
+
+// All instructions
+constexpr auto instructions = [] {
+    std::array<instr_t, impl::basic.size() + impl::conditional.size() * 2 * impl::flags.size()> result{};
+    auto it = std::ranges::copy(impl::basic, result.begin()).out;
+    for (auto&& c: impl::conditional)
+        for (uint8_t flag = 0; flag < impl::flags.size(); ++flag)
+            for (bool value: {true, false}) {
+                std::string name{c.prefix};
+                name.append(value ? "" : "n").append(impl::flags[flag]).append(c.suffix);
+                *it++ = {
+                    .name = impl::name(name),
+                    .opcode = uint8_t(c.opcode | (value ? cond_value : 0U) | flag),
+                    .dst = c.dst,
+                    .src = c.src,
+                    .cycles = c.cycles,
+                    .cycles_false = c.cycles_false,
+                };
+            }
+    return result;
+}();
+
+// No index to instructions, an unused opcode or an empty slot of the hash table
+constexpr uint8_t no_instr = 0xff;
+static_assert(instructions.size() < no_instr);
+
+// Indices to instructions by opcode
+constexpr std::array<uint8_t, 256> decode_table = [] {
+    std::array<uint8_t, 256> result{};
+    result.fill(no_instr);
+    for (size_t i = 0; i < instructions.size(); ++i)
+        result[instructions[i].opcode] = uint8_t(i);
+    return result;
+}();
+
+// The description of an instruction by its opcode, nullptr for an unused opcode
+constexpr const instr_t* decode(uint8_t opcode)
+{
+    auto i = decode_table[opcode];
+    return i == no_instr ? nullptr : &instructions[i];
+}
+
+// A seeded FNV-1a hash of a mnemonic
+constexpr uint32_t hash(std::string_view s, uint32_t seed)
+{
+    uint32_t h = 2166136261U ^ seed;
+    for (char c: s) {
+        h ^= uint8_t(c);
+        h *= 16777619U;
+    }
+    return h;
+}
+
+// Perfect hash table of mnemonics: the first seed without collisions
+struct hash_table_t {
+    static constexpr size_t size = 1024;
+    uint32_t seed = 0;
+    std::array<uint8_t, size> slots{}; // index to instructions, no_instr if empty
+};
+
+constexpr hash_table_t hash_table = [] {
+    for (hash_table_t result{};; ++result.seed) {
+        result.slots.fill(no_instr);
+        bool ok = true;
+        for (size_t i = 0; ok && i < instructions.size(); ++i) {
+            auto& slot = result.slots[hash(instructions[i].mnemonic(), result.seed) % hash_table_t::size];
+            ok = slot == no_instr;
+            slot = uint8_t(i);
+        }
+        if (ok)
+            return result;
+    }
+}();
+
+// The description of an instruction by its mnemonic, nullptr for an unknown mnemonic
+constexpr const instr_t* find(std::string_view mnemonic)
+{
+    auto i = hash_table.slots[hash(mnemonic, hash_table.seed) % hash_table_t::size];
+    return i != no_instr && instructions[i].mnemonic() == mnemonic ? &instructions[i] : nullptr;
+}
+
+// The opcode of an instruction, intended for constant expressions, where an unknown mnemonic is a compile error
+consteval uint8_t opcode(std::string_view mnemonic)
+{
+    if (auto i = find(mnemonic))
+        return i->opcode;
+    throw std::invalid_argument("Unknown mnemonic");
+}
+
+// Whether an instruction is conditional, that is, it tests a flag
+constexpr bool conditional(const instr_t& instr)
+{
+    auto c = uint8_t(instr.opcode & ~(cond_flag | cond_value));
+    return c == cond_ld || c == cond_ldis || c == cond_mv;
+}
+
+// Whether an instruction always transfers control, that is, the following instruction is never executed after it.
+// Instruction exch is a subroutine call, which returns to the following instruction.
+constexpr bool jumps(const instr_t& instr, uint8_t regs)
+{
+    if (instr.opcode == opcode("reti"))
+        return true;
+    if (conditional(instr))
+        return false;
+    return regs >> 4U == reg_pc && !instr.dst_csr && instr.opcode != opcode("exch") &&
+        (instr.dst == access::write || instr.dst == access::read_write);
+}
+
+// A textual representation of an instruction in the assembler syntax
+std::string disassemble(uint8_t opcode, uint8_t regs)
+{
+    if (auto i = decode(opcode))
+        return std::format("{} {}r{}, {}r{}", i->mnemonic(), i->dst_csr ? "cs" : "", regs >> 4U,
+                           i->src_csr ? "cs" : "", regs & 0x0fU);
+    return std::format("$data_b {:#04x}, {:#04x}", opcode, regs);
+}
+
+} // namespace isa
+
+/*** Memory-mapped files ****************************************************/
+
+// A file mapped read-only to memory
+class mapped_file {
+public:
+    explicit mapped_file(const std::filesystem::path& file);
+    mapped_file(const mapped_file&) = delete;
+    mapped_file(mapped_file&&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+    mapped_file& operator=(mapped_file&&) = delete;
+    ~mapped_file();
+    // Whether the file has been successfully mapped, an empty file is not mapped, but it is OK
+    [[nodiscard]] bool ok() const { return _ok; }
+    [[nodiscard]] const char* data() const { return static_cast<const char*>(_data); }
+    [[nodiscard]] size_t size() const { return _size; }
+    [[nodiscard]] std::string_view text() const { return {data(), _size}; }
+private:
+    void* _data = nullptr;
+    size_t _size = 0;
+    bool _ok = false;
+};
+
+mapped_file::mapped_file(const std::filesystem::path& file)
+{
+    if (int fd = open(file.c_str(), O_RDONLY); fd >= 0) {
+        if (struct stat st{}; fstat(fd, &st) == 0) {
+            _size = size_t(st.st_size);
+            if (_size == 0)
+                _ok = true;
+            else if (_data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0); _data == MAP_FAILED)
+                _data = nullptr;
+            else
+                _ok = true;
+        }
+        close(fd);
+    }
+    if (!_data)
+        _size = 0;
+}
+
+mapped_file::~mapped_file()
+{
+    if (_data)
+        munmap(_data, _size);
+}
+
+/*** Debug information *******************************************************/
+
+// Binary debug information file (FILE.dbg) produced by mb50as. It is designed
+// to be mapped to memory and searched without parsing: a header is followed by
+// tables of fixed-size entries, each sorted for binary search, and by a pool
+// of strings. Offsets are in bytes from the start of the file, integers are
+// stored in the byte order of the host.
+namespace debug_info {
+
+// Identification of the file format, the last character is the version
+constexpr std::array<char, 8> magic{'M', 'B', '5', '0', 'D', 'B', 'G', '1'};
+
+// A string in the string pool, without a terminating '\0'
+struct string_t {
+    uint32_t offset; // from the start of the string pool
+    uint32_t size;
+};
+
+// Location of a table in the file
+struct table_t {
+    uint32_t offset;
+    uint32_t size; // number of entries
+};
+
+struct header_t {
+    std::array<char, 8> magic;
+    table_t files; // string_t, names of source files, indexed by line_t::file
+    table_t lines; // line_t, sorted by addr and level
+    table_t symbols; // symbol_t, sorted by name
+    table_t labels; // uint32_t, indices of labels in symbols, sorted by value and name
+    table_t strings; // char, the string pool
+};
+
+// A source line that generated size bytes starting at addr. Bytes generated
+// by a macro have an entry for each macro nesting level, level 0 being the
+// outermost macro invocation.
+struct line_t {
+    uint16_t addr;
+    uint16_t size;
+    uint16_t level;
+    uint16_t reserved;
+    uint32_t file;
+    uint32_t line;
+};
+
+// A label or a constant. A name defined in a file included by $use is
+// qualified by the namespace of the file, a name defined in the top level file
+// is not qualified, and an unqualified (global) name starts with '.'.
+struct symbol_t {
+    string_t name;
+    uint16_t value;
+    uint16_t label; // 1 = label, 0 = constant
+};
+
+// Read-only access to a debug information file mapped to memory
+class reader {
+public:
+    explicit reader(const std::filesystem::path& file);
+    [[nodiscard]] std::string_view str(string_t s) const;
+    [[nodiscard]] std::string_view file(uint32_t idx) const {
+        return idx < _files.size() ? str(_files[idx]) : std::string_view{};
+    }
+    [[nodiscard]] std::span<const symbol_t> symbols() const { return _symbols; }
+    // Finds a symbol by name, nullptr if not found
+    [[nodiscard]] const symbol_t* symbol(std::string_view name) const;
+    // The label with the highest value not greater than addr, nullptr if there is no such label
+    [[nodiscard]] const symbol_t* label(uint16_t addr) const;
+    // Source lines of all macro nesting levels that generated the byte at addr, ordered by level
+    [[nodiscard]] std::span<const line_t> lines(uint16_t addr) const;
+private:
+    // Gets a table, checks that it is inside the file
+    template<class T> std::span<const T> table(table_t t) const;
+    mapped_file map;
+    std::span<const string_t> _files{};
+    std::span<const line_t> _lines{};
+    std::span<const symbol_t> _symbols{};
+    std::span<const uint32_t> _labels{};
+    std::span<const char> _strings{};
+};
+
+reader::reader(const std::filesystem::path& file):
+    map(file)
+{
+    if (!map.ok())
+        throw fatal_error(std::format("Cannot read debug information file \"{}\"", file.string()));
+    header_t header{};
+    if (map.size() >= sizeof(header))
+        std::memcpy(&header, map.data(), sizeof(header));
+    try {
+        if (map.size() < sizeof(header) || header.magic != magic)
+            throw fatal_error("");
+        _files = table<string_t>(header.files);
+        _lines = table<line_t>(header.lines);
+        _symbols = table<symbol_t>(header.symbols);
+        _labels = table<uint32_t>(header.labels);
+        _strings = table<char>(header.strings);
+        if (!std::ranges::all_of(_labels, [this](uint32_t i) { return i < _symbols.size(); }))
+            throw fatal_error("");
+    } catch (const fatal_error&) {
+        throw fatal_error(std::format("Invalid debug information file \"{}\"", file.string()));
+    }
+}
+
+template<class T> std::span<const T> reader::table(table_t t) const
+{
+    if (t.offset % alignof(T) != 0 || t.offset > map.size() || (map.size() - t.offset) / sizeof(T) < t.size)
+        throw fatal_error("");
+    return {reinterpret_cast<const T*>(map.data() + t.offset), t.size};
+}
+
+std::string_view reader::str(string_t s) const
+{
+    if (s.offset > _strings.size() || _strings.size() - s.offset < s.size)
+        return {};
+    return {_strings.data() + s.offset, s.size};
+}
+
+const symbol_t* reader::symbol(std::string_view name) const
+{
+    auto it = std::ranges::lower_bound(_symbols, name, {}, [this](const symbol_t& s) { return str(s.name); });
+    return it != _symbols.end() && str(it->name) == name ? &*it : nullptr;
+}
+
+const symbol_t* reader::label(uint16_t addr) const
+{
+    auto value = [this](uint32_t i) { return _symbols[i].value; };
+    auto it = std::ranges::upper_bound(_labels, addr, {}, value);
+    if (it == _labels.begin())
+        return nullptr;
+    // The first of labels with the same value
+    it = std::ranges::lower_bound(_labels.begin(), it, value(*std::prev(it)), {}, value);
+    return &_symbols[*it];
+}
+
+std::span<const line_t> reader::lines(uint16_t addr) const
+{
+    auto end = std::ranges::upper_bound(_lines, addr, {}, &line_t::addr);
+    if (end == _lines.begin())
+        return {};
+    auto last = std::prev(end);
+    if (size_t(addr) >= size_t(last->addr) + last->size)
+        return {};
+    return {std::ranges::lower_bound(_lines.begin(), end, last->addr, {}, &line_t::addr), end};
+}
+
+// Builds the contents of a debug information file, used by the assembler and the linker
+class writer {
+public:
+    // The file name must be valid until data() is called
+    void add_line(uint16_t addr, uint16_t size, uint16_t level, std::string_view file, size_t line) {
+        src_lines.push_back({.addr = addr, .size = size, .level = level, .file = file, .line = line});
+    }
+    void add_symbol(std::string name, uint16_t value, bool label) {
+        src_symbols.push_back({.name = std::move(name), .value = value, .label = label});
+    }
+    [[nodiscard]] std::string data();
+private:
+    struct src_line_t {
+        uint16_t addr;
+        uint16_t size;
+        uint16_t level;
+        std::string_view file;
+        size_t line;
+    };
+    struct src_symbol_t {
+        std::string name;
+        uint16_t value;
+        bool label;
+    };
+    std::vector<src_line_t> src_lines;
+    std::vector<src_symbol_t> src_symbols;
+};
+
+std::string writer::data()
+{
+    std::vector<char> strings;
+    auto add_string = [&strings](std::string_view s) {
+        string_t result{.offset = uint32_t(strings.size()), .size = uint32_t(s.size())};
+        strings.insert(strings.end(), s.begin(), s.end());
+        return result;
+    };
+    // Bytes may be added out of order after $addr, stable sorting keeps macro nesting levels ordered
+    std::ranges::stable_sort(src_lines, {}, &src_line_t::addr);
+    std::map<std::string_view, uint32_t> file_idx;
+    std::vector<string_t> files;
+    std::vector<line_t> lines;
+    for (auto&& l: src_lines) {
+        auto [it, added] = file_idx.try_emplace(l.file, uint32_t(files.size()));
+        if (added)
+            files.push_back(add_string(l.file));
+        lines.push_back({.addr = l.addr, .size = l.size, .level = l.level, .reserved = 0, .file = it->second,
+                         .line = uint32_t(l.line)});
+    }
+    std::ranges::sort(src_symbols, {}, &src_symbol_t::name);
+    std::vector<symbol_t> symbols;
+    std::vector<uint32_t> labels;
+    for (auto&& s: src_symbols) {
+        // Global names are aliases of qualified names, do not use them for symbolization of addresses
+        if (s.label && !s.name.starts_with('.'))
+            labels.push_back(uint32_t(symbols.size()));
+        symbols.push_back({.name = add_string(s.name), .value = s.value, .label = uint16_t(s.label)});
+    }
+    std::ranges::stable_sort(labels, {}, [&symbols](uint32_t i) { return symbols[i].value; });
+    // All entry sizes are multiples of 4, hence all tables are aligned
+    header_t header{};
+    header.magic = magic;
+    auto offset = uint32_t(sizeof(header));
+    auto place = [&offset]<class T>(const std::vector<T>& v) {
+        table_t t{.offset = offset, .size = uint32_t(v.size())};
+        offset += uint32_t(v.size() * sizeof(T));
+        return t;
+    };
+    header.files = place(files);
+    header.lines = place(lines);
+    header.symbols = place(symbols);
+    header.labels = place(labels);
+    header.strings = place(strings);
+
+    std::string data(reinterpret_cast<const char*>(&header), sizeof(header));
+    auto write_table = [&data]<class T>(const std::vector<T>& v) {
+        data.append(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+    };
+    write_table(files);
+    write_table(lines);
+    write_table(symbols);
+    write_table(labels);
+    write_table(strings);
+    return data;
+}
+
+} // namespace debug_info
+
+/*** Relocatable object files ************************************************/
+
+// Relocatable object file (FILE.o) produced by mb50as -r from a single source
+// file (a module) and linked to a program by mb50ld. The layout follows debug
+// information: a header is followed by tables of fixed-size entries and by
+// a pool of strings. Addresses in the object are offsets from the start of the
+// module. Values that depend on addresses are stored as expressions in postfix
+// order and evaluated by the linker.
+namespace object_file {
+
+using debug_info::string_t;
+using debug_info::table_t;
+
+// Identification of the file format, the last character is the version
+constexpr std::array<char, 8> magic{'M', 'B', '5', '0', 'O', 'B', 'J', '2'};
+
+struct header_t {
+    std::array<char, 8> magic;
+    string_t source; // the absolute path of the source file, identifies the module in $use directives
+    uint32_t size; // of the module in the address space, including space reserved by $addr after the last byte
+    uint32_t code_offset; // of the first byte of code
+    table_t uses; // use_t, $use directives of the module in the source order
+    table_t symbols; // symbol_t, labels and constants defined by the module
+    table_t fixups; // fixup_t, values stored to code by the linker
+    table_t nodes; // node_t, expressions referenced by symbols and fixups
+    table_t refs; // ref_t, symbols of other modules referenced by nodes
+    table_t files; // string_t, names of source files, indexed by fixup_t::file and line_t::file
+    table_t lines; // debug_info::line_t, source lines of code, with addresses relative to the module
+    table_t blocks; // block_t, boundaries of blocks sorted by offsets, the last one at the end of the module
+    table_t code; // uint8_t, code and data of the module, values of fixups are zero
+    table_t strings; // char, the string pool
+};
+
+// A module included by $use
+struct use_t {
+    string_t name_space;
+    string_t file; // the absolute path of the source file
+};
+
+// Operation of an expression node
+enum class op_t: uint16_t {
+    constant, // value
+    local, // the address of the byte at offset value in this module
+    ref, // the value of symbol refs[ref]
+    bit_or,
+    bit_xor,
+    bit_and,
+    shl,
+    shr,
+    add,
+    sub,
+    mul,
+    div,
+    rem,
+    bit_not,
+    neg,
+};
+
+struct node_t {
+    op_t op;
+    uint16_t value;
+    uint32_t ref;
+};
+
+// Nodes nodes[begin]...nodes[begin + size - 1], the last one is the root
+struct expr_t {
+    uint32_t begin;
+    uint32_t size;
+};
+
+// A symbol defined in the top level scope of a module
+struct symbol_t {
+    string_t name;
+    expr_t expr;
+    uint32_t label; // 1 = label, 0 = constant
+};
+
+// A value stored at offset after linking
+struct fixup_t {
+    expr_t expr;
+    uint16_t offset;
+    uint16_t word; // 0 = byte, 1 = word
+    uint32_t file; // source file of the expression, for error messages
+    uint32_t line;
+};
+
+// A symbol in another module, identified by the source file and the name, or an unqualified (global) name if file
+// is empty
+struct ref_t {
+    string_t file;
+    string_t name;
+};
+
+// The module is split to blocks by labels. A block starts at offset of a boundary and ends at offset of the next
+// boundary, the first block starts at offset 0. A block that is not used by the program can be removed by the linker.
+// If code cannot be split, for example, because $addr moves backwards, there is only the boundary at the end.
+struct block_t {
+    uint32_t offset;
+    uint32_t falls; // 1 = execution may continue from the preceding block (or the next module) to the offset
+};
+
+// Read-only access to an object file mapped to memory
+class reader {
+public:
+    explicit reader(const std::filesystem::path& file);
+    [[nodiscard]] const header_t& header() const { return _header; }
+    [[nodiscard]] std::string_view str(string_t s) const;
+    [[nodiscard]] std::string_view source() const { return str(_header.source); }
+    [[nodiscard]] std::span<const use_t> uses() const { return _uses; }
+    [[nodiscard]] std::span<const symbol_t> symbols() const { return _symbols; }
+    [[nodiscard]] std::span<const fixup_t> fixups() const { return _fixups; }
+    [[nodiscard]] std::span<const node_t> nodes(expr_t e) const { return _nodes.subspan(e.begin, e.size); }
+    [[nodiscard]] std::span<const ref_t> refs() const { return _refs; }
+    [[nodiscard]] std::string_view file(uint32_t idx) const {
+        return idx < _files.size() ? str(_files[idx]) : std::string_view{};
+    }
+    [[nodiscard]] std::span<const debug_info::line_t> lines() const { return _lines; }
+    [[nodiscard]] std::span<const block_t> blocks() const { return _blocks; }
+    [[nodiscard]] std::span<const uint8_t> code() const { return _code; }
+private:
+    template<class T> std::span<const T> table(table_t t) const;
+    // Checks that an expression is inside the table of nodes and its references are valid
+    [[nodiscard]] bool valid(expr_t e) const;
+    mapped_file map;
+    header_t _header{};
+    std::span<const use_t> _uses{};
+    std::span<const symbol_t> _symbols{};
+    std::span<const fixup_t> _fixups{};
+    std::span<const node_t> _nodes{};
+    std::span<const ref_t> _refs{};
+    std::span<const string_t> _files{};
+    std::span<const debug_info::line_t> _lines{};
+    std::span<const block_t> _blocks{};
+    std::span<const uint8_t> _code{};
+    std::span<const char> _strings{};
+};
+
+reader::reader(const std::filesystem::path& file):
+    map(file)
+{
+    if (!map.ok())
+        throw fatal_error(std::format("Cannot read object file \"{}\"", file.string()));
+    if (map.size() >= sizeof(_header))
+        std::memcpy(&_header, map.data(), sizeof(_header));
+    try {
+        if (map.size() < sizeof(_header) || _header.magic != magic)
+            throw fatal_error("");
+        _uses = table<use_t>(_header.uses);
+        _symbols = table<symbol_t>(_header.symbols);
+        _fixups = table<fixup_t>(_header.fixups);
+        _nodes = table<node_t>(_header.nodes);
+        _refs = table<ref_t>(_header.refs);
+        _files = table<string_t>(_header.files);
+        _lines = table<debug_info::line_t>(_header.lines);
+        _blocks = table<block_t>(_header.blocks);
+        _code = table<uint8_t>(_header.code);
+        _strings = table<char>(_header.strings);
+        if (_header.size > 0x10000 || _header.code_offset + _code.size() > _header.size ||
+            !std::ranges::all_of(_symbols, [this](auto&& s) { return valid(s.expr); }) ||
+            !std::ranges::all_of(_fixups, [this](auto&& f) {
+                return valid(f.expr) && f.offset + f.word + 1U <= _header.size && f.file < _files.size();
+            }) ||
+            !std::ranges::all_of(_lines, [this](auto&& l) {
+                return l.addr + l.size <= _header.size && l.file < _files.size();
+            }) ||
+            _blocks.empty() || _blocks.back().offset != _header.size ||
+            !std::ranges::is_sorted(_blocks, {}, &block_t::offset))
+        {
+            throw fatal_error("");
+        }
+    } catch (const fatal_error&) {
+        throw fatal_error(std::format("Invalid object file \"{}\"", file.string()));
+    }
+}
+
+template<class T> std::span<const T> reader::table(table_t t) const
+{
+    if (t.offset % alignof(T) != 0 || t.offset > map.size() || (map.size() - t.offset) / sizeof(T) < t.size)
+        throw fatal_error("");
+    return {reinterpret_cast<const T*>(map.data() + t.offset), t.size};
+}
+
+bool reader::valid(expr_t e) const
+{
+    if (e.size == 0 || e.begin > _nodes.size() || _nodes.size() - e.begin < e.size)
+        return false;
+    return std::ranges::all_of(nodes(e), [this](const node_t& n) {
+        return n.op <= op_t::neg && (n.op != op_t::ref || n.ref < _refs.size());
+    });
+}
+
+std::string_view reader::str(string_t s) const
+{
+    if (s.offset > _strings.size() || _strings.size() - s.offset < s.size)
+        return {};
+    return {_strings.data() + s.offset, s.size};
+}
+
+} // namespace object_file
+
+/*** Program files ***********************************************************/
+
+// Contents of a raw binary file (FILE.bin): the start address as four hexadecimal digits and a newline, followed by
+// the memory image starting at the start address
+std::string program_bin(size_t start, std::span<const uint8_t> image)
+{
+    return std::format("{:04x}\n", start).append(reinterpret_cast<const char*>(image.data()), image.size());
+}
+
+// Contents of a Memory Initialization File (FILE.mif) with a memory image starting at address start, generator is
+// the name of the program that produced it
+std::string program_mif(std::string_view generator, size_t start, std::span<const uint8_t> image)
+{
+    std::string result = std::format(R"(-- {} generated Memory Initialization File (.mif)
+
+WIDTH=8;
+DEPTH=30720;
+
+ADDRESS_RADIX=HEX;
+DATA_RADIX=HEX;
+
+CONTENT BEGIN
+)", generator);
+    for (size_t i = 0; i < image.size(); ++i)
+        result.append(std::format("\t{:04x}: {:02x};\n", start + i, image[i]));
+    return result.append("END;\n");
+}
+
 /*** Command line processing *************************************************/
 
 class cmdline_args_base {
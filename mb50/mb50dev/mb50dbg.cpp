@@ -1,14 +1,17 @@
 // MB50DEV debugger
 
 #include "mb50common.hpp"
+#include "mb50sim.hpp"
 
 #include <algorithm>
 #include <cstdlib>
+#include <deque>
 #include <filesystem>
 #include <format>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <set>
 #include <system_error>
 
@@ -101,6 +104,97 @@ template<class T> script_history& script_history::operator<<(const T& v)
     return *this;
 }
 
+/*** Symbolic debugging ******************************************************/
+
+// Debug information produced by the assembler. It is used to accept names of
+// labels and constants in place of addresses and to display the label and the
+// source lines of an address. Lookups are binary searches in the mapped file.
+// It is shared by the commands that use symbols.
+class debug_symbols {
+public:
+    // Replaces the currently loaded debug information
+    void load(const std::filesystem::path& file);
+    void unload();
+    // The loaded file, empty if none
+    [[nodiscard]] const std::filesystem::path& file() const { return _file; }
+    // Parses an address, either a number or a name of a label or a constant
+    parser::result_t<parser::number_t> address(std::string_view s, bool all) const;
+    // Returns "label+offset" for an address, or an empty string if there is no label at or before addr
+    [[nodiscard]] std::string label(uint16_t addr) const;
+    // Displays the label and the source lines of all macro nesting levels for an address
+    void show_location(script_history& log, uint16_t addr);
+private:
+    // Text of a source line, source files are read when needed
+    std::string_view source_line(std::string_view file, size_t line);
+    std::unique_ptr<debug_info::reader> info{};
+    std::filesystem::path _file{};
+    std::map<std::string, std::vector<std::string>, std::less<>> sources{};
+};
+
+void debug_symbols::load(const std::filesystem::path& file)
+{
+    auto new_info = std::make_unique<debug_info::reader>(file);
+    unload();
+    info = std::move(new_info);
+    _file = file;
+}
+
+void debug_symbols::unload()
+{
+    info.reset();
+    _file.clear();
+    sources.clear();
+}
+
+parser::result_t<parser::number_t> debug_symbols::address(std::string_view s, bool all) const
+{
+    auto v = parser::number_unsigned(s, all);
+    if (v.first || !info)
+        return v;
+    if (auto id = parser::identifier(s, all); id.first) {
+        auto name = std::format("{}", *id.first);
+        if (auto sym = info->symbol(name))
+            return {parser::number_t{.val = sym->value, .word = true}, id.second};
+        return {std::unexpected{std::format("Unknown symbol \"{}\"", name)}, s};
+    }
+    return v;
+}
+
+std::string debug_symbols::label(uint16_t addr) const
+{
+    if (info)
+        if (auto l = info->label(addr))
+            return std::format("{}+{:#x}", info->str(l->name), addr - l->value);
+    return {};
+}
+
+void debug_symbols::show_location(script_history& log, uint16_t addr)
+{
+    if (!info)
+        return;
+    if (auto l = label(addr); !l.empty()) {
+        log.output() << "At " << l;
+        log.endl();
+    }
+    for (auto&& l: info->lines(addr)) {
+        auto file = info->file(l.file);
+        log.output() << std::format("{:{}}{}:{}: {}", "", 2 * l.level, file, l.line, source_line(file, l.line));
+        log.endl();
+    }
+}
+
+std::string_view debug_symbols::source_line(std::string_view file, size_t line)
+{
+    auto it = sources.find(file);
+    if (it == sources.end()) {
+        it = sources.emplace(file, std::vector<std::string>{}).first;
+        std::ifstream ifs{std::string(file)};
+        for (std::string l; std::getline(ifs, l);)
+            it->second.push_back(std::move(l));
+    }
+    return line > 0 && line <= it->second.size() ? std::string_view(it->second[line - 1]) : std::string_view{};
+}
+
 /*** MB50 CDI ****************************************************************/
 
 // Request codes correspond to Req* constants in cdi.vhd
@@ -147,13 +241,17 @@ public:
     ~cdi();
     cdi& operator=(const cdi&) = delete;
     cdi& operator=(cdi&&) = delete;
-    void cmd_execute();
+    status_t cmd_execute();
     std::vector<uint8_t> cmd_memory(uint16_t addr, uint16_t size);
     void cmd_memory(uint16_t addr, const std::vector<uint8_t>& data);
     uint16_t cmd_register(uint8_t r, bool csr);
     void cmd_register(uint8_t r, bool csr, uint16_t v);
-    void cmd_status();
+    status_t cmd_status(bool quiet = false);
     status_t cmd_step(bool quiet = false);
+    // Send a step request without waiting for the response, used for pipelining steps
+    void cmd_step_req();
+    // Receive the response to the oldest request sent by cmd_step_req()
+    status_t cmd_step_resp();
 private:
     [[nodiscard]] std::vector<uint8_t> read_serial(size_t n) const;
     void write_serial(std::span<const uint8_t> data) const;
@@ -194,7 +292,7 @@ void cdi::check_response(uint8_t resp, cdi_response expected)
                                       resp, static_cast<uint8_t>(expected)));
 }
 
-void cdi::cmd_execute()
+cdi::status_t cdi::cmd_execute()
 {
     std::array req{
         static_cast<uint8_t>(cdi_request::execute),
@@ -211,9 +309,9 @@ void cdi::cmd_execute()
     if (FD_ISSET(STDIN_FILENO, &fds)) {
         std::string line;
         std::getline(std::cin, line);
-        cmd_status();
+        return cmd_status();
     } else // tty_fd ready
-        show_status(true);
+        return show_status(true);
 }
 
 std::vector<uint8_t> cdi::cmd_memory(uint16_t addr, uint16_t size)
@@ -275,27 +373,40 @@ void cdi::cmd_register(uint8_t r, bool csr, uint16_t v)
     check_response(resp[0], cdi_response::reg_wr);
 }
 
-void cdi::cmd_status()
+cdi::status_t cdi::cmd_status(bool quiet)
 {
     std::array req{
         static_cast<uint8_t>(cdi_request::status),
     };
     write_serial(req);
-    show_status();
+    if (quiet)
+        return read_status();
+    else
+        return show_status();
 }
 
 cdi::status_t cdi::cmd_step(bool quiet)
 {
-    std::array req{
-        static_cast<uint8_t>(cdi_request::step),
-    };
-    write_serial(req);
+    cmd_step_req();
     if (quiet)
         return read_status();
     else
         return show_status();
 }
 
+void cdi::cmd_step_req()
+{
+    std::array req{
+        static_cast<uint8_t>(cdi_request::step),
+    };
+    write_serial(req);
+}
+
+cdi::status_t cdi::cmd_step_resp()
+{
+    return read_status();
+}
+
 std::vector<uint8_t> cdi::read_serial(size_t n) const
 {
     std::vector<uint8_t> result(n);
@@ -342,6 +453,23 @@ void cdi::write_serial(std::span<const uint8_t> data) const
 
 bool do_file(cdi& mb50, script_history& log, const std::filesystem::path& file);
 
+// Check without blocking if the user entered a line requesting to stop a running command
+bool user_break()
+{
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(STDIN_FILENO, &fds);
+    timeval tv{};
+    if (select(STDIN_FILENO + 1, &fds, nullptr, nullptr, &tv) < 0)
+        throw fatal_error("Failed call to select(2): "s.append(errno_message()));
+    if (FD_ISSET(STDIN_FILENO, &fds)) {
+        std::string line;
+        std::getline(std::cin, line);
+        return true;
+    }
+    return false;
+}
+
 // Base class for all commands
 class command {
 public:
@@ -401,6 +529,7 @@ private:
         }
     };
     command_table();
+    std::shared_ptr<debug_symbols> _symbols;
     std::shared_ptr<cmd_break> _cmd_break;
     std::shared_ptr<cmd_dump> _cmd_dump;
     std::map<std::string_view, command_t> commands;
@@ -410,6 +539,7 @@ private:
 class cmd_break: public command {
 public:
     using breakpoints_t = std::set<uint16_t>;
+    explicit cmd_break(std::shared_ptr<debug_symbols> symbols): symbols{std::move(symbols)} {}
     std::vector<std::string_view> aliases() override { return {"b"}; }
     std::string_view help() override {
         return R"(If a breakpoint is set on an address, the program execution is stopped
@@ -422,6 +552,7 @@ If called with - only, delete all breakpoints.)";
     bool operator()(cdi& mb50, script_history&log, std::string_view cmd, std::string_view args) override;
     [[nodiscard]] const breakpoints_t& breakpoints() const { return _breakpoints; }
 private:
+    std::shared_ptr<debug_symbols> symbols;
     breakpoints_t _breakpoints{};
 };
 
@@ -443,7 +574,7 @@ bool cmd_break::operator()(cdi&, script_history& log, std::string_view, std::str
         }
     }
     if (!args.empty()) {
-        if (auto addr_v = parser::number_unsigned(args, true); !addr_v.first) {
+        if (auto addr_v = symbols->address(args, true); !addr_v.first) {
             log.output() << "Invalid address: " << addr_v.first.error();
             log.endl();
             return true;
@@ -479,13 +610,183 @@ bool cmd_break::operator()(cdi&, script_history& log, std::string_view, std::str
             log.endl();
             for (auto a: _breakpoints) {
                 log.output() << std::format("{:#06x}", a);
+                if (auto l = symbols->label(a); !l.empty())
+                    log << ' ' << l;
+                log.endl();
+            }
+        }
+    }
+    return true;
+}
+
+// Command cosim
+class cmd_cosim: public command {
+public:
+    explicit cmd_cosim(std::shared_ptr<debug_symbols> symbols, std::shared_ptr<cmd_break> breakpoints = nullptr):
+        symbols{std::move(symbols)}, breakpoints{std::move(breakpoints)} {}
+    std::string_view help() override {
+        return R"(Run the program in lockstep on the target computer and in a software
+simulator, in order to verify that the simulator behaves exactly as the CPU.
+The simulator is initialized by registers, CSRs, and memory read from the
+target, which takes a few seconds. Then the target executes single steps.
+Value of pc reported by the target is compared with the simulator after each
+instruction. All registers and CSRs are compared after every CHECK (default
+256, 0 = only at the end) instructions and when stopping. Execution stops at
+the first difference, after STEPS instructions (if nonzero), at a breakpoint,
+when the CPU halts, or by entering a newline. If a difference is found, the
+states of the target and of the simulator are displayed. Step requests are
+pipelined, hence both the target and the simulator may execute one more
+instruction after a difference in pc is detected. I/O devices are not
+simulated, therefore reading a device register or a hardware interrupt
+causes a difference.)";
+    }
+    std::string_view help_args() override { return "[STEPS [CHECK]]"; }
+    bool operator()(cdi& mb50, script_history& log, std::string_view cmd, std::string_view args) override;
+private:
+    // Registers and CSRs, in the order r0...r15, csr0...csr3
+    using state_t = std::array<uint16_t, 16 + mb5016_sim::csr_num>;
+    // Maximum number of unanswered step requests; the CDI receiver stores
+    // a single byte, so a second request can wait there while the first one
+    // is being processed
+    static constexpr size_t pipeline_depth = 2;
+    static constexpr uint16_t default_check = 256;
+    static state_t target_state(cdi& mb50);
+    static state_t sim_state(const mb5016_sim& sim);
+    static void display(script_history& log, const state_t& target, const state_t& sim);
+    std::shared_ptr<debug_symbols> symbols;
+    std::shared_ptr<cmd_break> breakpoints;
+};
+
+bool cmd_cosim::operator()(cdi& mb50, script_history& log, std::string_view, std::string_view args)
+{
+    uint16_t steps = 0;
+    uint16_t check = default_check;
+    if (!args.empty()) {
+        auto steps_v = parser::number_unsigned(args, false);
+        if (!steps_v.first) {
+            log.output() << "Invalid number of steps: " << steps_v.first.error();
+            log.endl();
+            return true;
+        }
+        steps = steps_v.first->val;
+        if (size_t check_b = steps_v.second.find_first_not_of(whitespace_chars); check_b != std::string_view::npos) {
+            if (auto check_v = parser::number_unsigned(steps_v.second.substr(check_b), true); !check_v.first) {
+                log.output() << "Invalid number of steps between checks: " << check_v.first.error();
                 log.endl();
+                return true;
+            } else
+                check = check_v.first->val;
+        }
+    }
+    auto bp = breakpoints ? &breakpoints->breakpoints() : nullptr;
+    log.output() << "Initializing simulator from the target";
+    log.endl();
+    auto sim = std::make_unique<mb5016_sim>();
+    auto status = mb50.cmd_status(true);
+    sim->halted = status.halted;
+    sim->breakpoint = status.breakpoint;
+    std::ranges::copy(mb50.cmd_memory(0, mb5016_sim::mem_max + 1), sim->mem.begin());
+    auto init = target_state(mb50);
+    std::ranges::copy(std::span(init).first(sim->r.size()), sim->r.begin());
+    std::ranges::copy(std::span(init).last(sim->csr.size()), sim->csr.begin());
+    log.output() << "Executing program in lockstep with simulator, press Enter to break";
+    log.endl();
+    std::deque<mb5016_sim::status_t> expected{};
+    size_t sent = 0;
+    size_t done = 0;
+    bool finish = false;
+    bool check_pending = false;
+    bool diverged = false;
+    for (;;) {
+        while (!finish && !check_pending && expected.size() < pipeline_depth) {
+            mb50.cmd_step_req();
+            auto predicted = sim->step();
+            expected.push_back(predicted);
+            ++sent;
+            if (predicted.halted || predicted.breakpoint || (bp && bp->contains(predicted.pc)) || sent == steps)
+                finish = true;
+            else if (check != 0 && sent % check == 0)
+                check_pending = true;
+        }
+        if (expected.empty()) {
+            if (!check_pending)
+                break;
+            check_pending = false;
+            if (target_state(mb50) != sim_state(*sim)) {
+                diverged = true;
+                break;
             }
+            continue;
+        }
+        status = mb50.cmd_step_resp();
+        auto predicted = expected.front();
+        expected.pop_front();
+        ++done;
+        if (status.pc != predicted.pc || status.halted != predicted.halted ||
+            status.breakpoint != predicted.breakpoint)
+        {
+            log.output() << std::format("Difference after step {}: target r15(pc)={:#06x} halted={} breakpoint={}, "
+                                        "simulator r15(pc)={:#06x} halted={} breakpoint={}", done,
+                                        status.pc, status.halted, status.breakpoint,
+                                        predicted.pc, predicted.halted, predicted.breakpoint);
+            log.endl();
+            diverged = true;
+            finish = true;
+            check_pending = false;
+        }
+        if (!finish && user_break())
+            finish = true;
+    }
+    auto target = target_state(mb50);
+    auto simulated = sim_state(*sim);
+    if (diverged || target != simulated) {
+        log.output() << std::format("Target and simulator differ after step {}", sent);
+        log.endl();
+        display(log, target, simulated);
+    } else {
+        log.output() << std::format("Target and simulator match after step {}", sent);
+        log.endl();
+        if (bp && bp->contains(status.pc)) {
+            log.output() << std::format("Breakpoint at {:#06x}", status.pc);
+            log.endl();
         }
     }
+    log.output() << status.msg;
+    log.endl();
+    symbols->show_location(log, status.pc);
     return true;
 }
 
+cmd_cosim::state_t cmd_cosim::target_state(cdi& mb50)
+{
+    state_t result{};
+    for (uint8_t i = 0; i < 16; ++i)
+        result[i] = mb50.cmd_register(i, false);
+    for (uint8_t i = 0; i < mb5016_sim::csr_num; ++i)
+        result[16 + i] = mb50.cmd_register(i, true);
+    return result;
+}
+
+cmd_cosim::state_t cmd_cosim::sim_state(const mb5016_sim& sim)
+{
+    state_t result{};
+    std::ranges::copy(sim.r, result.begin());
+    std::ranges::copy(sim.csr, result.begin() + ptrdiff_t(sim.r.size()));
+    return result;
+}
+
+void cmd_cosim::display(script_history& log, const state_t& target, const state_t& sim)
+{
+    log.output() << "REG     TARGET  SIMULATOR";
+    log.endl();
+    for (size_t i = 0; i < target.size(); ++i) {
+        auto name = i < 16 ? std::format("r{}", i) : std::format("csr{}", i - 16);
+        log.output() << std::format("{:6}  {:#06x}  {:#06x}{}", name, target[i], sim[i],
+                                    target[i] != sim[i] ? "  *" : "");
+        log.endl();
+    }
+}
+
 // Command csr
 class cmd_csr: public command {
 public:
@@ -590,7 +891,8 @@ bool cmd_do::operator()(cdi& mb50, script_history& log, std::string_view, std::s
 // Command dump
 class cmd_dump: public command {
 public:
-    explicit cmd_dump(std::shared_ptr<cmd_dump> other = nullptr): other{std::move(other)} {}
+    explicit cmd_dump(std::shared_ptr<debug_symbols> symbols, std::shared_ptr<cmd_dump> other = nullptr):
+        symbols{std::move(symbols)}, other{std::move(other)} {}
     std::vector<std::string_view> aliases() override { return {"d"}; }
     std::string_view help() override {
         static std::string text =
@@ -610,6 +912,7 @@ it uses ADDR and SIZE from the previous dump[w][d] command.
     }
     virtual size_t line_bytes() { return 16; }
     virtual std::string display(std::span<const uint8_t> data);
+    std::shared_ptr<debug_symbols> symbols;
     std::shared_ptr<cmd_dump> other;
 private:
     std::optional<std::pair<uint16_t, uint16_t>> parse_args(script_history& log, std::string_view args);
@@ -657,7 +960,7 @@ std::optional<std::pair<uint16_t, uint16_t>> cmd_dump::parse_args(script_history
     uint16_t size = other ? other->last_size : last_size;
     if (args.empty())
         return std::pair{addr, size};
-    auto v = parser::number_unsigned(args, false);
+    auto v = symbols->address(args, false);
     if (!v.first) {
         log.output() << "Invalid address: " << v.first.error();
         log.endl();
@@ -684,6 +987,28 @@ std::optional<std::pair<uint16_t, uint16_t>> cmd_dump::parse_args(script_history
     return std::pair{addr, size};
 }
 
+// Command disassemble
+class cmd_disassemble: public cmd_dump {
+    using cmd_dump::cmd_dump;
+public:
+    std::vector<std::string_view> aliases() override { return {"dis"}; }
+    std::string_view help() override {
+        return R"(Display SIZE bytes of memory rounded up to whole instructions, or a single
+instruction if SIZE is not specified, as instructions in the assembler syntax,
+starting at address ADDR. If an address is not specified, it uses ADDR and
+SIZE from the previous dump[w][d] or disassemble command. Bytes that are not
+a valid instruction are displayed as $data_b.)";
+    }
+protected:
+    size_t line_bytes() override { return 2; }
+    std::string display(std::span<const uint8_t> data) override;
+};
+
+std::string cmd_disassemble::display(std::span<const uint8_t> data)
+{
+    return std::format(" {:02x} {:02x}  {}", data[0], data[1], isa::disassemble(data[0], data[1]));
+}
+
 // Command dumpd
 class cmd_dumpd: public cmd_dump {
     using cmd_dump::cmd_dump;
@@ -764,7 +1089,8 @@ std::string cmd_dumpwd::display(std::span<const uint8_t> data)
 // Command execute
 class cmd_execute: public command {
 public:
-    explicit cmd_execute(std::shared_ptr<cmd_break> breakpoints = nullptr): breakpoints{std::move(breakpoints)} {}
+    explicit cmd_execute(std::shared_ptr<debug_symbols> symbols, std::shared_ptr<cmd_break> breakpoints = nullptr):
+        symbols{std::move(symbols)}, breakpoints{std::move(breakpoints)} {}
     std::vector<std::string_view> aliases() override { return {"exe", "x"}; }
     std::string_view help() override {
         return R"(Run the program. Program execution is interrupted by entering a newline.
@@ -772,6 +1098,7 @@ Any characters on the line before the newline are ignored.)";
     }
     bool operator()(cdi& mb50, script_history& log, std::string_view cmd, std::string_view args) override;
 private:
+    std::shared_ptr<debug_symbols> symbols;
     std::shared_ptr<cmd_break> breakpoints;
 };
 
@@ -780,27 +1107,18 @@ bool cmd_execute::operator()(cdi& mb50, script_history& log, std::string_view, s
     auto bp = breakpoints ? &breakpoints->breakpoints() : nullptr;
     if (bp && bp->empty())
         bp = nullptr;
+    cdi::status_t status{};
     if (!bp)
-        mb50.cmd_execute();
+        status = mb50.cmd_execute();
     else {
         log.output() << "Breakpoints set, expect very slow performance.";
         log.endl();
         log.output() << "Executing program, press Enter to break";
         log.endl();
-        cdi::status_t status{};
         for (;;) {
             status = mb50.cmd_step(true);
-            fd_set fds;
-            FD_ZERO(&fds);
-            FD_SET(STDIN_FILENO, &fds);
-            timeval tv{};
-            if (select(STDIN_FILENO + 1, &fds, nullptr, nullptr, &tv) < 0)
-                throw fatal_error("Failed call to select(2): "s.append(errno_message()));
-            if (FD_ISSET(STDIN_FILENO, &fds)) {
-                std::string line;
-                std::getline(std::cin, line);
+            if (user_break())
                 break;
-            }
             if (status.halted || status.breakpoint)
                 break;
             if (bp->contains(status.pc)) {
@@ -812,6 +1130,7 @@ bool cmd_execute::operator()(cdi& mb50, script_history& log, std::string_view, s
         log.output() << status.msg;
         log.endl();
     }
+    symbols->show_location(log, status.pc);
     return true;
 }
 
@@ -863,14 +1182,19 @@ bool cmd_history::operator()(cdi&, script_history& log, std::string_view, std::s
 // Command load
 class cmd_load: public command {
 public:
+    explicit cmd_load(std::shared_ptr<debug_symbols> symbols): symbols{std::move(symbols)} {}
     std::string_view help() override {
         return R"(Load content of a binary FILE from address ADDR. If ADDR is not specified,
 use the starting address from FILE. It expects the binary format produced
 by the assembler or by command save, that is, there is a single line
-containing start address in hexadecimal before binary data.)";
+containing start address in hexadecimal before binary data. If there is
+a debug information file with extension .dbg for FILE, it is loaded as by
+command symbols.)";
     }
     std::string_view help_args() override { return "FILE [ADDR]"; }
     bool operator()(cdi& mb50, script_history& log, std::string_view cmd, std::string_view args) override;
+private:
+    std::shared_ptr<debug_symbols> symbols;
 };
 
 bool cmd_load::operator()(cdi& mb50, script_history& log, std::string_view, std::string_view args)
@@ -886,7 +1210,7 @@ bool cmd_load::operator()(cdi& mb50, script_history& log, std::string_view, std:
     std::optional<uint16_t> addr;
     if (file_e != npos)
         if (size_t value_b = args.find_first_not_of(whitespace_chars, file_e); value_b != npos) {
-            if (auto v = parser::number_unsigned(args.substr(value_b), true); v.first)
+            if (auto v = symbols->address(args.substr(value_b), true); v.first)
                 addr = v.first->val;
             else {
                 log.output() << "Invalid address: " << v.first.error();
@@ -934,12 +1258,22 @@ bool cmd_load::operator()(cdi& mb50, script_history& log, std::string_view, std:
     mb50.cmd_memory(addr.value(), data);
     log.output() << std::format("Loaded at address {:#06x}", addr.value());
     log.endl();
+    if (auto dbg = std::filesystem::path(file).replace_extension(".dbg"); std::filesystem::exists(dbg))
+        try {
+            symbols->load(dbg);
+            log.output() << "Loaded debug information from \"" << dbg.string() << "\"";
+            log.endl();
+        } catch (const fatal_error& e) {
+            log.output() << e.what();
+            log.endl();
+        }
     return true;
 }
 
 // Command memset
 class cmd_memset: public command {
 public:
+    explicit cmd_memset(std::shared_ptr<debug_symbols> symbols): symbols{std::move(symbols)} {}
     std::vector<std::string_view> aliases() override { return {"m"}; }
     std::string_view help() override {
         return R"(Store values in memory. Each value can be a number (little endian if more
@@ -954,12 +1288,14 @@ sequentially starting at address ADDR.)";
     }
     std::string_view help_args() override { return "ADDR VALUE [VALUE...]"; }
     bool operator()(cdi& mb50, script_history& log, std::string_view cmd, std::string_view args) override;
+private:
+    std::shared_ptr<debug_symbols> symbols;
 };
 
 bool cmd_memset::operator()(cdi& mb50, script_history& log, std::string_view, std::string_view args)
 {
     constexpr size_t npos = std::string_view::npos;
-    auto v = parser::number_unsigned(args, false);
+    auto v = symbols->address(args, false);
     if (!v.first) {
         log.output() << "Invalid address: " << v.first.error();
         log.endl();
@@ -1051,6 +1387,7 @@ const std::vector<cmd_csr::reg_name>& cmd_register::registers()
 // Command save
 class cmd_save: public command {
 public:
+    explicit cmd_save(std::shared_ptr<debug_symbols> symbols): symbols{std::move(symbols)} {}
     std::string_view help() override {
         return R"(Save binary content of memory starting at ADDR and SIZE bytes long.
 If an address and size is not specified, save the whole memory.
@@ -1059,6 +1396,8 @@ a single line containing start address in hexadecimal before binary data.)";
     }
     std::string_view help_args() override { return "FILE [ADDR SIZE]"; }
     bool operator()(cdi& mb50, script_history& log, std::string_view cmd, std::string_view args) override;
+private:
+    std::shared_ptr<debug_symbols> symbols;
 };
 
 bool cmd_save::operator()(cdi& mb50, script_history& log, std::string_view, std::string_view args)
@@ -1075,7 +1414,7 @@ bool cmd_save::operator()(cdi& mb50, script_history& log, std::string_view, std:
     uint16_t size = 0;
     if (file_e != npos)
         if (size_t addr_b = args.find_first_not_of(whitespace_chars, file_e); addr_b != npos) {
-            if (auto addr_v = parser::number_unsigned(args.substr(addr_b), false); !addr_v.first) {
+            if (auto addr_v = symbols->address(args.substr(addr_b), false); !addr_v.first) {
                 log.output() << "Invalid address: " << addr_v.first.error();
                 log.endl();
                 return true;
@@ -1130,43 +1469,94 @@ bool cmd_script::operator()(cdi&, script_history& log, std::string_view, std::st
     return true;
 }
 
+// Command symbols
+class cmd_symbols: public command {
+public:
+    explicit cmd_symbols(std::shared_ptr<debug_symbols> symbols): symbols{std::move(symbols)} {}
+    std::vector<std::string_view> aliases() override { return {"sym"}; }
+    std::string_view help() override {
+        return R"(Load debug information FILE produced by the assembler (with extension .dbg).
+Then names of labels and constants, for example, main or stdlib.putchar, may
+be used in place of ADDR arguments of commands, and the nearest preceding
+label and source lines are displayed with the CPU status. If called with -,
+unload debug information. If called without arguments, show the name of
+the loaded file.)";
+    }
+    std::string_view help_args() override { return "[FILE|-]"; }
+    bool operator()(cdi& mb50, script_history& log, std::string_view cmd, std::string_view args) override;
+private:
+    std::shared_ptr<debug_symbols> symbols;
+};
+
+bool cmd_symbols::operator()(cdi&, script_history& log, std::string_view, std::string_view args)
+{
+    if (args.empty()) {
+        if (symbols->file().empty())
+            log.output() << "No debug information loaded";
+        else
+            log.output() << "Debug information loaded from \"" << symbols->file().string() << "\"";
+        log.endl();
+    } else if (args == "-"sv) {
+        symbols->unload();
+        log.output() << "Debug information unloaded";
+        log.endl();
+    } else
+        try {
+            symbols->load(args);
+            log.output() << "Loaded debug information from \"" << args << "\"";
+            log.endl();
+        } catch (const fatal_error& e) {
+            log.output() << e.what();
+            log.endl();
+        }
+    return true;
+}
+
 // Command step
 class cmd_step: public command {
 public:
+    explicit cmd_step(std::shared_ptr<debug_symbols> symbols): symbols{std::move(symbols)} {}
     std::vector<std::string_view> aliases() override { return {"s"}; }
     std::string_view help() override { return R"(Execute a single instruction.)"; }
     bool operator()(cdi& mb50, script_history& log, std::string_view cmd, std::string_view args) override;
+private:
+    std::shared_ptr<debug_symbols> symbols;
 };
 
-bool cmd_step::operator()(cdi& mb50, script_history&, std::string_view, std::string_view)
+bool cmd_step::operator()(cdi& mb50, script_history& log, std::string_view, std::string_view)
 {
-    mb50.cmd_step();
+    auto status = mb50.cmd_step();
+    symbols->show_location(log, status.pc);
     return true;
 }
 
 // Implementation of command_table
 
 command_table::command_table():
-    _cmd_break{std::make_shared<cmd_break>()},
-    _cmd_dump{std::make_shared<cmd_dump>()},
+    _symbols{std::make_shared<debug_symbols>()},
+    _cmd_break{std::make_shared<cmd_break>(_symbols)},
+    _cmd_dump{std::make_shared<cmd_dump>(_symbols)},
     commands{
         {"break", {_cmd_break}},
+        {"cosim", {std::make_shared<cmd_cosim>(_symbols, _cmd_break)}},
         {"csr", {std::make_shared<cmd_csr>()}},
+        {"disassemble", {std::make_shared<cmd_disassemble>(_symbols, _cmd_dump)}},
         {"do", {std::make_shared<cmd_do>()}},
         {"dump", {_cmd_dump}},
-        {"dumpd", {std::make_shared<cmd_dumpd>(_cmd_dump)}},
-        {"dumpw", {std::make_shared<cmd_dumpw>(_cmd_dump)}},
-        {"dumpwd", {std::make_shared<cmd_dumpwd>(_cmd_dump)}},
-        {"execute", {std::make_shared<cmd_execute>(_cmd_break)}},
+        {"dumpd", {std::make_shared<cmd_dumpd>(_symbols, _cmd_dump)}},
+        {"dumpw", {std::make_shared<cmd_dumpw>(_symbols, _cmd_dump)}},
+        {"dumpwd", {std::make_shared<cmd_dumpwd>(_symbols, _cmd_dump)}},
+        {"execute", {std::make_shared<cmd_execute>(_symbols, _cmd_break)}},
         {"help", {std::make_shared<cmd_help>()}},
         {"history", {std::make_shared<cmd_history>()}},
-        {"load", {std::make_shared<cmd_load>()}},
-        {"memset", {std::make_shared<cmd_memset>()}},
+        {"load", {std::make_shared<cmd_load>(_symbols)}},
+        {"memset", {std::make_shared<cmd_memset>(_symbols)}},
         {"quit", {std::make_shared<cmd_quit>()}},
         {"register", {std::make_shared<cmd_register>()}},
-        {"save", {std::make_shared<cmd_save>()}},
+        {"save", {std::make_shared<cmd_save>(_symbols)}},
         {"script", {std::make_shared<cmd_script>()}},
-        {"step", {std::make_shared<cmd_step>()}},
+        {"step", {std::make_shared<cmd_step>(_symbols)}},
+        {"symbols", {std::make_shared<cmd_symbols>(_symbols)}},
         {"watch", {std::make_shared<command>()}},
     }
 {
@@ -0,0 +1,681 @@
+// MB50DEV fuzzer of the CPU simulator
+
+#include "mb50common.hpp"
+#include "mb50sim.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+/*** Reference model of CPU MB5016 *******************************************/
+
+// An independent implementation of the ISA, written according to the
+// instruction reference in README.md instead of the VHDL sources. It is used
+// to check mb5016_sim. Values that the ISA leaves unspecified are reported
+// after each step and excluded from comparison.
+class reference {
+public:
+    // Set the CPU to the state given by registers and CSRs, memory is not changed
+    void set_state(const std::array<uint16_t, 16>& regs, const std::array<uint16_t, mb5016_sim::csr_num>& csrs);
+    void step();
+    std::array<uint16_t, 16> r{};
+    std::array<uint16_t, mb5016_sim::csr_num> csr{};
+    std::array<uint8_t, 0x10000> mem{};
+    bool halted = false;
+    bool breakpoint = false;
+    // Addresses written by the last step
+    std::vector<uint16_t> writes{};
+    // Bits of register f with unspecified values after the last step
+    uint16_t unspec_f = 0;
+    // Registers with unspecified values after the last step (bit i for register ri)
+    uint16_t unspec_r = 0;
+private:
+    // Groups of instructions with the same semantics
+    enum class kind: uint8_t {
+        illegal, ill, brk, reti, csrr, csrw, mv, exch, ld, ldb, ldis, ldnfis, sto, stob, ddsto,
+        add, sub, dec1, dec2, inc1, inc2, and_, or_, xor_, not_, rev, shl, shr, shra, cmps, cmpu,
+        mulss, mulsu, mulus, muluu,
+    };
+    static constexpr std::array<kind, 256> decode_table();
+    [[nodiscard]] uint8_t read(uint16_t addr) const;
+    [[nodiscard]] uint16_t read_word(uint16_t addr) const;
+    void write(uint16_t addr, uint8_t v);
+    void flags(uint16_t res, bool c, bool o);
+    void multiply(uint8_t d, uint8_t s, int64_t v, bool is_signed);
+    void exception(uint8_t reason);
+};
+
+constexpr std::array<reference::kind, 256> reference::decode_table()
+{
+    std::array<kind, 256> t{};
+    t.fill(kind::illegal);
+    t[0x00] = kind::ill;
+    t[0x01] = kind::add;
+    t[0x02] = kind::and_;
+    t[0x03] = kind::csrr;
+    t[0x04] = kind::csrw;
+    t[0x05] = kind::dec1;
+    t[0x06] = kind::dec2;
+    t[0x07] = kind::exch;
+    t[0x08] = kind::inc1;
+    t[0x09] = kind::inc2;
+    t[0x0a] = kind::ld;
+    t[0x0b] = kind::ldb;
+    t[0x0c] = kind::ldis;
+    t[0x0e] = kind::mv;
+    t[0x10] = kind::not_;
+    t[0x11] = kind::or_;
+    t[0x12] = kind::shl;
+    t[0x13] = kind::shr;
+    t[0x14] = kind::shra;
+    t[0x15] = kind::sto;
+    t[0x16] = kind::stob;
+    t[0x17] = kind::ddsto;
+    t[0x18] = kind::sub;
+    t[0x19] = kind::cmpu;
+    t[0x1a] = kind::xor_;
+    t[0x1b] = kind::cmps;
+    t[0x1c] = kind::reti;
+    t[0x1d] = kind::rev;
+    t[0x1e] = kind::mulss;
+    t[0x1f] = kind::mulsu;
+    t[0x20] = kind::mulus;
+    t[0x21] = kind::muluu;
+    t[0x22] = kind::brk;
+    for (unsigned cond = 0; cond < 16; ++cond) {
+        t[0x90 + cond] = kind::ld;
+        t[0xa0 + cond] = kind::ldnfis;
+        t[0xc0 + cond] = kind::mv;
+    }
+    return t;
+}
+
+void reference::set_state(const std::array<uint16_t, 16>& regs,
+                          const std::array<uint16_t, mb5016_sim::csr_num>& csrs)
+{
+    r = regs;
+    csr = csrs;
+    halted = false;
+    breakpoint = false;
+}
+
+void reference::step()
+{
+    constexpr uint8_t ia = 13;
+    constexpr uint8_t f = 14;
+    constexpr uint8_t pc = 15;
+    constexpr uint16_t ie = 0x0100;
+    constexpr uint16_t exc = 0x0200;
+    constexpr uint16_t iexc = 0x0400;
+    static constexpr std::array<kind, 256> decode = decode_table();
+    writes.clear();
+    unspec_f = 0;
+    unspec_r = 0;
+    if ((r[f] & ie) != 0) {
+        if ((r[f] & 0xfe00U) != 0) {
+            r[f] = uint16_t(r[f] & ~ie);
+            if ((r[f] & exc) != 0)
+                r[f] = uint16_t((r[f] & ~exc) | iexc);
+            std::swap(r[pc], r[ia]);
+        }
+    } else if ((r[f] & exc) != 0) {
+        halted = true;
+        return;
+    }
+    halted = false;
+    uint8_t op = read(r[pc]);
+    uint8_t regs = read(uint16_t(r[pc] + 1));
+    r[pc] = uint16_t(r[pc] + 2);
+    uint8_t d = regs / 16;
+    uint8_t s = regs % 16;
+    bool cond = (op & 0x80U) == 0 || ((r[f] & (1U << (op & 0x07U))) != 0) == ((op & 0x08U) != 0);
+    breakpoint = false;
+    uint16_t a = r[d];
+    uint16_t b = r[s];
+    unsigned n = b % 16;
+    switch (decode[op]) {
+    case kind::illegal:
+        exception(2);
+        break;
+    case kind::ill:
+        exception(1);
+        break;
+    case kind::brk:
+        breakpoint = true;
+        break;
+    case kind::reti:
+        r[f] |= ie;
+        r[pc] = r[ia];
+        r[ia] = csr[1];
+        csr[0] = 0;
+        break;
+    case kind::csrr:
+        r[d] = s < csr.size() ? csr[s] : 0;
+        break;
+    case kind::csrw:
+        // The hardware also clears bit H of csr0, although it is documented as not writable
+        if (d == 0)
+            csr[0] = b % 256;
+        else if (d < csr.size())
+            csr[d] = b;
+        break;
+    case kind::mv:
+        if (cond)
+            r[d] = b;
+        break;
+    case kind::exch:
+        r[d] = b;
+        r[s] = a;
+        break;
+    case kind::ld:
+        if (cond)
+            r[d] = read_word(b);
+        break;
+    case kind::ldb:
+        r[d] = uint16_t((a & 0xff00U) | read(b));
+        break;
+    case kind::ldis:
+        r[d] = read_word(b);
+        r[s] = uint16_t(r[s] + 2);
+        break;
+    case kind::ldnfis:
+        if (cond)
+            r[d] = read_word(b);
+        else
+            r[s] = uint16_t(b + 2);
+        break;
+    case kind::sto:
+        write(a, uint8_t(b % 256));
+        write(uint16_t(a + 1), uint8_t(b / 256));
+        break;
+    case kind::stob:
+        write(a, uint8_t(b % 256));
+        break;
+    case kind::ddsto:
+        r[d] = uint16_t(a - 2);
+        write(r[d], uint8_t(r[s] % 256));
+        write(uint16_t(r[d] + 1), uint8_t(r[s] / 256));
+        break;
+    case kind::add:
+        flags(uint16_t(a + b), a + b > 0xffff, int16_t(a) + int16_t(b) != int16_t(a + b));
+        r[d] = uint16_t(a + b);
+        break;
+    case kind::sub:
+        flags(uint16_t(a - b), a < b, int16_t(a) - int16_t(b) != int16_t(a - b));
+        r[d] = uint16_t(a - b);
+        break;
+    case kind::dec1:
+        flags(uint16_t(b - 1), b < 1, int16_t(b) - 1 < INT16_MIN);
+        r[d] = uint16_t(b - 1);
+        break;
+    case kind::dec2:
+        flags(uint16_t(b - 2), b < 2, int16_t(b) - 2 < INT16_MIN);
+        r[d] = uint16_t(b - 2);
+        break;
+    case kind::inc1:
+        flags(uint16_t(b + 1), b + 1 > 0xffff, int16_t(b) + 1 > INT16_MAX);
+        r[d] = uint16_t(b + 1);
+        break;
+    case kind::inc2:
+        flags(uint16_t(b + 2), b + 2 > 0xffff, int16_t(b) + 2 > INT16_MAX);
+        r[d] = uint16_t(b + 2);
+        break;
+    case kind::and_:
+        flags(uint16_t(a & b), false, false);
+        r[d] = uint16_t(a & b);
+        break;
+    case kind::or_:
+        flags(uint16_t(a | b), false, false);
+        r[d] = uint16_t(a | b);
+        break;
+    case kind::xor_:
+        flags(uint16_t(a ^ b), false, false);
+        r[d] = uint16_t(a ^ b);
+        break;
+    case kind::not_:
+        flags(uint16_t(~b), false, false);
+        r[d] = uint16_t(~b);
+        break;
+    case kind::rev:
+        {
+            uint16_t v = 0;
+            for (unsigned i = 0; i < 16; ++i)
+                v = uint16_t(v << 1U | ((b >> i) & 1U));
+            flags(v, false, false);
+            r[d] = v;
+        }
+        break;
+    case kind::shl:
+        {
+            auto v = uint16_t(a << n);
+            flags(v, a >= 0x8000, (v >= 0x8000) != (a >= 0x8000));
+            if (n != 1)
+                unspec_f |= mb5016_sim::flag_c;
+            r[d] = v;
+        }
+        break;
+    case kind::shr:
+        {
+            auto v = uint16_t(a >> n);
+            flags(v, a % 2 != 0, (v >= 0x8000) != (a >= 0x8000));
+            if (n != 1)
+                unspec_f |= mb5016_sim::flag_c;
+            r[d] = v;
+        }
+        break;
+    case kind::shra:
+        {
+            auto v = uint16_t(int16_t(a) >> n);
+            flags(v, a % 2 != 0, n == 1 && a == 0xffff);
+            if (n != 1)
+                unspec_f |= mb5016_sim::flag_c;
+            if (n > 1)
+                unspec_f |= mb5016_sim::flag_o;
+            r[d] = v;
+        }
+        break;
+    case kind::cmps:
+    case kind::cmpu:
+        {
+            bool lt = decode[op] == kind::cmps ? int16_t(a) < int16_t(b) : a < b;
+            r[f] = uint16_t((r[f] & 0xff0fU) | (a == b ? mb5016_sim::flag_z : 0) |
+                            (lt || a == b ? mb5016_sim::flag_c : 0) | (lt ? mb5016_sim::flag_s : 0));
+        }
+        break;
+    case kind::mulss:
+        multiply(d, s, int64_t(int16_t(a)) * int16_t(b), true);
+        break;
+    case kind::mulsu:
+        multiply(d, s, int64_t(int16_t(a)) * b, true);
+        break;
+    case kind::mulus:
+        multiply(d, s, int64_t(a) * int16_t(b), true);
+        break;
+    case kind::muluu:
+        multiply(d, s, int64_t(a) * b, false);
+        break;
+    default:
+        break;
+    }
+}
+
+uint8_t reference::read(uint16_t addr) const
+{
+    return addr > mb5016_sim::mem_max ? 0 : mem[addr];
+}
+
+uint16_t reference::read_word(uint16_t addr) const
+{
+    return uint16_t(read(addr) + 256 * read(uint16_t(addr + 1)));
+}
+
+void reference::write(uint16_t addr, uint8_t v)
+{
+    if (addr <= mb5016_sim::mem_max) {
+        mem[addr] = v;
+        writes.push_back(addr);
+    }
+}
+
+void reference::flags(uint16_t res, bool c, bool o)
+{
+    r[14] = uint16_t((r[14] & 0xff0fU) | (res == 0 ? mb5016_sim::flag_z : 0) | (c ? mb5016_sim::flag_c : 0) |
+                     (res >= 0x8000 ? mb5016_sim::flag_s : 0) | (o ? mb5016_sim::flag_o : 0));
+}
+
+void reference::multiply(uint8_t d, uint8_t s, int64_t v, bool is_signed)
+{
+    auto lo = uint16_t(v & 0xffff);
+    auto hi = uint16_t((v >> 16) & 0xffff);
+    bool c = is_signed ? hi != (v < 0 ? 0xffff : 0) : hi != 0;
+    bool o = is_signed ? v < INT16_MIN || v > INT16_MAX : v > INT16_MAX;
+    r[14] = uint16_t((r[14] & 0xff0fU) | (v == 0 ? mb5016_sim::flag_z : 0) | (c ? mb5016_sim::flag_c : 0) |
+                     (v < 0 ? mb5016_sim::flag_s : 0) | (o ? mb5016_sim::flag_o : 0));
+    r[s] = hi;
+    r[d] = lo;
+    if (d == s)
+        unspec_r |= uint16_t(1U << d);
+}
+
+void reference::exception(uint8_t reason)
+{
+    csr[0] = uint16_t(mb5016_sim::csr0_h | reason);
+    r[14] |= 0x0200;
+}
+
+/*** Fuzzer ******************************************************************/
+
+// Generates random register states and instruction sequences, executes them
+// by mb5016_sim and by the reference model, and compares states after each
+// instruction. Test cases that reach new combinations of an opcode, its
+// operand values, and resulting flags are kept in an in-memory corpus and
+// mutated to create further test cases.
+class fuzzer {
+public:
+    explicit fuzzer(uint64_t seed);
+    // Returns false if a difference has been found
+    bool run(uint64_t cases);
+private:
+    static constexpr size_t instr_num = 8;
+    struct test_case {
+        std::array<uint16_t, 16> r;
+        std::array<uint16_t, mb5016_sim::csr_num> csr;
+        std::array<uint8_t, 2 * instr_num> code;
+    };
+    static constexpr std::array<uint16_t, 14> interesting{
+        0x0000, 0x0001, 0x0002, 0x000f, 0x0010, 0x00ff, 0x0100, 0x7ffe, 0x7fff, 0x8000, 0x8001, 0xff00, 0xfffe, 0xffff,
+    };
+    uint16_t random_word();
+    uint16_t random_flags();
+    uint8_t random_opcode();
+    test_case generate();
+    void mutate(test_case& tc);
+    bool execute(const test_case& tc);
+    void restore();
+    void report(const test_case& tc, size_t step);
+    static size_t operand_class(uint16_t v);
+    std::mt19937_64 rnd;
+    std::unique_ptr<mb5016_sim> sim = std::make_unique<mb5016_sim>();
+    std::unique_ptr<reference> ref = std::make_unique<reference>();
+    // Initial memory content, restored after each test case
+    std::unique_ptr<std::array<uint8_t, 0x10000>> base = std::make_unique<std::array<uint8_t, 0x10000>>();
+    std::vector<uint16_t> sim_writes{};
+    std::vector<uint16_t> ref_writes{};
+    std::vector<test_case> corpus{};
+    std::vector<uint64_t> coverage = std::vector<uint64_t>(size_t(1) << 13U);
+    size_t features = 0;
+    bool new_coverage = false;
+};
+
+fuzzer::fuzzer(uint64_t seed):
+    rnd(seed)
+{
+    for (auto& b: *base)
+        b = uint8_t(rnd());
+    std::fill(base->begin() + mb5016_sim::mem_max + 1, base->end(), 0);
+    sim->mem = *base;
+    ref->mem = *base;
+    sim->write_log = &sim_writes;
+}
+
+bool fuzzer::run(uint64_t cases)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < cases; ++i) {
+        test_case tc = corpus.empty() || rnd() % 8 == 0 ? generate() : corpus[rnd() % corpus.size()];
+        if (!corpus.empty())
+            for (auto m = rnd() % 4; m-- > 0;)
+                mutate(tc);
+        new_coverage = false;
+        if (!execute(tc))
+            return false;
+        if (new_coverage)
+            corpus.push_back(tc);
+        if ((i + 1) % (uint64_t(1) << 20U) == 0 || i + 1 == cases) {
+            std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+            std::cout << std::format("cases={} corpus={} features={} time={:.1f}s rate={:.0f}/s",
+                                     i + 1, corpus.size(), features, t.count(), double(i + 1) / t.count()) <<
+                std::endl;
+        }
+    }
+    return true;
+}
+
+uint16_t fuzzer::random_word()
+{
+    switch (rnd() % 4) {
+    case 0:
+        return interesting.at(rnd() % interesting.size());
+    case 1:
+        return uint16_t(rnd() % (mb5016_sim::mem_max + 1U));
+    default:
+        return uint16_t(rnd());
+    }
+}
+
+uint16_t fuzzer::random_flags()
+{
+    // Mostly without interrupts and exceptions, in order to execute the generated code
+    auto f = uint16_t(rnd() % 256);
+    if (rnd() % 8 == 0)
+        f = uint16_t(f | (rnd() & 0xff00U));
+    return f;
+}
+
+uint8_t fuzzer::random_opcode()
+{
+    if (rnd() % 8 == 0)
+        return uint8_t(rnd());
+    static constexpr std::array<uint8_t, 32> unconditional{
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0e, 0x10, 0x11,
+        0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21,
+    };
+    static constexpr std::array<uint8_t, 3> conditional{0x90, 0xa0, 0xc0};
+    if (rnd() % 4 == 0)
+        return uint8_t(conditional.at(rnd() % conditional.size()) | (rnd() % 16));
+    return unconditional.at(rnd() % unconditional.size());
+}
+
+fuzzer::test_case fuzzer::generate()
+{
+    test_case tc{};
+    for (auto& v: tc.r)
+        v = random_word();
+    tc.r[14] = random_flags();
+    for (auto& v: tc.csr)
+        v = random_word();
+    tc.csr[0] &= 0x01ffU;
+    for (size_t i = 0; i < instr_num; ++i) {
+        tc.code.at(2 * i) = random_opcode();
+        tc.code.at(2 * i + 1) = uint8_t(rnd());
+    }
+    return tc;
+}
+
+void fuzzer::mutate(test_case& tc)
+{
+    size_t i = rnd() % instr_num;
+    switch (rnd() % 6) {
+    case 0:
+        tc.r.at(rnd() % tc.r.size()) = random_word();
+        break;
+    case 1:
+        tc.r.at(rnd() % tc.r.size()) ^= uint16_t(1U << (rnd() % 16));
+        break;
+    case 2:
+        tc.r[14] = random_flags();
+        break;
+    case 3:
+        tc.code.at(2 * i) = random_opcode();
+        break;
+    case 4:
+        tc.code.at(2 * i + 1) = uint8_t(rnd());
+        break;
+    default:
+        std::swap(tc.code.at(2 * i), tc.code.at(2 * (rnd() % instr_num)));
+        break;
+    }
+}
+
+bool fuzzer::execute(const test_case& tc)
+{
+    sim->r = tc.r;
+    sim->csr = tc.csr;
+    sim->halted = false;
+    sim->breakpoint = false;
+    ref->set_state(tc.r, tc.csr);
+    for (size_t i = 0; i < tc.code.size(); ++i) {
+        sim->mem_write(uint16_t(tc.r[15] + i), tc.code[i]);
+        ref->mem[uint16_t(tc.r[15] + i)] = sim->mem[uint16_t(tc.r[15] + i)];
+        ref_writes.push_back(uint16_t(tc.r[15] + i));
+    }
+    for (size_t step = 0; step < instr_num; ++step) {
+        // Coverage feature: opcode, operand classes, dst == src, and resulting flags
+        uint16_t pc = sim->r[15];
+        if ((sim->r[14] & mb5016_sim::flag_ie) != 0 && (sim->r[14] & mb5016_sim::flags_irq) != 0)
+            pc = sim->r[13];
+        uint8_t opcode = sim->mem_read(pc);
+        uint8_t regs = sim->mem_read(uint16_t(pc + 1));
+        size_t feature = opcode | operand_class(sim->r[regs / 16]) << 8U | operand_class(sim->r[regs % 16]) << 11U |
+            size_t(regs / 16 == regs % 16) << 14U;
+        size_t sim_writes_b = sim_writes.size();
+        sim->step();
+        ref->step();
+        ref_writes.insert(ref_writes.end(), ref->writes.begin(), ref->writes.end());
+        feature |= size_t(sim->r[14] & mb5016_sim::flags_alu) << 11U; // bits 15...18
+        if (uint64_t bit = uint64_t(1) << (feature % 64); (coverage[feature / 64] & bit) == 0) {
+            coverage[feature / 64] |= bit;
+            ++features;
+            new_coverage = true;
+        }
+        // Synchronize unspecified values, so that they do not cause differences later
+        ref->r[14] = uint16_t((ref->r[14] & ~ref->unspec_f) | (sim->r[14] & ref->unspec_f));
+        for (size_t i = 0; i < ref->r.size(); ++i)
+            if ((ref->unspec_r & (1U << i)) != 0)
+                ref->r[i] = sim->r[i];
+        bool same = sim->r == ref->r && sim->csr == ref->csr && sim->halted == ref->halted &&
+            sim->breakpoint == ref->breakpoint;
+        for (size_t i = sim_writes_b; same && i < sim_writes.size(); ++i)
+            same = sim->mem[sim_writes[i]] == ref->mem[sim_writes[i]];
+        for (auto a: ref->writes)
+            same = same && sim->mem[a] == ref->mem[a];
+        if (!same) {
+            report(tc, step);
+            return false;
+        }
+        if (sim->halted)
+            break;
+    }
+    restore();
+    return true;
+}
+
+void fuzzer::restore()
+{
+    for (auto a: sim_writes) {
+        sim->mem[a] = (*base)[a];
+        ref->mem[a] = (*base)[a];
+    }
+    for (auto a: ref_writes) {
+        sim->mem[a] = (*base)[a];
+        ref->mem[a] = (*base)[a];
+    }
+    sim_writes.clear();
+    ref_writes.clear();
+}
+
+size_t fuzzer::operand_class(uint16_t v)
+{
+    switch (v) {
+    case 0x0000:
+        return 0;
+    case 0x0001:
+        return 1;
+    case 0x7fff:
+        return 2;
+    case 0x8000:
+        return 3;
+    case 0xfffe:
+        return 4;
+    case 0xffff:
+        return 5;
+    default:
+        return v < 0x8000 ? 6 : 7;
+    }
+}
+
+void fuzzer::report(const test_case& tc, size_t step)
+{
+    std::cout << std::format("Difference after step {}\nInitial state:\n", step);
+    for (size_t i = 0; i < tc.r.size(); ++i)
+        std::cout << std::format(" r{}={:#06x}", i, tc.r[i]);
+    for (size_t i = 0; i < tc.csr.size(); ++i)
+        std::cout << std::format(" csr{}={:#06x}", i, tc.csr[i]);
+    std::cout << "\nCode:";
+    for (size_t i = 0; i < instr_num; ++i)
+        std::cout << std::format(" {:02x}{:02x}", tc.code.at(2 * i), tc.code.at(2 * i + 1));
+    std::cout << "\nREG     SIMULATOR  REFERENCE\n";
+    for (size_t i = 0; i < sim->r.size(); ++i)
+        std::cout << std::format("{:6}  {:#06x}     {:#06x}{}\n", std::format("r{}", i), sim->r[i], ref->r[i],
+                                 sim->r[i] != ref->r[i] ? "  *" : "");
+    for (size_t i = 0; i < sim->csr.size(); ++i)
+        std::cout << std::format("{:6}  {:#06x}     {:#06x}{}\n", std::format("csr{}", i), sim->csr[i], ref->csr[i],
+                                 sim->csr[i] != ref->csr[i] ? "  *" : "");
+    std::cout << std::format("halted  {:6}     {:6}\nbreak   {:6}     {:6}", sim->halted, ref->halted,
+                             sim->breakpoint, ref->breakpoint) << std::endl;
+    for (auto a: ref->writes)
+        std::cout << std::format("mem[{:#06x}]  {:#04x}  {:#04x}", a, sim->mem[a], ref->mem[a]) << std::endl;
+}
+
+/*** Command line processing *************************************************/
+
+class cmdline_args: public cmdline_args_base {
+public:
+    cmdline_args(int argc, char* argv[]);
+    std::string usage();
+    [[nodiscard]] uint64_t seed() const { return _seed; }
+    [[nodiscard]] uint64_t cases() const { return _cases; }
+private:
+    uint64_t _seed = std::random_device{}();
+    uint64_t _cases = 10'000'000;
+};
+
+cmdline_args::cmdline_args(int argc, char* argv[]):
+    cmdline_args_base(argc, argv)
+{
+    try {
+        for (size_t i = 1; i < args.size(); i += 2) {
+            if (i + 1 >= args.size())
+                throw invalid_cmdline_args{};
+            char* end = nullptr;
+            uint64_t v = std::strtoull(args[i + 1], &end, 0);
+            if (*args[i + 1] == '\0' || *end != '\0')
+                throw invalid_cmdline_args{};
+            if (args[i] == "-s"sv)
+                _seed = v;
+            else if (args[i] == "-n"sv)
+                _cases = v;
+            else
+                throw invalid_cmdline_args{};
+        }
+    } catch (const invalid_cmdline_args&) {
+        std::cerr << usage() << '\n';
+        throw;
+    }
+}
+
+std::string cmdline_args::usage()
+{
+    return cmdline_args_base::usage().append(R"([-s seed] [-n cases]
+
+-s ... seed of the random generator, a random seed is used by default
+-n ... number of test cases (default 10000000)
+)"sv);
+}
+
+/*** Entry point *************************************************************/
+
+int main(int argc, char* argv[])
+{
+    try {
+        cmdline_args args{argc, argv};
+        std::cout << "seed=" << args.seed() << std::endl;
+        fuzzer fuzz(args.seed());
+        return fuzz.run(args.cases()) ? EXIT_SUCCESS : EXIT_FAILURE;
+    } catch (const fatal_error& e) {
+        std::cerr << e.what() << std::endl;
+    } catch (const silent_error&) {
+        ; // already reported
+    } catch (const std::exception& e) {
+        std::cerr << "Unhandled exception: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Unhandled unknown exception" << std::endl;
+    }
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,518 @@
+// MB50DEV linker of relocatable object files produced by mb50as
+
+#include "mb50common.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <ranges>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace sfs = std::filesystem;
+
+/*** Linking *****************************************************************/
+
+// Links modules to a program. Modules are placed in the same order as mb50as
+// places files included by $use: the first object is the top level module,
+// and each module is preceded by the modules it includes, unless they have
+// already been placed. Objects not included by the program are ignored,
+// therefore a set of library objects can be passed when linking any program.
+//
+// With garbage collection enabled, modules are split to blocks at labels and
+// only live blocks are linked. The first block of the program (at address 0)
+// and all blocks of the top level module are live. A block is live if it is
+// referenced by an expression stored in a live block, or if execution can
+// continue to it from the preceding live block. An expression referencing more
+// addresses in a module, for example, the size of an array computed as
+// a difference of labels, makes live all blocks between the addresses.
+class linker {
+public:
+    linker(std::span<const sfs::path> objects, bool verbose, bool gc);
+    // Places modules and stores values of fixups
+    void run();
+    // Writes output files named by the first object file
+    void write();
+private:
+    // A part of a module between two labels
+    struct block_t {
+        uint32_t begin;
+        uint32_t end;
+        bool entered; // execution may continue to the block from the preceding one
+        bool live = false;
+        uint32_t removed = 0; // bytes of the module removed before the block
+        std::vector<const object_file::fixup_t*> fixups{}; // stored in the block
+    };
+    struct module_t {
+        sfs::path obj_file;
+        std::unique_ptr<const object_file::reader> obj;
+        uint16_t base = 0;
+        bool placed = false;
+        size_t order = 0; // the index in placed
+        std::vector<block_t> blocks{};
+        bool falls_out = true; // execution may continue from the end of the module to the next one
+        uint32_t size = 0; // after removing blocks
+    };
+    // A symbol and the module defining it
+    struct symbol_t {
+        module_t* module;
+        const object_file::symbol_t* sym;
+    };
+    // Orders a module after the modules included by it
+    void place(module_t& m);
+    // Splits a module to blocks
+    void split(module_t& m);
+    // Marks live blocks of all modules
+    void collect();
+    // Marks live blocks referenced by an expression of a module
+    void collect(module_t& m, object_file::expr_t e, std::vector<std::pair<module_t*, size_t>>& work);
+    // The block containing an offset in a module
+    static size_t block(const module_t& m, uint32_t offset);
+    // The address of an offset in a module after linking, throws eval_error if the block has been removed
+    static uint16_t addr(const module_t& m, uint32_t offset);
+    // Evaluates an expression of a module, throws eval_error
+    uint16_t eval(const module_t& m, object_file::expr_t e);
+    uint16_t eval(symbol_t s);
+    // Finds a symbol referenced by a module, throws eval_error
+    symbol_t find(const module_t& m, const object_file::ref_t& ref) const;
+    // Writes data to a file, kind is used in error messages
+    void write_file(const sfs::path& out_file, std::string_view kind, std::string_view data) const;
+    bool verbose;
+    bool gc; // remove unused blocks
+    std::vector<module_t> modules; // all objects, the first one is the top level module
+    std::map<std::string_view, module_t*> sources; // modules by source file names
+    std::vector<module_t*> placed; // modules in the order of addresses
+    size_t next_addr = 0; // the address of the next placed module
+    std::map<std::pair<std::string_view, std::string_view>, symbol_t> symbols; // keyed by source file and name
+    std::map<std::string_view, std::vector<symbol_t>> global_symbols; // keyed by name
+    std::map<const object_file::symbol_t*, uint16_t> values; // evaluated symbols
+    std::set<const object_file::symbol_t*> evaluating; // for detecting cyclic definitions
+    std::array<uint8_t, 0x10000> image{}; // the full address space
+    size_t start_addr = 0x10000; // the first byte of code
+    size_t end_addr = 0x0000; // one after the last byte of code
+};
+
+linker::linker(std::span<const sfs::path> objects, bool verbose, bool gc):
+    verbose(verbose), gc(gc)
+{
+    for (auto&& f: objects) {
+        if (verbose)
+            std::cerr << "Reading object file \"" << f.string() << '"' << std::endl;
+        modules.push_back({.obj_file = f, .obj = std::make_unique<object_file::reader>(f)});
+    }
+    for (auto&& m: modules)
+        if (auto [it, added] = sources.try_emplace(m.obj->source(), &m); !added)
+            throw fatal_error(std::format("Object files \"{}\" and \"{}\" contain the same module \"{}\"",
+                                          it->second->obj_file.string(), m.obj_file.string(), m.obj->source()));
+}
+
+void linker::place(module_t& m)
+{
+    m.placed = true;
+    for (auto&& u: m.obj->uses())
+        if (auto it = sources.find(m.obj->str(u.file)); it == sources.end())
+            throw fatal_error(std::format("Module \"{}\" included by \"{}\" not found in object files",
+                                          m.obj->str(u.file), m.obj->source()));
+        else if (!it->second->placed)
+            place(*it->second);
+    m.order = placed.size();
+    placed.push_back(&m);
+}
+
+void linker::split(module_t& m)
+{
+    uint32_t begin = 0;
+    bool entered = m.order == 0 || placed[m.order - 1]->falls_out;
+    for (auto&& b: m.obj->blocks()) {
+        m.blocks.push_back({.begin = begin, .end = b.offset, .entered = entered});
+        begin = b.offset;
+        entered = b.falls != 0;
+    }
+    m.falls_out = entered; // the flag of the last boundary at the end of the module
+    for (auto&& f: m.obj->fixups())
+        m.blocks[block(m, f.offset)].fixups.push_back(&f);
+}
+
+void linker::collect()
+{
+    std::vector<std::pair<module_t*, size_t>> work;
+    auto live = [&work](module_t& m, size_t i) {
+        if (!m.blocks[i].live) {
+            m.blocks[i].live = true;
+            work.emplace_back(&m, i);
+        }
+    };
+    live(*placed.front(), 0);
+    for (size_t i = 0; i < modules.front().blocks.size(); ++i)
+        live(modules.front(), i);
+    while (!work.empty()) {
+        auto [m, i] = work.back();
+        work.pop_back();
+        if (i + 1 < m->blocks.size()) {
+            if (m->blocks[i + 1].entered)
+                live(*m, i + 1);
+        } else if (m->order + 1 < placed.size() && m->falls_out)
+            live(*placed[m->order + 1], 0);
+        for (auto&& f: m->blocks[i].fixups)
+            collect(*m, f->expr, work);
+    }
+}
+
+void linker::collect(module_t& m, object_file::expr_t e, std::vector<std::pair<module_t*, size_t>>& work)
+{
+    // Ranges of offsets referenced in modules, including references via symbols of other modules
+    std::map<module_t*, std::pair<uint32_t, uint32_t>> ranges;
+    std::set<const object_file::symbol_t*> visited;
+    auto refs = [&](auto&& self, module_t& m, object_file::expr_t e) -> void {
+        for (auto&& n: m.obj->nodes(e))
+            if (n.op == object_file::op_t::local) {
+                auto [it, added] = ranges.try_emplace(&m, n.value, n.value);
+                it->second = {std::min(it->second.first, uint32_t{n.value}),
+                              std::max(it->second.second, uint32_t{n.value})};
+            } else if (n.op == object_file::op_t::ref)
+                try {
+                    if (auto s = find(m, m.obj->refs()[n.ref]); visited.insert(s.sym).second)
+                        self(self, *s.module, s.sym->expr);
+                } catch (const eval_error&) {
+                    ; // reported when evaluating fixups
+                }
+    };
+    refs(refs, m, e);
+    for (auto&& [r, range]: ranges)
+        for (size_t i = block(*r, range.first); i <= block(*r, range.second); ++i)
+            if (!r->blocks[i].live) {
+                r->blocks[i].live = true;
+                work.emplace_back(r, i);
+            }
+}
+
+size_t linker::block(const module_t& m, uint32_t offset)
+{
+    auto it = std::ranges::upper_bound(m.blocks, offset, {}, &block_t::begin);
+    return it == m.blocks.begin() ? 0 : size_t(it - m.blocks.begin()) - 1;
+}
+
+uint16_t linker::addr(const module_t& m, uint32_t offset)
+{
+    auto& b = m.blocks[block(m, offset)];
+    if (!b.live)
+        throw eval_error("Address in removed code");
+    return uint16_t(m.base + offset - b.removed);
+}
+
+void linker::run()
+{
+    place(modules.front());
+    for (auto&& m: placed)
+        split(*m);
+    for (auto&& m: placed)
+        for (auto&& s: m->obj->symbols()) {
+            symbols.try_emplace({m->obj->source(), m->obj->str(s.name)}, symbol_t{m, &s});
+            global_symbols[m->obj->str(s.name)].push_back({m, &s});
+        }
+    if (gc)
+        collect();
+    for (auto&& m: placed) {
+        uint32_t removed = 0;
+        for (auto&& b: m->blocks) {
+            b.live = b.live || !gc;
+            b.removed = removed;
+            if (!b.live)
+                removed += b.end - b.begin;
+        }
+        m->size = m->obj->header().size - removed;
+        if (next_addr + m->size > image.size())
+            throw fatal_error(std::format("Module \"{}\" does not fit to address space", m->obj->source()));
+        m->base = uint16_t(next_addr);
+        next_addr += m->size;
+        if (verbose)
+            std::cerr << std::format("Module \"{}\" at {:#06x}", m->obj->source(), m->base) <<
+                (gc ? std::format(", removed {} bytes", removed) : ""s) << std::endl;
+    }
+    for (auto&& m: placed) {
+        auto code = m->obj->code();
+        uint32_t code_begin = m->obj->header().code_offset;
+        uint32_t code_end = code_begin + uint32_t(code.size());
+        for (auto&& b: m->blocks)
+            if (auto begin = std::max(b.begin, code_begin), end = std::min(b.end, code_end); b.live && begin < end) {
+                size_t addr = m->base + begin - b.removed;
+                std::ranges::copy(code.subspan(begin - code_begin, end - begin), image.begin() + ptrdiff_t(addr));
+                start_addr = std::min(start_addr, addr);
+                end_addr = std::max(end_addr, addr + (end - begin));
+            }
+    }
+    bool ok = true;
+    for (auto&& m: placed)
+        for (auto&& b: m->blocks | std::views::filter(&block_t::live))
+            for (auto&& f: b.fixups)
+                try {
+                    auto v = eval(*m, f->expr);
+                    size_t a = addr(*m, f->offset);
+                    image[a] = uint8_t(v % 256U);
+                    if (f->word)
+                        image[a + 1] = uint8_t(v / 256U);
+                } catch (const eval_error& e) {
+                    std::cerr << m->obj->file(f->file) << ':' << f->line << ": " <<
+                        "Cannot evaluate an expression in the second phase: " << e.what() << std::endl;
+                    ok = false;
+                }
+    if (!ok)
+        throw silent_error{};
+}
+
+uint16_t linker::eval(const module_t& m, object_file::expr_t e)
+{
+    using object_file::op_t;
+    std::vector<uint16_t> stack;
+    for (auto&& n: m.obj->nodes(e)) {
+        if (n.op > op_t::ref && stack.size() < (n.op >= op_t::bit_not ? 1U : 2U))
+            throw eval_error("Invalid expression");
+        uint16_t r = n.op > op_t::ref ? stack.back() : 0;
+        switch (n.op) {
+        case op_t::constant:
+            stack.push_back(n.value);
+            break;
+        case op_t::local:
+            stack.push_back(addr(m, n.value));
+            break;
+        case op_t::ref:
+            stack.push_back(eval(find(m, m.obj->refs()[n.ref])));
+            break;
+        case op_t::bit_or:
+        case op_t::bit_xor:
+        case op_t::bit_and:
+        case op_t::shl:
+        case op_t::shr:
+        case op_t::add:
+        case op_t::sub:
+        case op_t::mul:
+        case op_t::div:
+        case op_t::rem: {
+            stack.pop_back();
+            uint16_t& l = stack.back();
+            switch (n.op) {
+            case op_t::bit_or:
+                l = uint16_t(l | r);
+                break;
+            case op_t::bit_xor:
+                l = uint16_t(l ^ r);
+                break;
+            case op_t::bit_and:
+                l = uint16_t(l & r);
+                break;
+            case op_t::shl:
+                l = uint16_t(l << std::min(r, uint16_t(16)));
+                break;
+            case op_t::shr:
+                l = uint16_t(l >> std::min(r, uint16_t(16)));
+                break;
+            case op_t::add:
+                l = uint16_t(l + r);
+                break;
+            case op_t::sub:
+                l = uint16_t(l - r);
+                break;
+            case op_t::mul:
+                l = uint16_t(l * r);
+                break;
+            case op_t::div:
+            case op_t::rem:
+                if (r == 0)
+                    throw eval_error("Division by zero");
+                l = n.op == op_t::div ? uint16_t(l / r) : uint16_t(l % r);
+                break;
+            case op_t::constant:
+            case op_t::local:
+            case op_t::ref:
+            case op_t::bit_not:
+            case op_t::neg:
+            default:
+                std::unreachable();
+            }
+            break;
+        }
+        case op_t::bit_not:
+            stack.back() = uint16_t(~r);
+            break;
+        case op_t::neg:
+            stack.back() = uint16_t(-r);
+            break;
+        default:
+            throw eval_error("Invalid expression");
+        }
+    }
+    if (stack.size() != 1)
+        throw eval_error("Invalid expression");
+    return stack.back();
+}
+
+uint16_t linker::eval(symbol_t s)
+{
+    if (auto it = values.find(s.sym); it != values.end())
+        return it->second;
+    if (!evaluating.insert(s.sym).second)
+        throw eval_error(std::format("Cyclic definition of \"{}\" in \"{}\"", s.module->obj->str(s.sym->name),
+                                     s.module->obj->source()));
+    uint16_t v = 0;
+    try {
+        v = eval(*s.module, s.sym->expr);
+    } catch (...) {
+        evaluating.erase(s.sym); // the symbol can be evaluated again, e.g., to report another error
+        throw;
+    }
+    evaluating.erase(s.sym);
+    values.emplace(s.sym, v);
+    return v;
+}
+
+linker::symbol_t linker::find(const module_t& m, const object_file::ref_t& ref) const
+{
+    auto file = m.obj->str(ref.file);
+    auto name = m.obj->str(ref.name);
+    if (file.empty()) {
+        auto it = global_symbols.find(name);
+        if (it == global_symbols.end())
+            throw eval_error(std::format("Undefined unqualified (global) label \".{}\"", name));
+        if (it->second.size() > 1)
+            throw eval_error(std::format("Multiple definitions of unqualified value name \".{}\"", name));
+        return it->second.front();
+    }
+    if (auto it = symbols.find({file, name}); it != symbols.end())
+        return it->second;
+    if (auto it = sources.find(file); it == sources.end() || !it->second->placed)
+        throw eval_error(std::format("Module \"{}\" not linked", file));
+    throw eval_error(std::format("Undefined label \"{}\" in \"{}\"", name, file));
+}
+
+void linker::write()
+{
+    sfs::path file = sfs::path(modules.front().obj_file).replace_extension();
+    if (end_addr <= start_addr) {
+        start_addr = 0x0000;
+        end_addr = 0x0000;
+    }
+    auto code = std::span(image).subspan(start_addr, end_addr - start_addr);
+    write_file(sfs::path(file).replace_extension(".bin"), "binary output", program_bin(start_addr, code));
+    write_file(sfs::path(file).replace_extension(".mif"), "MIF output", program_mif("mb50ld", start_addr, code));
+    // Names are qualified by all namespaces of their modules, as by mb50as
+    std::map<std::string_view, std::set<std::string_view>> name_spaces{{modules.front().obj->source(), {""}}};
+    for (auto&& m: placed)
+        for (auto&& u: m->obj->uses())
+            name_spaces[m->obj->str(u.file)].insert(m->obj->str(u.name_space));
+    debug_info::writer w;
+    for (auto&& m: placed) {
+        for (auto&& l: m->obj->lines())
+            if (m->blocks[block(*m, l.addr)].live)
+                w.add_line(addr(*m, l.addr), l.size, l.level, m->obj->file(l.file), l.line);
+        for (auto&& s: m->obj->symbols())
+            try {
+                auto value = eval({m, &s});
+                auto name = m->obj->str(s.name);
+                for (auto&& ns: name_spaces[m->obj->source()])
+                    w.add_symbol(ns.empty() ? std::string(name) : std::format("{}.{}", ns, name), value, s.label);
+                if (global_symbols[name].size() == 1)
+                    w.add_symbol("."s.append(name), value, s.label);
+            } catch (const eval_error&) {
+                ; // reported for fixups, or not used
+            }
+    }
+    write_file(sfs::path(file).replace_extension(".dbg"), "debug information", w.data());
+}
+
+void linker::write_file(const sfs::path& out_file, std::string_view kind, std::string_view data) const
+{
+    if (verbose)
+        std::cerr << "Writing file \"" << out_file.string() << '"' << std::endl;
+    std::ofstream ofs(out_file, std::ios_base::binary | std::ios_base::trunc);
+    if (!ofs)
+        throw fatal_error(std::format("Cannot write {} file \"{}\"", kind, out_file.string()));
+    ofs.write(data.data(), std::streamsize(data.size()));
+    ofs.close();
+    if (!ofs)
+        throw fatal_error(std::format("Error writing {} file \"{}\"", kind, out_file.string()));
+}
+
+/*** Command line processing *************************************************/
+
+class cmdline_args: public cmdline_args_base {
+public:
+    cmdline_args(int argc, char* argv[]);
+    std::string usage();
+    [[nodiscard]] const std::vector<sfs::path>& objects() const { return _objects; }
+    [[nodiscard]] bool verbose() const { return _verbose; }
+    [[nodiscard]] bool gc() const { return _gc; }
+private:
+    std::vector<sfs::path> _objects{};
+    bool _verbose = false;
+    bool _gc = false;
+};
+
+cmdline_args::cmdline_args(int argc, char* argv[]):
+    cmdline_args_base(argc, argv)
+{
+    try {
+        size_t i = 1;
+        for (; i < args.size() && *args[i] == '-'; ++i)
+            if (args[i] == "-v"sv)
+                _verbose = true;
+            else if (args[i] == "-g"sv)
+                _gc = true;
+            else
+                throw invalid_cmdline_args{};
+        if (i == args.size())
+            throw invalid_cmdline_args{};
+        for (; i < args.size(); ++i) {
+            if (*args[i] == '-')
+                throw invalid_cmdline_args{};
+            _objects.emplace_back(args[i]);
+        }
+    } catch (const invalid_cmdline_args&) {
+        std::cerr << usage() << '\n';
+        throw;
+    }
+}
+
+std::string cmdline_args::usage()
+{
+    return cmdline_args_base::usage().append(R"([-v] [-g] program.o [object.o...]
+
+-v ... verbose output
+-g ... garbage collection, remove code and data not used by the program
+program.o ... the relocatable object of the top level file of a program
+object.o ... relocatable objects of files included by $use, objects not
+             included by the program are ignored
+
+Writes program.bin, program.mif, and program.dbg, the same as the assembler
+produces from the source files of the objects. With -g, code is shorter and
+addresses differ.
+)"sv);
+}
+
+/*** Entry point *************************************************************/
+
+int main(int argc, char* argv[])
+{
+    try {
+        cmdline_args args{argc, argv};
+        linker ld(args.objects(), args.verbose(), args.gc());
+        ld.run();
+        ld.write();
+        return EXIT_SUCCESS;
+    } catch (const fatal_error& e) {
+        std::cerr << e.what() << std::endl;
+    } catch (const silent_error&) {
+        ; // already reported
+    } catch (const std::exception& e) {
+        std::cerr << "Unhandled exception: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Unhandled unknown exception" << std::endl;
+    }
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,294 @@
+// MB50DEV runner of programs in the CPU simulator, with code coverage collection
+
+#include "mb50common.hpp"
+#include "mb50sim.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace sfs = std::filesystem;
+
+/*** Loading a program *******************************************************/
+
+// Load a binary file produced by the assembler, that is, a single line containing start address in hexadecimal
+// before binary data
+void load_program(mb5016_sim& sim, const sfs::path& file)
+{
+    std::ifstream ifs(file, std::ios::binary);
+    if (!ifs)
+        throw fatal_error(std::format("Cannot read file \"{}\"", file.string()));
+    std::string addr_s;
+    if (!std::getline(ifs, addr_s) || addr_s.empty())
+        throw fatal_error(std::format("Cannot read address from file \"{}\"", file.string()));
+    size_t addr = 0;
+    for (auto c: addr_s)
+        if (auto d = parser::digit_hex(c))
+            addr = (addr << 4U) + *d;
+        else
+            throw fatal_error(std::format("Cannot read address from file \"{}\"", file.string()));
+    for (char c; ifs.get(c); ++addr) {
+        if (addr > mb5016_sim::mem_max)
+            throw fatal_error(std::format("Program in file \"{}\" does not fit to memory", file.string()));
+        sim.mem[addr] = uint8_t(c);
+    }
+}
+
+/*** Code coverage ***********************************************************/
+
+// Mapping of instruction addresses to source lines, read from the text output
+// (.out) of the assembler. An instruction generated by a macro is attributed
+// to the line of the macro body and to the line of each macro invocation
+// enclosing it.
+class coverage {
+public:
+    explicit coverage(const sfs::path& listing);
+    // Write a report in the lcov tracefile format. A line is counted as executed if any of its instructions has
+    // been executed.
+    void write_lcov(const sfs::path& file, const mb5016_sim::coverage_t& executed);
+private:
+    // A source line
+    struct location {
+        std::string file;
+        size_t line;
+    };
+    // The source line of the current output line at a macro nesting level
+    struct context {
+        location loc;
+        // The next source line in the output is loc, not the line after loc
+        bool exact;
+    };
+    // Lines of a source file, read only when needed
+    const std::vector<std::string>& source(const std::string& file);
+    // The number of the first line after line that the assembler copies to the output, that is, a line that is
+    // not empty and is not a comment starting in the first column
+    size_t next_line(const std::string& file, size_t line);
+    std::map<std::string, std::vector<std::string>> sources;
+    // Pairs of an instruction address and a source line
+    std::vector<std::pair<uint16_t, location>> instrs;
+};
+
+coverage::coverage(const sfs::path& listing)
+{
+    std::ifstream ifs(listing);
+    if (!ifs)
+        throw fatal_error(std::format("Cannot read file \"{}\"", listing.string()));
+    // Indexed by macro nesting level
+    std::vector<context> contexts{};
+    size_t line_num = 0;
+    for (std::string line; std::getline(ifs, line);) {
+        ++line_num;
+        if (!line.starts_with("; "sv)) {
+            // A source line, the level is known from the preceding location line
+            if (contexts.empty())
+                throw fatal_error(std::format("{}:{}: Source line without location", listing.string(), line_num));
+            context& c = contexts.back();
+            if (c.exact)
+                c.exact = false;
+            else
+                c.loc.line = next_line(c.loc.file, c.loc.line);
+            continue;
+        }
+        std::string_view l = std::string_view(line).substr(2);
+        size_t indent = l.find_first_not_of(' ');
+        if (indent == std::string_view::npos)
+            continue;
+        l.remove_prefix(indent);
+        if (l.size() > 5 && l[4] == ':' && std::ranges::all_of(l.substr(0, 4), [](char c) {
+            return parser::digit_hex(c).has_value();
+        })) {
+            // Address line "; {4*level spaces}XXXX: instruction", or "XXXX: $data_b ..." for data
+            if (l.substr(5).starts_with(" $"sv))
+                continue;
+            uint16_t addr = 0;
+            for (auto c: l.substr(0, 4))
+                addr = uint16_t((addr << 4U) + *parser::digit_hex(c));
+            size_t level = std::min(indent / 4 + 1, contexts.size());
+            for (size_t i = 0; i < level; ++i)
+                instrs.emplace_back(addr, contexts[i].loc);
+            continue;
+        }
+        // Location lines, see output::add_src_location() in mb50as.cpp:
+        // level 0 "; file:line", level N>0 "; {4*N-2 spaces}file:line",
+        // entering level N "; {4*N-2 spaces}MACRO file:line",
+        // returning to level N "; {4*N+2 spaces}END_MACRO file:line"
+        size_t level = indent == 0 ? 0 : (indent + 2) / 4;
+        if (l.starts_with("MACRO "sv))
+            l.remove_prefix(6);
+        else if (l.starts_with("END_MACRO "sv)) {
+            l.remove_prefix(10);
+            level = (indent - 2) / 4;
+        }
+        size_t colon = l.rfind(':');
+        if (colon == std::string_view::npos || colon + 1 == l.size())
+            continue; // other comments, e.g., $addr
+        size_t src_line = 0;
+        if (auto [p, ec] = std::from_chars(l.data() + colon + 1, l.data() + l.size(), src_line);
+            ec != std::errc{} || p != l.data() + l.size())
+        {
+            continue;
+        }
+        contexts.resize(level + 1, {{"", 0}, false});
+        contexts.back() = {{std::string(l.substr(0, colon)), src_line}, true};
+    }
+}
+
+const std::vector<std::string>& coverage::source(const std::string& file)
+{
+    auto [it, inserted] = sources.try_emplace(file);
+    if (inserted) {
+        std::ifstream ifs(file);
+        if (!ifs)
+            throw fatal_error(std::format("Cannot read source file \"{}\"", file));
+        for (std::string line; std::getline(ifs, line);)
+            it->second.push_back(std::move(line));
+    }
+    return it->second;
+}
+
+size_t coverage::next_line(const std::string& file, size_t line)
+{
+    auto& text = source(file);
+    // Line numbers start at 1, therefore text[line] is the line after line
+    for (; line < text.size(); ++line)
+        if (auto b = text[line].find_first_not_of(whitespace_chars);
+            b != std::string::npos && text[line].front() != '#')
+        {
+            return line + 1;
+        }
+    return line + 1;
+}
+
+void coverage::write_lcov(const sfs::path& file, const mb5016_sim::coverage_t& executed)
+{
+    std::map<std::string, std::map<size_t, bool>> lines;
+    for (auto& [addr, loc]: instrs)
+        lines[loc.file][loc.line] |= executed[addr >> 1U];
+    std::ofstream ofs(file, std::ios_base::trunc);
+    if (!ofs)
+        throw fatal_error(std::format("Cannot write coverage file \"{}\"", file.string()));
+    ofs << "TN:\n";
+    for (auto& [f, l]: lines) {
+        ofs << "SF:" << f << '\n';
+        size_t hit = 0;
+        for (auto [n, e]: l) {
+            ofs << "DA:" << n << ',' << int(e) << '\n';
+            hit += e;
+        }
+        ofs << "LF:" << l.size() << "\nLH:" << hit << "\nend_of_record\n";
+    }
+    ofs.close();
+    if (!ofs)
+        throw fatal_error(std::format("Error writing coverage file \"{}\"", file.string()));
+}
+
+/*** Command line processing *************************************************/
+
+class cmdline_args: public cmdline_args_base {
+public:
+    cmdline_args(int argc, char* argv[]);
+    std::string usage();
+    [[nodiscard]] uint64_t steps() const { return _steps; }
+    [[nodiscard]] const std::optional<sfs::path>& coverage_file() const { return _coverage_file; }
+    [[nodiscard]] const sfs::path& program() const { return _program; }
+private:
+    uint64_t _steps = 100'000'000;
+    std::optional<sfs::path> _coverage_file{};
+    sfs::path _program{};
+};
+
+cmdline_args::cmdline_args(int argc, char* argv[]):
+    cmdline_args_base(argc, argv)
+{
+    try {
+        size_t i = 1;
+        for (; i + 1 < args.size(); i += 2) {
+            if (args[i] == "-n"sv) {
+                char* end = nullptr;
+                _steps = std::strtoull(args[i + 1], &end, 0);
+                if (*args[i + 1] == '\0' || *end != '\0')
+                    throw invalid_cmdline_args{};
+            } else if (args[i] == "-c"sv)
+                _coverage_file = args[i + 1];
+            else
+                break;
+        }
+        if (i + 1 != args.size() || *args[i] == '-')
+            throw invalid_cmdline_args{};
+        _program = args[i];
+    } catch (const invalid_cmdline_args&) {
+        std::cerr << usage() << '\n';
+        throw;
+    }
+}
+
+std::string cmdline_args::usage()
+{
+    return cmdline_args_base::usage().append(R"([-n steps] [-c coverage_file] program.bin
+
+-n ... maximum number of executed instructions (default 100000000)
+-c ... collect code coverage and write it to coverage_file in the lcov format,
+       the mapping to source lines is read from program.out
+program.bin ... program produced by the assembler
+
+The program is executed from the state after reset until the CPU halts,
+instruction brk is executed, or the maximum number of steps is reached.
+)"sv);
+}
+
+/*** Entry point *************************************************************/
+
+int main(int argc, char* argv[])
+{
+    try {
+        cmdline_args args{argc, argv};
+        auto sim = std::make_unique<mb5016_sim>();
+        sim->reset();
+        load_program(*sim, args.program());
+        std::unique_ptr<coverage> listing;
+        std::unique_ptr<mb5016_sim::coverage_t> executed;
+        if (args.coverage_file()) {
+            // Read the listing first, so that an invalid one is reported before running the program
+            listing = std::make_unique<coverage>(sfs::path(args.program()).replace_extension(".out"));
+            executed = std::make_unique<mb5016_sim::coverage_t>();
+            sim->coverage = executed.get();
+        }
+        auto start = std::chrono::steady_clock::now();
+        uint64_t steps = 0;
+        mb5016_sim::status_t status = sim->status();
+        while (steps < args.steps()) {
+            status = sim->step();
+            if (status.halted)
+                break;
+            ++steps;
+            if (status.breakpoint)
+                break;
+        }
+        std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+        std::cout << std::format("Executed {} steps in {:.3f} s, pc={:#06x}{}{}", steps, t.count(), status.pc,
+                                 status.halted ? " halted" : "", status.breakpoint ? " breakpoint" : "") <<
+            std::endl;
+        if (listing)
+            listing->write_lcov(*args.coverage_file(), *executed);
+        return EXIT_SUCCESS;
+    } catch (const fatal_error& e) {
+        std::cerr << e.what() << std::endl;
+    } catch (const silent_error&) {
+        ; // already reported
+    } catch (const std::exception& e) {
+        std::cerr << "Unhandled exception: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Unhandled unknown exception" << std::endl;
+    }
+    return EXIT_FAILURE;
+}
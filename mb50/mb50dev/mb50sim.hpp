@@ -0,0 +1,362 @@
+// MB50 software simulator of CPU MB5016, included by programs that execute MB50 code on the host
+// It uses the instruction set description from mb50common.hpp, which must be included first.
+
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/*** Simulator of CPU MB5016 *************************************************/
+
+// The CPU and memory of MB50. The behavior follows the VHDL implementation
+// (mb5016_cu.vhd, mb5016_alu.vhd, mb5016_registers.vhd, mb5016_csr.vhd,
+// memctl.vhd) instruction by instruction, including corner cases not defined
+// by the ISA. I/O devices are not simulated: device registers read as zero
+// and no hardware interrupts are generated.
+class mb5016_sim {
+public:
+    // The state after executing a step, the same information as in a CDI status response
+    struct status_t {
+        uint16_t pc;
+        bool halted;
+        bool breakpoint;
+    };
+    // Indices of registers with special meaning
+    static constexpr uint8_t reg_ia = 13;
+    static constexpr uint8_t reg_f = 14;
+    static constexpr uint8_t reg_pc = 15;
+    // Bits of register f
+    static constexpr uint16_t flag_z = 1U << 4U;
+    static constexpr uint16_t flag_c = 1U << 5U;
+    static constexpr uint16_t flag_s = 1U << 6U;
+    static constexpr uint16_t flag_o = 1U << 7U;
+    static constexpr uint16_t flag_ie = 1U << 8U;
+    static constexpr uint16_t flag_exc = 1U << 9U;
+    static constexpr uint16_t flag_iexc = 1U << 10U;
+    // Bits of register f set by ALU operations
+    static constexpr uint16_t flags_alu = flag_z | flag_c | flag_s | flag_o;
+    // Exception and interrupt bits of register f
+    static constexpr uint16_t flags_irq = 0xfe00;
+    // Bit H of csr0 and exception reasons, correspond to OpConstExc* in mb5016_alu.vhd
+    static constexpr uint16_t csr0_h = 0x0100;
+    static constexpr uint16_t exc_izero = 0x01;
+    static constexpr uint16_t exc_iinstr = 0x02;
+    // Number of implemented CSRs (csr0...csr3)
+    static constexpr uint8_t csr_num = 4;
+    // Address of the last byte of memory, corresponds to MEM_MAX in sys_params.vhd
+    static constexpr uint16_t mem_max = 0x752f;
+    // Set the CPU and memory to the state after reset
+    void reset();
+    // Execute a single instruction, with the same effect as a CDI step request
+    status_t step();
+    [[nodiscard]] status_t status() const { return {r[reg_pc], halted, breakpoint}; }
+    [[nodiscard]] uint8_t mem_read(uint16_t addr) const { return addr <= mem_max ? mem[addr] : 0; }
+    void mem_write(uint16_t addr, uint8_t v) {
+        if (addr <= mem_max) {
+            mem[addr] = v;
+            if (write_log)
+                write_log->push_back(addr);
+        }
+    }
+    [[nodiscard]] uint16_t csr_read(uint8_t idx) const { return idx < csr_num ? csr[idx] : 0; }
+    // Writing bit H of csr0 is enabled only for the CPU itself and for the CDI
+    void csr_write(uint8_t idx, uint16_t v, bool ena_h = true);
+    // Registers r0...r15
+    std::array<uint16_t, 16> r{};
+    // Registers csr0...csr3, other CSRs are not implemented
+    std::array<uint16_t, csr_num> csr{};
+    // Memory, only addresses up to mem_max are used
+    std::array<uint8_t, 0x10000> mem{};
+    // The CPU is in the halted state (an exception with disabled interrupts)
+    bool halted = false;
+    // The last instruction was brk
+    bool breakpoint = false;
+    // If not null, addresses of all memory writes are appended, so that memory can be restored without copying it
+    std::vector<uint16_t>* write_log = nullptr;
+    // Bitmap of executed instructions, indexed by address / 2
+    using coverage_t = std::bitset<0x8000>;
+    // If not null, the address of each executed instruction is recorded for code coverage
+    coverage_t* coverage = nullptr;
+private:
+    // Result of an ALU operation, corresponds to output_t in mb5016_alu.vhd
+    struct alu_t {
+        uint16_t a;
+        uint16_t b;
+        uint16_t flags;
+    };
+    static alu_t alu(uint8_t opcode, uint16_t a, uint16_t b);
+    void load(uint8_t dst, uint8_t src, bool word);
+    void store(uint8_t dst, uint8_t src, bool word);
+    void exception(uint16_t reason);
+};
+
+void mb5016_sim::reset()
+{
+    r.fill(0);
+    csr.fill(0);
+    mem.fill(0);
+    halted = false;
+    breakpoint = false;
+}
+
+mb5016_sim::status_t mb5016_sim::step()
+{
+    uint16_t& f = r[reg_f];
+    uint16_t& pc = r[reg_pc];
+    if ((f & flag_ie) != 0 && (f & flags_irq) != 0) {
+        // Call the interrupt handler and execute its first instruction in the same step
+        std::swap(r[reg_ia], pc);
+        f &= uint16_t(~flag_ie);
+        if ((f & flag_exc) != 0)
+            f = uint16_t((f & ~flag_exc) | flag_iexc);
+    } else if ((f & flag_ie) == 0 && (f & flag_exc) != 0) {
+        halted = true;
+        return status();
+    }
+    halted = false;
+    breakpoint = false;
+    // Testing before setting avoids a memory write per step once a loop has been recorded
+    if (coverage && !(*coverage)[pc >> 1U])
+        (*coverage)[pc >> 1U] = true;
+    uint8_t opcode = mem_read(pc++);
+    uint8_t regs = mem_read(pc++);
+    auto dst = uint8_t(regs >> 4U);
+    auto src = uint8_t(regs & 0x0fU);
+    bool cond = true;
+    uint8_t op = opcode;
+    if ((opcode & 0x80U) != 0) {
+        cond = ((f >> (opcode & 0x07U)) & 1U) == ((opcode >> 3U) & 1U);
+        op = uint8_t(opcode & 0xf0U);
+    }
+    switch (op) {
+    case isa::opcode("ill"):
+        exception(exc_izero);
+        break;
+    case isa::opcode("csrr"):
+        r[dst] = csr_read(src);
+        break;
+    case isa::opcode("csrw"):
+        csr_write(dst, r[src], false);
+        break;
+    case isa::opcode("exch"):
+        std::swap(r[dst], r[src]);
+        break;
+    case isa::opcode("ld"):
+    case isa::cond_ld: // ldnf
+        if (cond)
+            load(dst, src, true);
+        break;
+    case isa::opcode("ldb"):
+        load(dst, src, false);
+        break;
+    case isa::opcode("ldis"):
+        load(dst, src, true);
+        r[src] = uint16_t(r[src] + 2);
+        break;
+    case isa::cond_ldis: // ldnfis
+        if (cond)
+            load(dst, src, true);
+        else
+            r[src] = uint16_t(r[src] + 2);
+        break;
+    case isa::opcode("mv"):
+    case isa::cond_mv: // mvnf
+        if (cond)
+            r[dst] = r[src];
+        break;
+    case isa::opcode("sto"):
+        store(dst, src, true);
+        break;
+    case isa::opcode("stob"):
+        store(dst, src, false);
+        break;
+    case isa::opcode("ddsto"):
+        r[dst] = uint16_t(r[dst] - 2);
+        store(dst, src, true);
+        break;
+    case isa::opcode("reti"):
+        f |= flag_ie;
+        pc = r[reg_ia];
+        r[reg_ia] = csr[1];
+        csr[0] = 0;
+        break;
+    case isa::opcode("brk"):
+        breakpoint = true;
+        break;
+    case isa::opcode("cmpu"):
+    case isa::opcode("cmps"):
+        f = uint16_t((f & ~flags_alu) | alu(op, r[dst], r[src]).flags);
+        break;
+    case isa::opcode("add"):
+    case isa::opcode("and"):
+    case isa::opcode("dec1"):
+    case isa::opcode("dec2"):
+    case isa::opcode("inc1"):
+    case isa::opcode("inc2"):
+    case isa::opcode("not"):
+    case isa::opcode("or"):
+    case isa::opcode("shl"):
+    case isa::opcode("shr"):
+    case isa::opcode("shra"):
+    case isa::opcode("sub"):
+    case isa::opcode("xor"):
+    case isa::opcode("rev"):
+        {
+            auto res = alu(op, r[dst], r[src]);
+            f = uint16_t((f & ~flags_alu) | res.flags);
+            r[dst] = res.a;
+        }
+        break;
+    case isa::opcode("mulss"):
+    case isa::opcode("mulsu"):
+    case isa::opcode("mulus"):
+    case isa::opcode("muluu"):
+        {
+            auto res = alu(op, r[dst], r[src]);
+            f = uint16_t((f & ~flags_alu) | res.flags);
+            r[src] = res.b;
+            r[dst] = res.a; // wins if dst == src
+        }
+        break;
+    default: // including not implemented ldisx, neg, exchnf, ldxnfis
+        exception(exc_iinstr);
+        break;
+    }
+    return status();
+}
+
+void mb5016_sim::csr_write(uint8_t idx, uint16_t v, bool ena_h)
+{
+    if (idx == 0)
+        csr[0] = uint16_t((ena_h ? v & csr0_h : 0) | (v & 0xffU));
+    else if (idx < csr_num)
+        csr[idx] = v;
+}
+
+mb5016_sim::alu_t mb5016_sim::alu(uint8_t opcode, uint16_t a, uint16_t b)
+{
+    constexpr uint16_t hi = 0x8000;
+    uint16_t res = 0;
+    bool c = false;
+    bool o = false;
+    auto mul = [](int32_t v, bool carry, bool overflow) {
+        auto lo = uint16_t(uint32_t(v) & 0xffffU);
+        auto up = uint16_t(uint32_t(v) >> 16U);
+        return alu_t{lo, up, uint16_t((v == 0 ? flag_z : 0) | (carry ? flag_c : 0) | (v < 0 ? flag_s : 0) |
+                                      (overflow ? flag_o : 0))};
+    };
+    auto mul_signed = [&mul](int32_t v) {
+        return mul(v, v < 0 ? (uint32_t(v) >> 16U) != 0xffffU : (uint32_t(v) >> 16U) != 0, v < -0x8000 || v > 0x7fff);
+    };
+    switch (opcode) {
+    case isa::opcode("add"):
+        res = uint16_t(a + b);
+        c = uint32_t(a) + uint32_t(b) > 0xffffU;
+        o = (res & hi) != (a & hi) && (res & hi) != (b & hi);
+        break;
+    case isa::opcode("and"):
+        res = uint16_t(a & b);
+        break;
+    case isa::opcode("dec1"):
+        res = uint16_t(b - 1);
+        c = res == 0xffff;
+        o = res == 0x7fff;
+        break;
+    case isa::opcode("dec2"):
+        res = uint16_t(b - 2);
+        c = res == 0xffff || res == 0xfffe;
+        o = res == 0x7fff || res == 0x7ffe;
+        break;
+    case isa::opcode("inc1"):
+        res = uint16_t(b + 1);
+        c = b == 0xffff;
+        o = b == 0x7fff;
+        break;
+    case isa::opcode("inc2"):
+        res = uint16_t(b + 2);
+        c = b == 0xffff || b == 0xfffe;
+        o = b == 0x7fff || b == 0x7ffe;
+        break;
+    case isa::opcode("not"):
+        res = uint16_t(~b);
+        break;
+    case isa::opcode("or"):
+        res = uint16_t(a | b);
+        break;
+    case isa::opcode("shl"):
+        res = uint16_t(a << (b & 0x0fU));
+        c = (a & hi) != 0;
+        o = (res & hi) != (a & hi);
+        break;
+    case isa::opcode("shr"):
+        res = uint16_t(a >> (b & 0x0fU));
+        c = (a & 1U) != 0;
+        o = (res & hi) != (a & hi);
+        break;
+    case isa::opcode("shra"):
+        res = uint16_t(int16_t(a) >> (b & 0x0fU));
+        c = (a & 1U) != 0;
+        o = (b & 0x0fU) != 0 && a == 0xffff;
+        break;
+    case isa::opcode("sub"):
+        res = uint16_t(a - b);
+        c = a < b;
+        o = (res & hi) != (a & hi) && (res & hi) == (b & hi);
+        break;
+    case isa::opcode("cmpu"):
+    case isa::opcode("cmps"):
+        {
+            bool eq = a == b;
+            bool lt = opcode == isa::opcode("cmpu") ? a < b : int16_t(a) < int16_t(b);
+            return {a, b, uint16_t((eq ? flag_z : 0) | (lt || eq ? flag_c : 0) | (lt ? flag_s : 0))};
+        }
+    case isa::opcode("xor"):
+        res = uint16_t(a ^ b);
+        break;
+    case isa::opcode("rev"):
+        for (unsigned i = 0; i < 16; ++i)
+            if ((b & (1U << i)) != 0)
+                res |= uint16_t(hi >> i);
+        break;
+    case isa::opcode("mulss"):
+        return mul_signed(int32_t(int16_t(a)) * int32_t(int16_t(b)));
+    case isa::opcode("mulsu"):
+        return mul_signed(int32_t(int16_t(a)) * int32_t(b));
+    case isa::opcode("mulus"):
+        return mul_signed(int32_t(a) * int32_t(int16_t(b)));
+    case isa::opcode("muluu"):
+        {
+            uint32_t v = uint32_t(a) * uint32_t(b);
+            auto res_mul = mul(int32_t(v), (v >> 16U) != 0, v > 0x7fffU);
+            res_mul.flags &= uint16_t(~flag_s);
+            return res_mul;
+        }
+    default:
+        break;
+    }
+    return {res, b, uint16_t((res == 0 ? flag_z : 0) | (c ? flag_c : 0) | ((res & hi) != 0 ? flag_s : 0) |
+                             (o ? flag_o : 0))};
+}
+
+void mb5016_sim::load(uint8_t dst, uint8_t src, bool word)
+{
+    // The address of the second byte is computed before the first byte is stored to dst
+    uint16_t addr = r[src];
+    r[dst] = uint16_t((r[dst] & 0xff00U) | mem_read(addr));
+    if (word)
+        r[dst] = uint16_t((r[dst] & 0x00ffU) | (mem_read(uint16_t(addr + 1)) << 8U));
+}
+
+void mb5016_sim::store(uint8_t dst, uint8_t src, bool word)
+{
+    mem_write(r[dst], uint8_t(r[src] & 0xffU));
+    if (word)
+        mem_write(uint16_t(r[dst] + 1), uint8_t(r[src] >> 8U));
+}
+
+void mb5016_sim::exception(uint16_t reason)
+{
+    csr_write(0, csr0_h | reason);
+    r[reg_f] |= flag_exc;
+}
@@ -33,6 +33,10 @@ $const _LED_STATE, 1 # sending new LED state
 
 _led_send_state: $data_b _LED_NONE
 
+# The maximum rate of bytes received from the keyboard: 16.7 kHz PS/2 clock,
+# 11 bits per byte
+$const KBD_BYTE_HZ, 1518
+
 # Keyboard state.
 # State of modifiers in the upper byte.
 # The last entered character in the lower byte:
@@ -186,6 +190,9 @@ shr r1, r10
 
 ### The keyboard interrupt handler ############################################
 
+# The handler jumps to its beginning at most once, when it starts sending LED
+# state to the keyboard
+$loop_bound 2
 dev_kbd_intr_hnd:
  # Handle sending LED state
 .set r10, _led_send_state # r10 = _led_send_state
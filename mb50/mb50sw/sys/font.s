@@ -3,6 +3,8 @@
 # This file contains 8x8 pixel bitmaps of printable ASCII characters (codes
 # 0x20 to 0x7e)
 
+$use macros, macros.s
+
 # Do not execute any code in this file.
 .jmp _skip_this_file
 
@@ -17,14 +17,20 @@ $use dev_kbd, dev_kbd.s
 # registers, but must not enable interrupts or clear pending interrupt bits in
 # register f. This implies that push/pop pair for register f is forbidden in an
 # interrupt handler.
+# The handlers installed by intr_init are declared by $targets for the worst
+# case execution time analysis of intr_hnd. The exception handler is not
+# declared, because an exception is not a real-time event, hence it is excluded
+# from the analysis.
 
 # Handler for interrupt bit exc (E, exception)
 addr_intr_hnd_iexc: $data_w 0x0000
 
 # Handler for interrupt bit iclk (C, system clock)
+$targets .dev_clk_intr_hnd
 addr_intr_hnd_iclk: $data_w 0x0000
 
 # Handler for interrupt bit ikbd (K keyboard)
+$targets .dev_kbd_intr_hnd
 addr_intr_hnd_ikbd: $data_w 0x0000
 
 # The main interrupt handler
@@ -41,6 +47,9 @@ $end_macro
 # Variant of the interrupt handler that saves registers to the stack.
 $macro _intr_hnd_stack
     intr_hnd:
+    # Handle each clock tick and each byte from the keyboard before the next one
+    $intr_deadline .HZ
+    $intr_deadline .KBD_BYTE_HZ
     .save_all
     _handle_intr_bit .FLAG_BIT_IEXC, addr_intr_hnd_iexc
     _handle_intr_bit .FLAG_BIT_ICLK, addr_intr_hnd_iclk
@@ -54,6 +63,9 @@ $macro _intr_hnd_mem
     _intr_reg_begin: $addr _intr_reg_begin + 14 * 2
     _intr_reg_end:
     intr_hnd:
+    # Handle each clock tick and each byte from the keyboard before the next one
+    $intr_deadline .HZ
+    $intr_deadline .KBD_BYTE_HZ
     .mem_save_all_intr _intr_reg_end
     _handle_intr_bit .FLAG_BIT_IEXC, addr_intr_hnd_iexc
     _handle_intr_bit .FLAG_BIT_ICLK, addr_intr_hnd_iclk